@@ -0,0 +1,278 @@
+// p2p.cpp
+// libp2pcore: C++17 interface over the C library
+
+#include "p2p.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace p2p {
+
+namespace {
+
+// How long a FileServer waits on a silent client
+constexpr int SERVE_TIMEOUT_SECS = 5;
+
+[[noreturn]] void throw_errno(const char *what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+void check(int rc) {
+  if (rc != P2P_OK)
+    throw Error(rc);
+}
+
+int deliver_chunk(void *ctx, const void *data, size_t len) {
+  auto *chunk = static_cast<std::function<bool(const void *, size_t)> *>(ctx);
+  return (*chunk)(data, len) ? 0 : 1;
+}
+
+} // namespace
+
+Error::Error(int code) : std::runtime_error(p2p_strerror(code)), code_(code) {}
+
+Fd &Fd::operator=(Fd &&other) noexcept {
+  if (this != &other) {
+    if (fd_ != -1)
+      p2p_close(fd_);
+    fd_ = other.release();
+  }
+  return *this;
+}
+
+Fd::~Fd() {
+  if (fd_ != -1)
+    p2p_close(fd_);
+}
+
+int Fd::release() noexcept {
+  int fd = fd_;
+  fd_ = -1;
+  return fd;
+}
+
+// ---- Registry ----
+
+struct Registry::Conn {
+  Fd sock;
+  std::mutex lock; // one request in flight at a time
+};
+
+Registry::Registry(const std::string &host, const std::string &port, uint16_t local_port)
+    : conn_(std::make_shared<Conn>()) {
+  int fd = p2p_connect(host.c_str(), port.c_str(), local_port);
+  if (fd == -1)
+    throw_errno("connect to registry");
+  conn_->sock = Fd(fd);
+}
+
+void Registry::join(uint32_t peer_id) {
+  std::lock_guard<std::mutex> guard(conn_->lock);
+  check(p2p_join(conn_->sock.get(), peer_id));
+}
+
+void Registry::publish(const std::vector<std::string> &names) {
+  std::vector<const char *> list;
+  list.reserve(names.size());
+  for (const auto &name : names)
+    list.push_back(name.c_str());
+
+  std::lock_guard<std::mutex> guard(conn_->lock);
+  check(p2p_publish(conn_->sock.get(), list.data(), static_cast<uint32_t>(list.size())));
+}
+
+void Registry::publish(const std::vector<File> &files) {
+  std::vector<const char *> list;
+  std::vector<p2p_file_attrs> attrs;
+  list.reserve(files.size());
+  attrs.reserve(files.size());
+  for (const auto &file : files) {
+    list.push_back(file.name.c_str());
+    attrs.push_back(file.attrs);
+  }
+
+  std::lock_guard<std::mutex> guard(conn_->lock);
+  check(p2p_publish_attrs(conn_->sock.get(), list.data(), attrs.data(),
+                          static_cast<uint32_t>(list.size())));
+}
+
+std::future<std::optional<Location>> Registry::search(std::string name) {
+  return std::async(std::launch::async,
+                    [conn = conn_, name = std::move(name)]() -> std::optional<Location> {
+                      p2p_location loc;
+                      {
+                        std::lock_guard<std::mutex> guard(conn->lock);
+                        check(p2p_search(conn->sock.get(), name.c_str(), &loc));
+                      }
+                      if (!p2p_location_found(&loc))
+                        return std::nullopt;
+
+                      char ip[INET_ADDRSTRLEN];
+                      inet_ntop(AF_INET, &loc.ip, ip, sizeof(ip));
+                      return Location{loc.id, ip, loc.port, name};
+                    });
+}
+
+std::future<std::optional<Location>> Registry::search(std::string name,
+                                                      const p2p_search_filter &filter) {
+  return std::async(std::launch::async,
+                    [conn = conn_, name = std::move(name),
+                     filter]() -> std::optional<Location> {
+                      p2p_location loc;
+                      p2p_file_attrs attrs;
+                      char found[P2P_MAX_NAME];
+                      {
+                        std::lock_guard<std::mutex> guard(conn->lock);
+                        check(p2p_search_filtered(conn->sock.get(), name.c_str(), &filter,
+                                                  &loc, &attrs, found));
+                      }
+                      if (!p2p_location_found(&loc))
+                        return std::nullopt;
+
+                      char ip[INET_ADDRSTRLEN];
+                      inet_ntop(AF_INET, &loc.ip, ip, sizeof(ip));
+                      return Location{loc.id, ip, loc.port, found, attrs};
+                    });
+}
+
+// ---- Peer ----
+
+Peer::Peer(std::string host, std::string port)
+    : host_(std::move(host)), port_(std::move(port)) {}
+
+Peer::Peer(const Location &where) : host_(where.host), port_(std::to_string(where.port)) {}
+
+std::future<size_t> Peer::fetch(std::string name, int fd) const {
+  return std::async(std::launch::async, [host = host_, port = port_, name = std::move(name), fd] {
+    p2p_sink sink = p2p_fd_sink(fd);
+    size_t received = 0;
+    check(p2p_fetch(host.c_str(), port.c_str(), name.c_str(), &sink, &received));
+    return received;
+  });
+}
+
+std::future<size_t> Peer::fetch(std::string name, std::string path) const {
+  return std::async(std::launch::async, [host = host_, port = port_, name = std::move(name),
+                                         path = std::move(path)] {
+    std::string part = path + ".part";
+    Fd fd(open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (!fd)
+      throw_errno("open");
+
+    p2p_sink sink = p2p_fd_sink(fd.get());
+    size_t received = 0;
+    int rc = p2p_fetch(host.c_str(), port.c_str(), name.c_str(), &sink, &received);
+    if (close(fd.release()) == -1 && rc == P2P_OK)
+      rc = P2P_ESINK;
+    if (rc == P2P_OK && rename(part.c_str(), path.c_str()) == -1)
+      rc = P2P_ESINK;
+    if (rc != P2P_OK) {
+      unlink(part.c_str());
+      throw Error(rc);
+    }
+    return received;
+  });
+}
+
+std::future<size_t> Peer::fetch(std::string name,
+                                std::function<bool(const void *, size_t)> chunk) const {
+  return std::async(std::launch::async, [host = host_, port = port_, name = std::move(name),
+                                         chunk = std::move(chunk)]() mutable {
+    p2p_sink sink = p2p_callback_sink(deliver_chunk, &chunk);
+    size_t received = 0;
+    check(p2p_fetch(host.c_str(), port.c_str(), name.c_str(), &sink, &received));
+    return received;
+  });
+}
+
+// ---- Server ----
+
+p2p_registry_options Server::defaults() {
+  p2p_registry_options opts;
+  p2p_registry_default_options(&opts);
+  return opts;
+}
+
+Server::Server(const p2p_registry_options &opts) {
+  int port = p2p_registry_open(&opts);
+  if (port < 0)
+    throw std::runtime_error("registry failed to open");
+  port_ = static_cast<uint16_t>(port);
+  thread_ = std::thread(p2p_registry_run);
+}
+
+Server::~Server() {
+  p2p_registry_stop();
+  thread_.join();
+}
+
+// ---- FileServer ----
+
+FileServer::FileServer(std::string root, uint16_t port, unsigned workers)
+    : root_(std::move(root)), workers_(workers > 0 ? workers : 1) {
+  std::vector<int> cpus(workers_.size());
+  int ncpus = workers_.size() > 1 ? p2p_allowed_cpus(cpus.data(), static_cast<int>(cpus.size())) : 0;
+
+  // Every listener must be in the port's group before any worker runs
+  for (size_t i = 0; i < workers_.size(); i++) {
+    workers_[i].listen_fd = Fd(p2p_listen(i == 0 ? port : port_, 64, &port_));
+    if (!workers_[i].listen_fd)
+      throw_errno("listen");
+    if (ncpus > 0)
+      workers_[i].cpu = cpus[i % ncpus];
+  }
+  stop_fd_ = Fd(eventfd(0, EFD_CLOEXEC));
+  if (!stop_fd_)
+    throw_errno("eventfd");
+  for (auto &worker : workers_)
+    worker.thread = std::thread(&FileServer::serve, this, std::ref(worker));
+}
+
+FileServer::~FileServer() {
+  uint64_t one = 1;
+  if (write(stop_fd_.get(), &one, sizeof(one)) == -1)
+    std::perror("write stop");
+  for (auto &worker : workers_)
+    worker.thread.join();
+}
+
+void FileServer::serve(Worker &worker) {
+  // Pinned before serving, so what the worker allocates is on its node
+  if (worker.cpu >= 0 &&
+      (p2p_pin_cpu(worker.cpu) == -1 || p2p_steer_cpu(worker.listen_fd.get(), worker.cpu) == -1))
+    std::perror("pin FETCH worker");
+
+  for (;;) {
+    pollfd fds[2] = {{worker.listen_fd.get(), POLLIN, 0}, {stop_fd_.get(), POLLIN, 0}};
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      std::perror("poll");
+      return;
+    }
+    if (fds[1].revents)
+      return;
+
+    Fd client(accept4(worker.listen_fd.get(), nullptr, nullptr, SOCK_CLOEXEC));
+    if (!client)
+      continue;
+    p2p_net_tune(client.get(), P2P_NET_BULK);
+    timeval timeout = {SERVE_TIMEOUT_SECS, 0};
+    setsockopt(client.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (p2p_tls_enabled() && p2p_tls_server(client.get()) != P2P_OK)
+      continue;
+    size_t sent;
+    p2p_serve_fetch(client.get(), root_.c_str(), &sent);
+  }
+}
+
+} // namespace p2p
@@ -0,0 +1,166 @@
+// p2p.hpp
+// libp2pcore: C++17 interface for embedding registries, registry clients
+// and FETCH servers in other programs. Everything owns its sockets and
+// threads and releases them on destruction. Failures throw p2p::Error,
+// or std::system_error for the underlying system calls.
+
+#ifndef P2P_HPP
+#define P2P_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "p2p_client.h"
+#include "p2p_cpu.h"
+#include "p2p_net.h"
+#include "p2p_registry.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+namespace p2p {
+
+// A libp2pcore result code other than P2P_OK
+class Error : public std::runtime_error {
+public:
+  explicit Error(int code);
+  int code() const noexcept { return code_; }
+
+private:
+  int code_;
+};
+
+// Owns one descriptor
+class Fd {
+public:
+  Fd() = default;
+  explicit Fd(int fd) : fd_(fd) {}
+  Fd(Fd &&other) noexcept : fd_(other.release()) {}
+  Fd &operator=(Fd &&other) noexcept;
+  Fd(const Fd &) = delete;
+  Fd &operator=(const Fd &) = delete;
+  ~Fd();
+
+  int get() const noexcept { return fd_; }
+  int release() noexcept;
+  explicit operator bool() const noexcept { return fd_ != -1; }
+
+private:
+  int fd_ = -1;
+};
+
+// A peer serving a file, as SEARCH reports it
+struct Location {
+  uint32_t peer_id;
+  std::string host; // dotted IPv4
+  uint16_t port;
+  std::string name;         // what to FETCH from it
+  p2p_file_attrs attrs{};   // as published; zero from a plain SEARCH
+};
+
+// A file to PUBLISH along with its attributes
+struct File {
+  std::string name;
+  p2p_file_attrs attrs;
+};
+
+// Connection to a registry. Requests from any thread are sent one at a
+// time; the futures stay valid after the Registry is gone.
+class Registry {
+public:
+  // Connect to host:port, from local_port when it is not 0 so that a
+  // FileServer on that port becomes the address the registry hands out
+  Registry(const std::string &host, const std::string &port, uint16_t local_port = 0);
+
+  void join(uint32_t peer_id);
+  void publish(const std::vector<std::string> &names);
+  void publish(const std::vector<File> &files);
+
+  // Who serves name, or nothing if no peer does
+  std::future<std::optional<Location>> search(std::string name);
+
+  // Who serves a copy of name that passes filter; with P2P_FILTER_DIGEST
+  // and an empty name, who serves that content under any name
+  std::future<std::optional<Location>> search(std::string name,
+                                              const p2p_search_filter &filter);
+
+private:
+  struct Conn;
+  std::shared_ptr<Conn> conn_;
+};
+
+// A peer to download from
+class Peer {
+public:
+  Peer(std::string host, std::string port);
+  explicit Peer(const Location &where);
+
+  // Each resolves to the number of bytes delivered. A path is written
+  // through "<path>.part" so a failed fetch leaves an old copy alone; a
+  // descriptor is written as the data arrives and stays open; a callback
+  // returning false aborts the transfer.
+  std::future<size_t> fetch(std::string name, int fd) const;
+  std::future<size_t> fetch(std::string name, std::string path) const;
+  std::future<size_t> fetch(std::string name,
+                            std::function<bool(const void *, size_t)> chunk) const;
+
+private:
+  std::string host_, port_;
+};
+
+// The registry, hosted on a thread of this process. Only one can exist
+// at a time.
+class Server {
+public:
+  static p2p_registry_options defaults();
+
+  explicit Server(const p2p_registry_options &opts = defaults());
+  ~Server(); // stops and joins the thread
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  uint16_t port() const noexcept { return port_; }
+
+private:
+  uint16_t port_;
+  std::thread thread_;
+};
+
+// Answers FETCH for the files under root, one connection at a time per
+// worker. With more than one worker, each is pinned to one of the CPUs
+// this thread may use and has its own SO_REUSEPORT listener on the
+// port, which the kernel prefers for connections arriving on that CPU.
+class FileServer {
+public:
+  explicit FileServer(std::string root, uint16_t port = 0, unsigned workers = 1);
+  ~FileServer(); // stops and joins the threads
+  FileServer(const FileServer &) = delete;
+  FileServer &operator=(const FileServer &) = delete;
+
+  uint16_t port() const noexcept { return port_; }
+
+private:
+  struct Worker {
+    Fd listen_fd;
+    int cpu = -1; // -1: not pinned
+    std::thread thread;
+  };
+
+  void serve(Worker &worker);
+
+  std::string root_;
+  uint16_t port_ = 0;
+  Fd stop_fd_;
+  std::vector<Worker> workers_;
+};
+
+} // namespace p2p
+
+#endif
@@ -0,0 +1,423 @@
+// p2p_client.c
+// libp2pcore: talking to a registry and serving FETCH
+
+#define _GNU_SOURCE
+#include "p2p_client.h"
+#include "p2p_delta.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVE_CHUNK (64 * 1024)
+
+int p2p_join(int sock, uint32_t id) {
+  uint8_t msg[5];
+  size_t len = p2p_encode_join(msg, id);
+  return p2p_send_all(sock, msg, len) == 0 ? P2P_OK : P2P_EPROTO;
+}
+
+// PUBLISH and PUBLISH ATTRS; attrs is NULL for the first
+static int send_publish(int sock, const char *const *names,
+                        const struct p2p_file_attrs *attrs, uint32_t count) {
+  size_t cap = 5;
+  size_t per_file = attrs ? P2P_ATTRS_LEN : 0;
+  for (uint32_t i = 0; i < count; i++) {
+    size_t len = strlen(names[i]) + 1;
+    if (len > P2P_MAX_NAME)
+      return P2P_EPROTO;
+    cap += per_file + len;
+  }
+
+  uint8_t *msg = malloc(cap);
+  if (!msg)
+    return P2P_EPROTO;
+  uint32_t count_net = htonl(count);
+  size_t used = 5;
+  msg[0] = attrs ? P2P_MSG_PUBLISH_ATTRS : P2P_MSG_PUBLISH;
+  memcpy(msg + 1, &count_net, 4);
+  for (uint32_t i = 0; i < count; i++) {
+    size_t len = strlen(names[i]) + 1;
+    if (attrs) {
+      p2p_encode_attrs(msg + used, &attrs[i]);
+      used += P2P_ATTRS_LEN;
+    }
+    memcpy(msg + used, names[i], len);
+    used += len;
+  }
+
+  int rc = p2p_send_all(sock, msg, used) == 0 ? P2P_OK : P2P_EPROTO;
+  free(msg);
+  return rc;
+}
+
+int p2p_publish(int sock, const char *const *names, uint32_t count) {
+  return send_publish(sock, names, NULL, count);
+}
+
+int p2p_publish_attrs(int sock, const char *const *names,
+                      const struct p2p_file_attrs *attrs, uint32_t count) {
+  return send_publish(sock, names, attrs, count);
+}
+
+int p2p_search(int sock, const char *name, struct p2p_location *loc) {
+  uint8_t req[1 + P2P_MAX_NAME];
+  uint8_t reply[P2P_SEARCH_REPLY_LEN];
+  size_t len = p2p_encode_request(req, sizeof(req), P2P_MSG_SEARCH, name);
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_SEARCH);
+  int rc = P2P_OK;
+
+  if (len == 0 || p2p_send_all(sock, req, len) != 0) {
+    rc = P2P_EPROTO;
+  } else {
+    P2P_TRACE(trace, P2P_TRACE_SENT, 0);
+    if (p2p_recv_all(sock, reply, sizeof(reply)) != 0)
+      rc = P2P_ERECV;
+    else
+      p2p_decode_location(reply, loc);
+  }
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
+
+static int search_filtered(int sock, const char *name, const struct p2p_search_filter *filter,
+                           struct p2p_location *loc, struct p2p_file_attrs *attrs,
+                           char *found_name, uint64_t trace) {
+  uint8_t req[1 + P2P_FILTER_LEN + P2P_MAX_NAME];
+  uint8_t reply[P2P_FILTER_REPLY_LEN];
+  char name_buf[P2P_MAX_NAME];
+  size_t name_len = strlen(name);
+
+  if (name_len + 1 > P2P_MAX_NAME)
+    return P2P_EPROTO;
+  req[0] = P2P_MSG_SEARCH_FILTER;
+  p2p_encode_filter(req + 1, filter);
+  memcpy(req + 1 + P2P_FILTER_LEN, name, name_len + 1);
+
+  if (p2p_send_all(sock, req, 2 + P2P_FILTER_LEN + name_len) != 0)
+    return P2P_EPROTO;
+  P2P_TRACE(trace, P2P_TRACE_SENT, 0);
+  if (p2p_recv_all(sock, reply, sizeof(reply)) != 0)
+    return P2P_ERECV;
+  // Then the name the holder has it under, up to its NUL
+  size_t got = 0;
+  do {
+    if (got == sizeof(name_buf) || p2p_recv_all(sock, name_buf + got, 1) != 0)
+      return P2P_ERECV;
+  } while (name_buf[got++] != '\0');
+
+  p2p_decode_location(reply, loc);
+  p2p_decode_attrs(reply + P2P_SEARCH_REPLY_LEN, attrs);
+  if (found_name)
+    memcpy(found_name, name_buf, got);
+  return P2P_OK;
+}
+
+int p2p_search_filtered(int sock, const char *name, const struct p2p_search_filter *filter,
+                        struct p2p_location *loc, struct p2p_file_attrs *attrs,
+                        char *found_name) {
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_SEARCH);
+  int rc = search_filtered(sock, name, filter, loc, attrs, found_name, trace);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
+
+static int search_udp(int sock, uint32_t req_id, const char *name, int tries,
+                      int timeout_ms, struct p2p_location *loc, uint64_t trace) {
+  uint8_t req[5 + P2P_MAX_NAME];
+  size_t name_len = strlen(name);
+  uint32_t id_net = htonl(req_id);
+
+  if (name_len + 1 > P2P_MAX_NAME)
+    return P2P_EPROTO;
+  req[0] = P2P_MSG_SEARCH;
+  memcpy(req + 1, &id_net, 4);
+  memcpy(req + 5, name, name_len + 1);
+
+  for (int attempt = 0; attempt < tries; attempt++, timeout_ms *= 2) {
+    if (send(sock, req, 6 + name_len, 0) == -1)
+      return P2P_EPROTO;
+    P2P_TRACE(trace, P2P_TRACE_SENT, attempt + 1);
+
+    double deadline = p2p_monotonic_secs() + timeout_ms / 1000.0;
+    for (;;) {
+      int left = (int)((deadline - p2p_monotonic_secs()) * 1000);
+      if (left <= 0)
+        break;
+      struct pollfd pfd = {.fd = sock, .events = POLLIN};
+      int rc = poll(&pfd, 1, left);
+      if (rc == -1 && errno == EINTR)
+        continue;
+      if (rc <= 0)
+        break;
+
+      uint8_t reply[P2P_UDP_SEARCH_REPLY_LEN];
+      ssize_t n = recv(sock, reply, sizeof(reply), 0);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        return P2P_EPROTO; // e.g. ECONNREFUSED: no UDP endpoint there
+      }
+      // Replies to earlier tries or searches carry other ids
+      if (n != sizeof(reply) || reply[0] != P2P_MSG_SEARCH ||
+          memcmp(reply + 1, &id_net, 4) != 0)
+        continue;
+      if (reply[5] != P2P_UDP_OK)
+        return P2P_EPROTO;
+      p2p_decode_location(reply + 6, loc);
+      return P2P_OK;
+    }
+  }
+  return P2P_EPROTO;
+}
+
+int p2p_search_udp(int sock, uint32_t req_id, const char *name, int tries,
+                   int timeout_ms, struct p2p_location *loc) {
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_SEARCH_UDP);
+  int rc = search_udp(sock, req_id, name, tries, timeout_ms, loc, trace);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
+
+int p2p_listen(uint16_t port, int backlog, uint16_t *bound) {
+  struct sockaddr_in addr = {0};
+  socklen_t addr_len = sizeof(addr);
+  int on = 1;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, backlog) == -1 ||
+      getsockname(fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  *bound = ntohs(addr.sin_port);
+  return fd;
+}
+
+int p2p_valid_name(const char *name) {
+  if (strlen(name) >= P2P_MAX_FETCH_NAME)
+    return 0;
+  const char *p = name;
+  while (1) {
+    if (*p == '\0' || *p == '/' || *p == '.')
+      return 0;
+    p += strcspn(p, "/");
+    if (*p == '\0')
+      return 1;
+    p++;
+  }
+}
+
+int p2p_read_attrs(int fd, struct p2p_file_attrs *attrs) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return P2P_ENOFILE;
+
+  // The digest is the one a delta FETCH ends with
+  uint8_t *data = NULL;
+  if (st.st_size > 0 &&
+      (data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    return P2P_ENOFILE;
+  if (data)
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  attrs->size = (uint64_t)st.st_size;
+  attrs->mtime = st.st_mtime;
+  attrs->digest = p2p_hash(data, (size_t)st.st_size);
+  if (data)
+    munmap(data, (size_t)st.st_size);
+  return P2P_OK;
+}
+
+static int send_file(int sock, int fd, off_t offset, off_t end, size_t *sent, uint64_t trace) {
+  while (offset < end) {
+    ssize_t n = p2p_sendfile(sock, fd, &offset, (size_t)(end - offset));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return P2P_ESINK;
+    *sent += (size_t)n;
+    P2P_TRACE(trace, P2P_TRACE_CHUNK, n);
+  }
+  return P2P_OK;
+}
+
+// Delta reply: the file mapped, matched against the signatures and
+// encoded a buffer at a time
+static int send_delta(int sock, int fd, off_t size, uint32_t block, const uint8_t *sigs,
+                      uint32_t count, size_t *sent, uint64_t trace) {
+  uint8_t *data = NULL;
+  if (size > 0 && (data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    return P2P_ESINK;
+
+  struct p2p_delta_plan plan;
+  int rc = P2P_ESINK;
+  uint8_t *buf = malloc(SERVE_CHUNK);
+  if (buf && p2p_delta_plan(data, (uint64_t)size, block, sigs, count, &plan) == 0) {
+    struct p2p_delta_encoder enc;
+    size_t n;
+    rc = P2P_OK;
+    p2p_delta_encoder_init(&enc, data, (uint64_t)size, &plan);
+    while (rc == P2P_OK && (n = p2p_delta_encode(&enc, buf, SERVE_CHUNK)) > 0) {
+      if (p2p_send_all(sock, buf, n) != 0) {
+        rc = P2P_ESINK;
+      } else {
+        *sent += n;
+        P2P_TRACE(trace, P2P_TRACE_CHUNK, (int64_t)n);
+      }
+    }
+    p2p_delta_plan_free(&plan);
+  }
+  free(buf);
+  if (data)
+    munmap(data, (size_t)size);
+  return rc;
+}
+
+// HAVE reply for a whole file: its size and every chunk's bit set
+static int send_have(int sock, off_t size) {
+  size_t bits_len = p2p_swarm_bits_len((uint64_t)size);
+  uint8_t *reply = malloc(12 + bits_len);
+  if (!reply)
+    return P2P_ESINK;
+  uint32_t chunk_net = htonl(P2P_SWARM_CHUNK);
+  uint32_t chunks = p2p_swarm_chunks((uint64_t)size);
+  p2p_put64(reply, (uint64_t)size);
+  memcpy(reply + 8, &chunk_net, 4);
+  memset(reply + 12, 0, bits_len);
+  for (uint32_t i = 0; i < chunks; i++)
+    p2p_bit_set(reply + 12, i);
+  int rc = p2p_send_all(sock, reply, 12 + bits_len) == 0 ? P2P_OK : P2P_ESINK;
+  free(reply);
+  return rc;
+}
+
+static int serve_fetch(int sock, const char *root, size_t *sent, uint64_t trace) {
+  uint8_t req[1 + P2P_MAX_FETCH_NAME + 8];
+  uint8_t chunk_req[6]; // FETCH CHUNK's index and port
+  size_t len = 1;
+  uint8_t *sigs = NULL;
+  uint32_t block = 0, count = 0;
+  *sent = 0;
+
+  // Action code and name, read up to its NUL and no further
+  if (p2p_recv_all(sock, req, 1) != 0 ||
+      (req[0] != P2P_MSG_FETCH && req[0] != P2P_MSG_FETCH_DELTA &&
+       req[0] != P2P_MSG_HAVE && req[0] != P2P_MSG_FETCH_CHUNK))
+    return P2P_EPROTO;
+  if (req[0] == P2P_MSG_FETCH_CHUNK && p2p_recv_all(sock, chunk_req, sizeof(chunk_req)) != 0)
+    return P2P_EPROTO;
+  do {
+    if (len == 1 + P2P_MAX_FETCH_NAME || p2p_recv_all(sock, req + len, 1) != 0)
+      return P2P_EPROTO;
+  } while (req[len++] != '\0');
+
+  // A delta FETCH goes on with the signatures of the fetcher's copy
+  if (req[0] == P2P_MSG_FETCH_DELTA) {
+    if (p2p_recv_all(sock, req + len, 8) != 0)
+      return P2P_EPROTO;
+    long total = p2p_delta_request_len(req, len + 8);
+    if (total < 0)
+      return P2P_EPROTO;
+    memcpy(&block, req + len, 4);
+    memcpy(&count, req + len + 4, 4);
+    block = ntohl(block);
+    count = ntohl(count);
+    sigs = malloc((size_t)count * P2P_DELTA_SIG_LEN + 1);
+    if (!sigs)
+      return P2P_ESINK;
+    if (p2p_recv_all(sock, sigs, (size_t)count * P2P_DELTA_SIG_LEN) != 0) {
+      free(sigs);
+      return P2P_EPROTO;
+    }
+  }
+
+  P2P_TRACE(trace, P2P_TRACE_REQUEST, 0);
+  const char *name = (const char *)req + 1;
+  char path[PATH_MAX];
+  struct stat st;
+  int fd = -1;
+  if (p2p_valid_name(name) &&
+      snprintf(path, sizeof(path), "%s/%s", root, name) < (int)sizeof(path))
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+    close(fd);
+    fd = -1;
+  }
+
+  // A whole file has every chunk, up to the most a swarm tracks
+  off_t offset = 0, end = fd != -1 ? st.st_size : 0;
+  if (fd != -1 && (req[0] == P2P_MSG_HAVE || req[0] == P2P_MSG_FETCH_CHUNK) &&
+      p2p_swarm_chunks((uint64_t)st.st_size) > P2P_SWARM_MAX_CHUNKS) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd != -1 && req[0] == P2P_MSG_FETCH_CHUNK) {
+    uint32_t index;
+    memcpy(&index, chunk_req, 4);
+    offset = (off_t)ntohl(index) * P2P_SWARM_CHUNK;
+    if (offset >= st.st_size) {
+      close(fd);
+      fd = -1;
+    } else if (offset + P2P_SWARM_CHUNK < end) {
+      end = offset + P2P_SWARM_CHUNK;
+    }
+  }
+
+  int rc;
+  uint8_t code = fd == -1 ? 1 : 0;
+  if (p2p_send_all(sock, &code, 1) != 0) {
+    rc = P2P_ESINK;
+  } else {
+    P2P_TRACE(trace, P2P_TRACE_FIRST_BYTE, 0);
+    if (fd == -1)
+      rc = P2P_ENOFILE;
+    else if (sigs)
+      rc = send_delta(sock, fd, st.st_size, block, sigs, count, sent, trace);
+    else if (req[0] == P2P_MSG_HAVE)
+      rc = send_have(sock, st.st_size);
+    else {
+      double start = p2p_monotonic_secs();
+      rc = send_file(sock, fd, offset, end, sent, trace);
+      if (rc == P2P_OK)
+        p2p_net_measured(sock, *sent, p2p_monotonic_secs() - start);
+    }
+  }
+
+  if (fd != -1)
+    close(fd);
+  free(sigs);
+  // Over TLS the fetcher only takes the file as whole after a close_notify
+  if (rc == P2P_OK && p2p_tls_shutdown(sock) != P2P_OK)
+    rc = P2P_ESINK;
+  return rc;
+}
+
+int p2p_serve_fetch(int sock, const char *root, size_t *sent) {
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_SERVE);
+  int rc = serve_fetch(sock, root, sent, trace);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
@@ -0,0 +1,69 @@
+// p2p_client.h
+// libp2pcore: talking to a registry and serving FETCH, without any of the
+// peer program's prompts or state. All calls block; results use the
+// codes from p2p_fetch.h.
+
+#ifndef P2P_CLIENT_H
+#define P2P_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "p2p_fetch.h"
+#include "p2p_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// JOIN as peer id on a connected registry socket
+int p2p_join(int sock, uint32_t id);
+
+// PUBLISH count names; P2P_EPROTO if one is too long for the protocol
+int p2p_publish(int sock, const char *const *names, uint32_t count);
+
+// PUBLISH count names along with each file's attributes
+int p2p_publish_attrs(int sock, const char *const *names,
+                      const struct p2p_file_attrs *attrs, uint32_t count);
+
+// SEARCH over TCP. *loc is all zero when no peer has the file.
+int p2p_search(int sock, const char *name, struct p2p_location *loc);
+
+// SEARCH for a holder whose copy passes filter, also returning what it
+// published about the file and, if found_name isn't NULL, the name it
+// holds it under (P2P_MAX_NAME bytes). With P2P_FILTER_DIGEST an empty
+// name finds any file with that content.
+int p2p_search_filtered(int sock, const char *name, const struct p2p_search_filter *filter,
+                        struct p2p_location *loc, struct p2p_file_attrs *attrs,
+                        char *found_name);
+
+// Size, mtime and content digest of an open regular file, for PUBLISH
+int p2p_read_attrs(int fd, struct p2p_file_attrs *attrs);
+
+// SEARCH over a UDP socket connected to the registry's port, sending up
+// to tries datagrams with request id req_id, waiting timeout_ms for the
+// first reply and twice as long for each retry. P2P_EPROTO when no answer
+// came or the registry doesn't own the name; TCP still works then.
+int p2p_search_udp(int sock, uint32_t req_id, const char *name, int tries,
+                   int timeout_ms, struct p2p_location *loc);
+
+// Listening TCP socket on port (0 for any) that p2p_connect() calls
+// given the same local port can share. Returns it with *bound set, or -1
+// with errno set.
+int p2p_listen(uint16_t port, int backlog, uint16_t *bound);
+
+// Answer one FETCH, delta FETCH, HAVE or FETCH CHUNK on an accepted
+// socket from the files under root, each of them a whole swarm seed.
+// Names must pass p2p_valid_name(). Over TLS a complete answer ends with
+// close_notify. The socket is left open.
+int p2p_serve_fetch(int sock, const char *root, size_t *sent);
+
+// A relative path with no empty, hidden, "." or ".." components, short
+// enough to FETCH
+int p2p_valid_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+// p2p_cpu.c
+// libp2pcore: CPU affinity and NUMA placement
+
+#define _GNU_SOURCE
+#include "p2p_cpu.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+int p2p_allowed_cpus(int *cpus, int cap) {
+  cpu_set_t set;
+  int rc = pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  int n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < cap; cpu++) {
+    if (CPU_ISSET(cpu, &set))
+      cpus[n++] = cpu;
+  }
+  return n;
+}
+
+int p2p_cpu_node(int cpu) {
+  // The CPU's sysfs directory links to its node as "node<N>"
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir)
+    return 0;
+  int node = 0;
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' &&
+        de->d_name[4] <= '9') {
+      node = atoi(de->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+static int pin(const cpu_set_t *set) {
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return 0;
+}
+
+int p2p_pin_cpu(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pin(&set);
+}
+
+int p2p_pin_node(int node) {
+  // cpulist reads like "0-7,16-23"
+  char path[64], list[1024];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  int ok = fgets(list, sizeof(list), fp) != NULL;
+  fclose(fp);
+  if (!ok) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  char *p = list;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10), last = first;
+    if (*p == '-')
+      last = strtol(p + 1, &p, 10);
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET((int)cpu, &set);
+    if (*p == ',')
+      p++;
+  }
+  if (CPU_COUNT(&set) == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return pin(&set);
+}
+
+int p2p_steer_cpu(int sock, int cpu) {
+  return setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
@@ -0,0 +1,34 @@
+// p2p_cpu.h
+// libp2pcore: placing threads and connections on CPUs. A thread pinned
+// before it allocates gets its memory from its own NUMA node (Linux
+// places pages where they are first touched), so pinning early is all
+// the NUMA awareness the event loops need.
+
+#ifndef P2P_CPU_H
+#define P2P_CPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CPUs the calling thread may run on, lowest first. Returns how many
+// were stored (at most cap), or -1 with errno set.
+int p2p_allowed_cpus(int *cpus, int cap);
+
+// NUMA node of cpu; 0 on machines that report no nodes
+int p2p_cpu_node(int cpu);
+
+// Pin the calling thread to cpu, or to every CPU of a NUMA node.
+// 0 on success, -1 with errno set.
+int p2p_pin_cpu(int cpu);
+int p2p_pin_node(int node);
+
+// Of the SO_REUSEPORT listeners sharing a port, prefer this one for
+// connections whose packets the kernel handles on cpu. 0 or -1.
+int p2p_steer_cpu(int sock, int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,470 @@
+// p2p_delta.c
+// libp2pcore: rsync-style delta FETCH
+
+#define _GNU_SOURCE
+#include "p2p_delta.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_proto.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+#define NO_BLOCK UINT32_MAX
+#define SIG_BATCH 1024        // signatures per send()
+#define APPLY_CHUNK (64 * 1024)
+
+// ---- Hashes ----
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Byte order independent, so peers on any CPU agree
+static uint64_t load_le64(const uint8_t *p) {
+  uint64_t w = 0;
+  for (int i = 7; i >= 0; i--)
+    w = (w << 8) | p[i];
+  return w;
+}
+
+static uint64_t hash_word(uint64_t h, uint64_t w) {
+  w *= HASH_PRIME2;
+  w = rotl64(w, 31);
+  w *= HASH_PRIME1;
+  h ^= w;
+  return rotl64(h, 27) * HASH_PRIME1 + HASH_PRIME3;
+}
+
+void p2p_hash_init(struct p2p_hash *st) {
+  st->h = HASH_PRIME3;
+  st->total = 0;
+  st->tail_len = 0;
+}
+
+void p2p_hash_update(struct p2p_hash *st, const void *data, size_t len) {
+  const uint8_t *p = data;
+  if (len == 0)
+    return;
+  st->total += len;
+
+  if (st->tail_len > 0) {
+    size_t take = 8 - st->tail_len < len ? 8 - st->tail_len : len;
+    memcpy(st->tail + st->tail_len, p, take);
+    st->tail_len += take;
+    p += take;
+    len -= take;
+    if (st->tail_len < 8)
+      return;
+    st->h = hash_word(st->h, load_le64(st->tail));
+    st->tail_len = 0;
+  }
+  for (; len >= 8; p += 8, len -= 8)
+    st->h = hash_word(st->h, load_le64(p));
+  memcpy(st->tail, p, len);
+  st->tail_len = len;
+}
+
+uint64_t p2p_hash_final(const struct p2p_hash *st) {
+  uint64_t h = st->h ^ st->total;
+  if (st->tail_len > 0) {
+    uint8_t last[8] = {0};
+    memcpy(last, st->tail, st->tail_len);
+    h = hash_word(h, load_le64(last));
+  }
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t p2p_hash(const void *data, size_t len) {
+  struct p2p_hash st;
+  p2p_hash_init(&st);
+  p2p_hash_update(&st, data, len);
+  return p2p_hash_final(&st);
+}
+
+uint32_t p2p_weak_sum(const uint8_t *data, size_t len) {
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a += data[i];
+    b += (uint32_t)(len - i) * data[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+uint32_t p2p_delta_block_size(uint64_t size) {
+  // About the square root of the size, which balances signature bytes
+  // against literal bytes resent around each change
+  uint64_t block = P2P_DELTA_MIN_BLOCK;
+  while (block < P2P_DELTA_MAX_BLOCK && block * block < size)
+    block *= 2;
+  return (uint32_t)block;
+}
+
+long p2p_delta_request_len(const uint8_t *buf, size_t len) {
+  if (len == 0)
+    return 0;
+  if (buf[0] != P2P_MSG_FETCH_DELTA)
+    return -1;
+  const uint8_t *nul = memchr(buf + 1, '\0', len - 1);
+  if (!nul)
+    return len - 1 >= P2P_MAX_FETCH_NAME ? -1 : 0;
+  if (nul - (buf + 1) >= P2P_MAX_FETCH_NAME)
+    return -1;
+
+  size_t header = (size_t)(nul - buf) + 9;
+  if (len < header)
+    return 0;
+  uint32_t block = p2p_get32(nul + 1);
+  uint32_t count = p2p_get32(nul + 5);
+  if (block < P2P_DELTA_MIN_BLOCK || block > P2P_DELTA_MAX_BLOCK || count > P2P_DELTA_MAX_BLOCKS)
+    return -1;
+  return (long)(header + (size_t)count * P2P_DELTA_SIG_LEN);
+}
+
+// ---- Server side ----
+
+// Append an op, extending the last one when it continues it
+static int plan_push(struct p2p_delta_plan *plan, uint8_t type, uint64_t start, uint64_t len) {
+  if (type == P2P_DELTA_LITERAL)
+    plan->literal_bytes += len;
+  if (plan->count > 0) {
+    struct p2p_delta_op *last = &plan->ops[plan->count - 1];
+    if (last->type == type && last->start + last->len == start) {
+      last->len += len;
+      return 0;
+    }
+  }
+  if (plan->count == plan->cap) {
+    size_t cap = plan->cap ? plan->cap * 2 : 64;
+    struct p2p_delta_op *ops = realloc(plan->ops, cap * sizeof(*ops));
+    if (!ops)
+      return -1;
+    plan->ops = ops;
+    plan->cap = cap;
+  }
+  plan->ops[plan->count++] = (struct p2p_delta_op){type, start, len};
+  return 0;
+}
+
+static uint32_t weak_bucket(uint32_t weak, uint32_t mask) {
+  uint32_t h = weak * 2654435761u;
+  return (h ^ (h >> 16)) & mask;
+}
+
+int p2p_delta_plan(const uint8_t *data, uint64_t size, uint32_t block,
+                   const uint8_t *sigs, uint32_t count, struct p2p_delta_plan *plan) {
+  memset(plan, 0, sizeof(*plan));
+  if (count == 0 || block == 0 || size < block)
+    return size > 0 ? plan_push(plan, P2P_DELTA_LITERAL, 0, size) : 0;
+
+  // Weak sums hashed to chains of block numbers, lowest block first
+  uint32_t buckets = 1;
+  while (buckets < 2 * count)
+    buckets *= 2;
+  plan->scratch = malloc((size_t)count * (sizeof(uint64_t) + 2 * sizeof(uint32_t)) +
+                         (size_t)buckets * sizeof(uint32_t));
+  if (!plan->scratch)
+    return -1;
+  uint64_t *strong = plan->scratch;
+  uint32_t *next = (uint32_t *)(strong + count);
+  uint32_t *weak = next + count;
+  uint32_t *head = weak + count;
+  int rc = -1;
+  memset(head, 0xff, buckets * sizeof(*head));
+  for (uint32_t i = count; i-- > 0;) {
+    const uint8_t *sig = sigs + (size_t)i * P2P_DELTA_SIG_LEN;
+    weak[i] = p2p_get32(sig);
+    strong[i] = p2p_get64(sig + 4);
+    uint32_t b = weak_bucket(weak[i], buckets - 1);
+    next[i] = head[b];
+    head[b] = i;
+  }
+
+  uint64_t pos = 0, literal = 0;
+  uint32_t a = 0, b = 0, want = NO_BLOCK;
+  int summed = 0;
+  while (pos + block <= size) {
+    if (!summed) {
+      uint32_t w = p2p_weak_sum(data + pos, block);
+      a = w & 0xffff;
+      b = w >> 16;
+      summed = 1;
+    }
+    uint32_t w = (a & 0xffff) | (b << 16);
+
+    // Prefer the block after the last match, so runs become one op
+    uint32_t match = NO_BLOCK;
+    uint64_t s = 0;
+    int hashed = 0;
+    for (uint32_t i = head[weak_bucket(w, buckets - 1)]; i != NO_BLOCK; i = next[i]) {
+      if (weak[i] != w)
+        continue;
+      if (!hashed) {
+        s = p2p_hash(data + pos, block);
+        hashed = 1;
+      }
+      if (strong[i] != s)
+        continue;
+      if (match == NO_BLOCK || i == want)
+        match = i;
+      if (want == NO_BLOCK || i >= want)
+        break; // chains run in block order, so want can't come later
+    }
+
+    if (match != NO_BLOCK) {
+      if (pos > literal && plan_push(plan, P2P_DELTA_LITERAL, literal, pos - literal) != 0)
+        goto out;
+      if (plan_push(plan, P2P_DELTA_COPY, match, 1) != 0)
+        goto out;
+      want = match + 1;
+      pos += block;
+      literal = pos;
+      summed = 0;
+      continue;
+    }
+
+    // Slide the window one byte
+    if (pos + block < size) {
+      uint8_t out = data[pos], in = data[pos + block];
+      a += in - out;
+      b += a - block * out;
+    }
+    pos++;
+  }
+  if (size > literal && plan_push(plan, P2P_DELTA_LITERAL, literal, size - literal) != 0)
+    goto out;
+  rc = 0;
+
+out:
+  free(plan->scratch);
+  plan->scratch = NULL;
+  if (rc != 0)
+    p2p_delta_plan_free(plan);
+  return rc;
+}
+
+void p2p_delta_plan_free(struct p2p_delta_plan *plan) {
+  free(plan->ops);
+  free(plan->scratch);
+  memset(plan, 0, sizeof(*plan));
+}
+
+void p2p_delta_encoder_init(struct p2p_delta_encoder *enc, const uint8_t *data,
+                            uint64_t size, const struct p2p_delta_plan *plan) {
+  enc->data = data;
+  enc->size = size;
+  enc->plan = plan;
+  enc->op = 0;
+  enc->done = 0;
+  enc->ended = 0;
+}
+
+size_t p2p_delta_encode(struct p2p_delta_encoder *enc, uint8_t *out, size_t cap) {
+  size_t used = 0;
+  while (!enc->ended) {
+    if (enc->op == enc->plan->count) {
+      if (cap - used < 17)
+        break;
+      out[used] = P2P_DELTA_END;
+      p2p_put64(out + used + 1, enc->size);
+      p2p_put64(out + used + 9, p2p_hash(enc->data, enc->size));
+      used += 17;
+      enc->ended = 1;
+      break;
+    }
+
+    const struct p2p_delta_op *op = &enc->plan->ops[enc->op];
+    if (op->type == P2P_DELTA_COPY) {
+      if (cap - used < 9)
+        break;
+      out[used] = P2P_DELTA_COPY;
+      p2p_put32(out + used + 1, (uint32_t)op->start);
+      p2p_put32(out + used + 5, (uint32_t)op->len);
+      used += 9;
+      enc->op++;
+      continue;
+    }
+
+    // Literal data goes out in pieces as large as the buffer allows
+    if (cap - used < 6)
+      break;
+    uint64_t n = op->len - enc->done;
+    if (n > cap - used - 5)
+      n = cap - used - 5;
+    out[used] = P2P_DELTA_LITERAL;
+    p2p_put32(out + used + 1, (uint32_t)n);
+    memcpy(out + used + 5, enc->data + op->start + enc->done, n);
+    used += 5 + n;
+    enc->done += n;
+    if (enc->done == op->len) {
+      enc->op++;
+      enc->done = 0;
+    }
+  }
+  return used;
+}
+
+// ---- Fetcher side ----
+
+// Header, then the signature of each full block of the old copy
+static int send_signatures(int sock, const char *name, int basis_fd, uint32_t block,
+                           uint32_t count) {
+  uint8_t header[1 + P2P_MAX_FETCH_NAME + 8];
+  size_t len = p2p_encode_request(header, sizeof(header) - 8, P2P_MSG_FETCH_DELTA, name);
+  if (len == 0 || len - 2 >= P2P_MAX_FETCH_NAME)
+    return P2P_EPROTO;
+  p2p_put32(header + len, block);
+  p2p_put32(header + len + 4, count);
+  if (p2p_send_all(sock, header, len + 8) != 0)
+    return P2P_EPROTO;
+
+  uint8_t *buf = malloc(block);
+  uint8_t *sigs = malloc(SIG_BATCH * P2P_DELTA_SIG_LEN);
+  int rc = P2P_OK;
+  if (!buf || !sigs) {
+    rc = P2P_ESINK;
+    goto out;
+  }
+  for (uint32_t i = 0; i < count;) {
+    uint32_t batch = count - i < SIG_BATCH ? count - i : SIG_BATCH;
+    for (uint32_t j = 0; j < batch; j++) {
+      if (p2p_pread_all(basis_fd, buf, block, (off_t)(i + j) * block) != 0) {
+        rc = P2P_ESINK;
+        goto out;
+      }
+      p2p_put32(sigs + j * P2P_DELTA_SIG_LEN, p2p_weak_sum(buf, block));
+      p2p_put64(sigs + j * P2P_DELTA_SIG_LEN + 4, p2p_hash(buf, block));
+    }
+    if (p2p_send_all(sock, sigs, (size_t)batch * P2P_DELTA_SIG_LEN) != 0) {
+      rc = P2P_EPROTO;
+      goto out;
+    }
+    i += batch;
+  }
+
+out:
+  free(buf);
+  free(sigs);
+  return rc;
+}
+
+// Rebuild the file from the reply's ops
+static int apply_delta(int sock, int basis_fd, uint32_t block, uint32_t count,
+                       const struct p2p_sink *sink, struct p2p_delta_stats *stats,
+                       uint64_t trace) {
+  uint32_t chunk = block > APPLY_CHUNK ? block : APPLY_CHUNK;
+  uint8_t *buf = malloc(chunk);
+  struct p2p_hash digest;
+  int rc = P2P_ERECV; // a reply cut short before its end op
+  if (!buf)
+    return P2P_ESINK;
+  p2p_hash_init(&digest);
+
+  for (;;) {
+    uint8_t op[17];
+    if (p2p_recv_all(sock, op, 1) != 0)
+      break;
+
+    if (op[0] == P2P_DELTA_LITERAL) {
+      if (p2p_recv_all(sock, op + 1, 4) != 0)
+        break;
+      uint32_t left = p2p_get32(op + 1);
+      while (left > 0) {
+        size_t n = left < chunk ? left : chunk;
+        if (p2p_recv_all(sock, buf, n) != 0)
+          goto out;
+        if (p2p_sink_write(sink, buf, n) != 0) {
+          rc = P2P_ESINK;
+          goto out;
+        }
+        p2p_hash_update(&digest, buf, n);
+        stats->literal_bytes += n;
+        P2P_TRACE(trace, P2P_TRACE_CHUNK, (int64_t)n);
+        left -= (uint32_t)n;
+      }
+    } else if (op[0] == P2P_DELTA_COPY) {
+      if (p2p_recv_all(sock, op + 1, 8) != 0)
+        break;
+      uint32_t first = p2p_get32(op + 1), blocks = p2p_get32(op + 5);
+      if (first > count || blocks > count - first) {
+        rc = P2P_EPROTO;
+        break;
+      }
+      for (uint32_t i = first; i < first + blocks; i++) {
+        if (p2p_pread_all(basis_fd, buf, block, (off_t)i * block) != 0 ||
+            p2p_sink_write(sink, buf, block) != 0) {
+          rc = P2P_ESINK;
+          goto out;
+        }
+        p2p_hash_update(&digest, buf, block);
+        stats->copied_bytes += block;
+      }
+    } else if (op[0] == P2P_DELTA_END) {
+      if (p2p_recv_all(sock, op + 1, 16) != 0)
+        break;
+      stats->file_bytes = stats->literal_bytes + stats->copied_bytes;
+      rc = p2p_get64(op + 1) == stats->file_bytes && p2p_get64(op + 9) == p2p_hash_final(&digest)
+               ? P2P_OK
+               : P2P_EDIGEST;
+      break;
+    } else {
+      rc = P2P_EPROTO;
+      break;
+    }
+  }
+
+out:
+  free(buf);
+  return rc;
+}
+
+int p2p_fetch_delta(const char *host, const char *service, const char *name,
+                    int basis_fd, const struct p2p_sink *sink,
+                    struct p2p_delta_stats *stats) {
+  struct stat st;
+  memset(stats, 0, sizeof(*stats));
+  if (fstat(basis_fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return P2P_ESINK;
+  uint32_t block = p2p_delta_block_size((uint64_t)st.st_size);
+  uint64_t blocks = (uint64_t)st.st_size / block;
+  uint32_t count = blocks > P2P_DELTA_MAX_BLOCKS ? P2P_DELTA_MAX_BLOCKS : (uint32_t)blocks;
+
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_FETCH_DELTA);
+  int sock = p2p_connect_as(host, service, 0, P2P_NET_BULK);
+  if (sock == -1) {
+    P2P_TRACE(trace, P2P_TRACE_DONE, P2P_ECONNECT);
+    return P2P_ECONNECT;
+  }
+  P2P_TRACE(trace, P2P_TRACE_CONNECTED, 0);
+
+  int rc = send_signatures(sock, name, basis_fd, block, count);
+  if (rc == P2P_OK) {
+    // Same response code as FETCH, then the ops
+    uint8_t code;
+    P2P_TRACE(trace, P2P_TRACE_SENT, 0);
+    if (p2p_recv_all(sock, &code, 1) != 0) {
+      rc = P2P_EPROTO;
+    } else {
+      P2P_TRACE(trace, P2P_TRACE_FIRST_BYTE, 0);
+      if (code != 0)
+        rc = P2P_ENOFILE;
+      else
+        rc = apply_delta(sock, basis_fd, block, count, sink, stats, trace);
+    }
+  }
+  p2p_close(sock);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
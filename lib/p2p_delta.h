@@ -0,0 +1,115 @@
+// p2p_delta.h
+// libp2pcore: rsync-style delta FETCH. The fetcher sends signatures of
+// the fixed-size blocks of its stale copy; the server finds those blocks
+// anywhere in the current file with a rolling checksum and answers with
+// copy references for them and literal data for everything else.
+//
+// Request: [9][name\0][block size:4][count:4] then count signatures of
+// [weak:4][strong:8]. Reply: the FETCH response code byte, then ops:
+//   [0][len:4][len bytes]         literal data
+//   [1][first block:4][blocks:4]  copy from the fetcher's copy
+//   [2][file size:8][digest:8]    end; digest is p2p_hash of the file
+// All integers are in network byte order.
+
+#ifndef P2P_DELTA_H
+#define P2P_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "p2p_fetch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define P2P_DELTA_MIN_BLOCK 1024
+#define P2P_DELTA_MAX_BLOCK (128 * 1024)
+#define P2P_DELTA_MAX_BLOCKS (1u << 20)
+#define P2P_DELTA_SIG_LEN 12
+
+#define P2P_DELTA_LITERAL 0
+#define P2P_DELTA_COPY 1
+#define P2P_DELTA_END 2
+
+// Streaming 64-bit hash, used per block and over whole files
+struct p2p_hash {
+  uint64_t h;
+  uint64_t total;
+  uint8_t tail[8];
+  size_t tail_len;
+};
+
+void p2p_hash_init(struct p2p_hash *st);
+void p2p_hash_update(struct p2p_hash *st, const void *data, size_t len);
+uint64_t p2p_hash_final(const struct p2p_hash *st);
+uint64_t p2p_hash(const void *data, size_t len);
+
+// rsync's rolling checksum: two 16-bit sums of the window's bytes
+uint32_t p2p_weak_sum(const uint8_t *data, size_t len);
+
+// Block size the fetcher uses for a copy of size bytes
+uint32_t p2p_delta_block_size(uint64_t size);
+
+// What the server sends, before encoding
+struct p2p_delta_op {
+  uint8_t type;     // P2P_DELTA_LITERAL or P2P_DELTA_COPY
+  uint64_t start;   // file offset, or first block
+  uint64_t len;     // bytes, or blocks
+};
+
+struct p2p_delta_plan {
+  struct p2p_delta_op *ops;
+  size_t count;
+  size_t cap;
+  uint64_t literal_bytes;
+  void *scratch;    // signature index while planning
+};
+
+// Match the fetcher's signatures (wire format) against data. Returns 0,
+// or -1 if out of memory. Everything it allocates hangs off plan as soon
+// as it's allocated, so a caller that siglongjmp()s out of a fault
+// reading data frees it all with p2p_delta_plan_free().
+int p2p_delta_plan(const uint8_t *data, uint64_t size, uint32_t block,
+                   const uint8_t *sigs, uint32_t count, struct p2p_delta_plan *plan);
+void p2p_delta_plan_free(struct p2p_delta_plan *plan);
+
+// Turns a plan into reply bytes a buffer at a time
+struct p2p_delta_encoder {
+  const uint8_t *data;
+  uint64_t size;
+  const struct p2p_delta_plan *plan;
+  size_t op;        // next op to encode
+  uint64_t done;    // bytes of the current literal already encoded
+  int ended;
+};
+
+void p2p_delta_encoder_init(struct p2p_delta_encoder *enc, const uint8_t *data,
+                            uint64_t size, const struct p2p_delta_plan *plan);
+
+// Write the next reply bytes into out (cap at least 64); returns how
+// many, 0 once the end op has been written
+size_t p2p_delta_encode(struct p2p_delta_encoder *enc, uint8_t *out, size_t cap);
+
+// Length of the delta request in buf: the full length once the header
+// is in, 0 while more header is needed, -1 if it is malformed
+long p2p_delta_request_len(const uint8_t *buf, size_t len);
+
+struct p2p_delta_stats {
+  uint64_t file_bytes;    // size of the new file
+  uint64_t literal_bytes; // sent by the peer
+  uint64_t copied_bytes;  // reused from the old copy
+};
+
+// Bring basis_fd, a readable old copy of name, up to date from the peer
+// at host:service, writing the new file to sink. The sink must not be
+// basis_fd. P2P_EDIGEST if the result doesn't match the peer's file.
+int p2p_fetch_delta(const char *host, const char *service, const char *name,
+                    int basis_fd, const struct p2p_sink *sink,
+                    struct p2p_delta_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+// p2p_fetch.c
+// libp2pcore: downloading files from peers into arbitrary sinks
+
+#define _GNU_SOURCE
+#include "p2p_fetch.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_proto.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FETCH_CHUNK (64 * 1024)
+
+int p2p_connect_as(const char *host, const char *service, uint16_t local_port, int profile) {
+  struct addrinfo hints = {0};
+  struct addrinfo *rp, *result;
+  int s, saved_errno = ECONNREFUSED;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(host, service, &hints, &result) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    if ((s = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC,
+                    rp->ai_protocol)) == -1) {
+      saved_errno = errno;
+      continue;
+    }
+
+    if (local_port != 0 && rp->ai_family == AF_INET) {
+      // Shares the port with a listening socket of ours
+      struct sockaddr_in local = {0};
+      int on = 1;
+      local.sin_family = AF_INET;
+      local.sin_addr.s_addr = htonl(INADDR_ANY);
+      local.sin_port = htons(local_port);
+      setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+      if (bind(s, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        saved_errno = errno;
+        close(s);
+        continue;
+      }
+    }
+
+    if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1)
+      break;
+    saved_errno = errno;
+    close(s);
+  }
+  freeaddrinfo(result);
+
+  if (rp == NULL) {
+    errno = saved_errno;
+    return -1;
+  }
+  p2p_net_tune(s, profile);
+  if (p2p_tls_enabled() && p2p_tls_client(s, host) != P2P_OK) {
+    close(s);
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  return s;
+}
+
+int p2p_connect(const char *host, const char *service, uint16_t local_port) {
+  return p2p_connect_as(host, service, local_port, P2P_NET_CONTROL);
+}
+
+int p2p_sink_write(const struct p2p_sink *sink, const void *data, size_t len) {
+  if (sink->type == P2P_SINK_CALLBACK)
+    return sink->fn(sink->ctx, data, len) != 0 ? -1 : 0;
+  return p2p_write_all(sink->fd, data, len);
+}
+
+// recv() into a buffer and pass it on, until the peer closes
+static int copy_to_sink(int sock, const struct p2p_sink *sink, size_t *received,
+                        uint64_t trace) {
+  char buf[FETCH_CHUNK];
+  for (;;) {
+    ssize_t n = p2p_recv(sock, buf, sizeof(buf), 0);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return P2P_ERECV;
+    }
+    if (n == 0)
+      return P2P_OK;
+
+    if (p2p_sink_write(sink, buf, (size_t)n) != 0)
+      return P2P_ESINK;
+    *received += (size_t)n;
+    P2P_TRACE(trace, P2P_TRACE_CHUNK, n);
+  }
+}
+
+// Move len bytes from pipe_rd to fd. If fd turns out not to take
+// splice() (EINVAL: O_APPEND files, ttys), they are copied instead and
+// *spliceable is cleared.
+static int drain_pipe(int pipe_rd, int fd, size_t len, int *spliceable) {
+  while (len > 0) {
+    if (*spliceable) {
+      ssize_t n = splice(pipe_rd, NULL, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n > 0) {
+        len -= (size_t)n;
+        continue;
+      }
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n == 0 || errno != EINVAL)
+        return -1;
+      *spliceable = 0;
+    }
+
+    char buf[4096];
+    ssize_t n = read(pipe_rd, buf, len < sizeof(buf) ? len : sizeof(buf));
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (p2p_write_all(fd, buf, (size_t)n) != 0)
+      return -1;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Zero-copy path for descriptor sinks: socket -> pipe (the sink itself,
+// or one of ours) -> sink
+static int splice_to_fd(int sock, int fd, int fd_is_pipe, size_t *received,
+                        uint64_t trace) {
+  int pipefd[2] = {-1, -1};
+  int spliceable = 1;
+  int out = fd;
+  int rc = P2P_OK;
+
+  if (!fd_is_pipe) {
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+      return P2P_ESINK;
+    out = pipefd[1];
+  }
+
+  for (;;) {
+    ssize_t n = splice(sock, NULL, out, NULL, FETCH_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      // A socket splice() refuses can still be read
+      rc = errno == EINVAL && *received == 0 && spliceable ? 1 : P2P_ERECV;
+      break;
+    }
+    if (n == 0)
+      break;
+    if (!fd_is_pipe && drain_pipe(pipefd[0], fd, (size_t)n, &spliceable) != 0) {
+      rc = P2P_ESINK;
+      break;
+    }
+    *received += (size_t)n;
+    P2P_TRACE(trace, P2P_TRACE_CHUNK, n);
+  }
+
+  if (!fd_is_pipe) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+  }
+  return rc;
+}
+
+static int fetch_socket(int sock, const char *name, const struct p2p_sink *sink,
+                        size_t *received, uint64_t trace) {
+  uint8_t request[1 + P2P_MAX_FETCH_NAME];
+  *received = 0;
+
+  // FETCH request: action code and the NUL-terminated name
+  size_t sent = 0, len = p2p_encode_request(request, sizeof(request), P2P_MSG_FETCH, name);
+  if (len == 0)
+    return P2P_EPROTO;
+  while (sent < len) {
+    ssize_t n = p2p_send(sock, request + sent, len - sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return P2P_EPROTO;
+    }
+    sent += (size_t)n;
+  }
+  P2P_TRACE(trace, P2P_TRACE_SENT, 0);
+
+  // One response code byte, then the file until the peer closes
+  uint8_t code;
+  ssize_t n;
+  do {
+    n = p2p_recv(sock, &code, 1, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n != 1)
+    return P2P_EPROTO;
+  P2P_TRACE(trace, P2P_TRACE_FIRST_BYTE, 0);
+  if (code != 0)
+    return P2P_ENOFILE;
+
+  // Over TLS the end of the file is a close_notify record, which only
+  // the TLS library can read
+  if (sink->type == P2P_SINK_FD && !p2p_tls_enabled()) {
+    struct stat st;
+    if (fstat(sink->fd, &st) == -1)
+      return P2P_ESINK;
+    if (S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode) || S_ISSOCK(st.st_mode)) {
+      int rc = splice_to_fd(sock, sink->fd, S_ISFIFO(st.st_mode), received, trace);
+      if (rc <= 0)
+        return rc;
+      // else nothing moved yet and splice() isn't available; copy instead
+    }
+  }
+  return copy_to_sink(sock, sink, received, trace);
+}
+
+int p2p_fetch_socket(int sock, const char *name, const struct p2p_sink *sink,
+                     size_t *received) {
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_FETCH);
+  int rc = fetch_socket(sock, name, sink, received, trace);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
+
+int p2p_fetch(const char *host, const char *service, const char *name,
+              const struct p2p_sink *sink, size_t *received) {
+  *received = 0;
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_FETCH);
+  int sock = p2p_connect_as(host, service, 0, P2P_NET_BULK);
+  if (sock == -1) {
+    P2P_TRACE(trace, P2P_TRACE_DONE, P2P_ECONNECT);
+    return P2P_ECONNECT;
+  }
+  P2P_TRACE(trace, P2P_TRACE_CONNECTED, 0);
+  double start = p2p_monotonic_secs();
+  int rc = fetch_socket(sock, name, sink, received, trace);
+  if (rc == P2P_OK)
+    p2p_net_measured(sock, *received, p2p_monotonic_secs() - start);
+  p2p_close(sock);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
+
+const char *p2p_strerror(int rc) {
+  switch (rc) {
+  case P2P_OK:
+    return "success";
+  case P2P_ECONNECT:
+    return "could not connect to peer";
+  case P2P_EPROTO:
+    return "bad request or reply";
+  case P2P_ENOFILE:
+    return "peer does not have the file";
+  case P2P_ESINK:
+    return "could not deliver data";
+  case P2P_ERECV:
+    return "connection failed during transfer";
+  case P2P_EDIGEST:
+    return "file failed verification";
+  case P2P_ETLS:
+    return "TLS failed";
+  default:
+    return "unknown error";
+  }
+}
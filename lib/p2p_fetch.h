@@ -0,0 +1,82 @@
+// p2p_fetch.h
+// libp2pcore: downloading files from peers into arbitrary sinks
+
+#ifndef P2P_FETCH_H
+#define P2P_FETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// p2p_fetch() results; everything but P2P_OK is negative
+#define P2P_OK 0
+#define P2P_ECONNECT -1 // couldn't reach the peer
+#define P2P_EPROTO -2   // request not sent or reply cut short
+#define P2P_ENOFILE -3  // peer answered that it doesn't serve the file
+#define P2P_ESINK -4    // sink failed or asked to stop
+#define P2P_ERECV -5    // connection failed mid-transfer
+#define P2P_EDIGEST -6  // delta result differs from the peer's file
+#define P2P_ETLS -7     // TLS handshake failed or TLS not built in
+
+// Called with each piece of the file as it arrives. Return 0 to keep
+// going, anything else to abort the transfer.
+typedef int (*p2p_chunk_fn)(void *ctx, const void *data, size_t len);
+
+enum p2p_sink_type {
+  P2P_SINK_FD,      // write to a descriptor
+  P2P_SINK_CALLBACK // hand buffers to a function
+};
+
+// Where fetched bytes go. Pipes (stdout in a shell pipeline, say) are
+// fed with splice() straight from the socket; regular files and sockets
+// are spliced through a pipe; anything else is copied.
+struct p2p_sink {
+  enum p2p_sink_type type;
+  int fd;
+  p2p_chunk_fn fn;
+  void *ctx;
+};
+
+static inline struct p2p_sink p2p_fd_sink(int fd) {
+  struct p2p_sink s = {P2P_SINK_FD, fd, NULL, NULL};
+  return s;
+}
+
+static inline struct p2p_sink p2p_callback_sink(p2p_chunk_fn fn, void *ctx) {
+  struct p2p_sink s = {P2P_SINK_CALLBACK, -1, fn, ctx};
+  return s;
+}
+
+// Hand len bytes to sink by plain write() or call; 0, or -1 if it failed
+// or asked to stop
+int p2p_sink_write(const struct p2p_sink *sink, const void *data, size_t len);
+
+// Connect to host:service over TCP, binding the local end to local_port
+// first unless it is 0, and tune it for profile (P2P_NET_*, see
+// p2p_net.h). With TLS on (p2p_tls.h) the handshake is done too.
+// Returns the socket, or -1 with errno set.
+int p2p_connect_as(const char *host, const char *service, uint16_t local_port, int profile);
+
+// p2p_connect_as() for registry requests and other short exchanges
+int p2p_connect(const char *host, const char *service, uint16_t local_port);
+
+// FETCH name from the peer at host:service into sink. *received counts
+// the file bytes delivered, even on failure.
+int p2p_fetch(const char *host, const char *service, const char *name,
+              const struct p2p_sink *sink, size_t *received);
+
+// Same over an already connected socket, which is left open
+int p2p_fetch_socket(int sock, const char *name, const struct p2p_sink *sink,
+                     size_t *received);
+
+// Human-readable text for a p2p_fetch() result
+const char *p2p_strerror(int rc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+// p2p_io.h
+// libp2pcore: blocking read and write loops shared by the library and
+// the registry. Sockets go through p2p_send() and p2p_recv(), so they
+// work the same over TLS.
+
+#ifndef P2P_IO_H
+#define P2P_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Each moves all len bytes, retrying on EINTR. 0, or -1 on an error or
+// (reading) the other end closing first.
+int p2p_send_all(int sock, const void *buf, size_t len);
+int p2p_recv_all(int sock, void *buf, size_t len);
+int p2p_write_all(int fd, const void *buf, size_t len);
+int p2p_pread_all(int fd, void *buf, size_t len, off_t offset);
+
+// CLOCK_MONOTONIC in seconds
+double p2p_monotonic_secs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
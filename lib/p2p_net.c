@@ -0,0 +1,192 @@
+// p2p_net.c
+// libp2pcore: transport profiles for registry and FETCH connections
+
+#define _GNU_SOURCE
+#include "p2p_net.h"
+
+#include <errno.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define NET_HOSTS 64              // hosts whose transfer rates we remember
+#define NET_MIN_SAMPLE (1 << 20)  // bytes; shorter transfers measure slow start
+#define NET_AUTOTUNE_GUESS (4 << 20) // when /proc doesn't say
+
+struct host_rate {
+  int family; // 0 when the slot is free
+  uint8_t addr[16];
+  uint64_t rate;     // bytes per second
+  uint64_t last_use; // host_clock when measured or used
+};
+
+static int net_enabled = 1;
+static char congestion[16]; // TCP_CA_NAME_MAX
+static uint64_t default_rate = 0;
+
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_rate hosts[NET_HOSTS];
+static uint64_t host_clock = 0;
+
+// Buffer limits, [0] receive and [1] send: how far autotuning grows
+// one, and the most SO_RCVBUF or SO_SNDBUF may ask for
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+static long autotune_max[2];
+static long core_max[2];
+
+// The last number in a /proc/sys file, or fallback
+static long read_sysctl(const char *path, long fallback) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return fallback;
+  long v, last = fallback;
+  while (fscanf(fp, "%ld", &v) == 1)
+    last = v;
+  fclose(fp);
+  return last;
+}
+
+static void read_limits(void) {
+  autotune_max[0] = read_sysctl("/proc/sys/net/ipv4/tcp_rmem", NET_AUTOTUNE_GUESS);
+  autotune_max[1] = read_sysctl("/proc/sys/net/ipv4/tcp_wmem", NET_AUTOTUNE_GUESS);
+  core_max[0] = read_sysctl("/proc/sys/net/core/rmem_max", 0);
+  core_max[1] = read_sysctl("/proc/sys/net/core/wmem_max", 0);
+}
+
+void p2p_net_setup(int enabled, const char *cc, uint64_t rate) {
+  net_enabled = enabled;
+  snprintf(congestion, sizeof(congestion), "%s", cc ? cc : "");
+  default_rate = rate;
+}
+
+void p2p_net_setup_env(void) {
+  const char *net = getenv("P2P_NET");
+  const char *cc = getenv("P2P_NET_CC");
+  const char *mbps = getenv("P2P_NET_MBPS");
+  p2p_net_setup(!net || strcmp(net, "off") != 0, cc && *cc ? cc : NULL,
+                mbps ? strtoull(mbps, NULL, 10) * 1000000 / 8 : 0);
+}
+
+// The other end's address as a table key; 0, or -1 if it has none
+static int host_key(int sock, int *family, uint8_t addr[16]) {
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (getpeername(sock, (struct sockaddr *)&ss, &len) == -1)
+    return -1;
+  memset(addr, 0, 16);
+  *family = ss.ss_family;
+  if (ss.ss_family == AF_INET)
+    memcpy(addr, &((struct sockaddr_in *)&ss)->sin_addr, 4);
+  else if (ss.ss_family == AF_INET6)
+    memcpy(addr, &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+  else
+    return -1;
+  return 0;
+}
+
+// The host's entry, or with create a new one in place of the one used
+// longest ago. Called with hosts_lock held.
+static struct host_rate *find_host(int family, const uint8_t addr[16], int create) {
+  struct host_rate *oldest = &hosts[0];
+  for (int i = 0; i < NET_HOSTS; i++) {
+    struct host_rate *h = &hosts[i];
+    if (h->family == family && memcmp(h->addr, addr, 16) == 0)
+      return h;
+    if (h->last_use < oldest->last_use)
+      oldest = h;
+  }
+  if (!create)
+    return NULL;
+  oldest->family = family;
+  memcpy(oldest->addr, addr, 16);
+  oldest->rate = 0;
+  return oldest;
+}
+
+// Bytes per second to expect to the other end of sock; 0 if unknown
+static uint64_t expected_rate(int sock) {
+  int family;
+  uint8_t addr[16];
+  if (host_key(sock, &family, addr) == -1)
+    return default_rate;
+  pthread_mutex_lock(&hosts_lock);
+  struct host_rate *h = find_host(family, addr, 0);
+  uint64_t rate = h && h->rate ? h->rate : default_rate;
+  if (h)
+    h->last_use = ++host_clock;
+  pthread_mutex_unlock(&hosts_lock);
+  return rate;
+}
+
+// Ask for a buffer of want bytes in direction dir if autotuning wouldn't
+// get there. Unprivileged requests are capped by net.core.*mem_max, and
+// locking a buffer below what autotuning reaches would only slow the
+// transfer, so then it's left alone.
+static int size_buffer(int sock, int dir, uint64_t want) {
+  if (want <= (uint64_t)autotune_max[dir])
+    return 0;
+  int bytes = want > P2P_NET_MAX_BUFFER ? P2P_NET_MAX_BUFFER : (int)want;
+  if (setsockopt(sock, SOL_SOCKET, dir ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, &bytes,
+                 sizeof(bytes)) == 0)
+    return 0;
+  if (core_max[dir] <= autotune_max[dir])
+    return -1;
+  if (bytes > core_max[dir])
+    bytes = (int)core_max[dir];
+  return setsockopt(sock, SOL_SOCKET, dir ? SO_SNDBUF : SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+int p2p_net_tune(int sock, int profile) {
+  if (!net_enabled)
+    return 0;
+  int on = 1;
+  if (profile == P2P_NET_CONTROL)
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  int rc = 0, saved_errno = 0;
+  if (congestion[0] &&
+      setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion)) == -1) {
+    rc = -1;
+    saved_errno = errno;
+  }
+
+  // The handshake gave the connection its first RTT sample
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  uint64_t rate = expected_rate(sock);
+  if (rate > 0 && getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+      info.tcpi_rtt > 0) {
+    pthread_once(&limits_once, read_limits);
+    uint64_t bdp = rate * info.tcpi_rtt / 1000000;
+    for (int dir = 0; dir < 2; dir++) {
+      if (size_buffer(sock, dir, 2 * bdp) == -1 && rc == 0) {
+        rc = -1;
+        saved_errno = errno;
+      }
+    }
+  }
+  if (rc == -1)
+    errno = saved_errno;
+  return rc;
+}
+
+void p2p_net_measured(int sock, uint64_t bytes, double secs) {
+  int family;
+  uint8_t addr[16];
+  if (!net_enabled || bytes < NET_MIN_SAMPLE || secs <= 0 ||
+      host_key(sock, &family, addr) == -1)
+    return;
+  uint64_t sample = (uint64_t)(bytes / secs);
+
+  // A faster transfer shows what the path can do and counts in full; a
+  // slower one may have just shared it, so the estimate only drifts down
+  pthread_mutex_lock(&hosts_lock);
+  struct host_rate *h = find_host(family, addr, 1);
+  h->rate = sample > h->rate ? sample : (3 * h->rate + sample) / 4;
+  h->last_use = ++host_clock;
+  pthread_mutex_unlock(&hosts_lock);
+}
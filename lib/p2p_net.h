@@ -0,0 +1,57 @@
+// p2p_net.h
+// libp2pcore: transport profiles. Registry connections carry small
+// requests and replies, so they are tuned for latency; FETCH connections
+// carry files, so they get socket buffers sized from the bandwidth-delay
+// product to the other host and, if one is configured, their own
+// congestion control. The bandwidth is what earlier transfers to that
+// host achieved, the delay the connection's handshake round trip.
+//
+// Buffers are only set when the product is beyond what the kernel's
+// autotuning would grow them to (net.ipv4.tcp_rmem and tcp_wmem), since
+// setting them turns autotuning off for the socket. They are sized at
+// twice the product, up to P2P_NET_MAX_BUFFER, so a transfer held back by
+// its buffers leaves room for the next one to the same host to measure
+// more. Without CAP_NET_ADMIN they are capped by net.core.rmem_max and
+// wmem_max, and left alone if that is no more than autotuning reaches.
+// Options the kernel refuses are left at its defaults.
+
+#ifndef P2P_NET_H
+#define P2P_NET_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What a connection is for
+#define P2P_NET_CONTROL 1 // registry requests and replies, swarm HAVE
+#define P2P_NET_BULK 2    // file transfers, at either end
+
+#define P2P_NET_MAX_BUFFER (64 << 20) // largest socket buffer a profile asks for
+
+// Profiles are on unless enabled is 0, which leaves every socket as the
+// kernel made it. congestion names the algorithm for bulk connections
+// ("bbr", say; see net.ipv4.tcp_allowed_congestion_control), NULL for
+// the system's. rate (bytes per second) is assumed for hosts nothing has
+// been measured from yet, 0 to leave those alone.
+void p2p_net_setup(int enabled, const char *congestion, uint64_t rate);
+
+// p2p_net_setup() from P2P_NET ("off" to disable), P2P_NET_CC and
+// P2P_NET_MBPS (megabits per second); profiles on when none is set
+void p2p_net_setup_env(void);
+
+// Apply profile to a connected or accepted socket. 0, or -1 with errno
+// set by the first option the kernel refused.
+int p2p_net_tune(int sock, int profile);
+
+// A bulk transfer of bytes over sock took secs; remembered for sizing
+// the next connections to the same host. Transfers too short to leave
+// slow start are ignored.
+void p2p_net_measured(int sock, uint64_t bytes, double secs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
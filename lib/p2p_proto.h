@@ -0,0 +1,237 @@
+// p2p_proto.h
+// libp2pcore: wire format shared by the registry, the peer and the
+// library's clients. Everything here is header-only so the C99 registry,
+// the C17 peer and C++ can all use it.
+
+#ifndef P2P_PROTO_H
+#define P2P_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Message action codes
+#define P2P_MSG_JOIN 0          // [0][id:4]
+#define P2P_MSG_PUBLISH 1       // [1][count:4] count NUL-terminated names
+#define P2P_MSG_SEARCH 2        // [2][name\0] -> [id:4][ip:4][port:2]
+#define P2P_MSG_FETCH 3         // peer to peer: [3][name\0] -> [code:1] data
+#define P2P_MSG_CLUSTER_MAP 4   // peer -> registry: request the shard list
+#define P2P_MSG_SHARD_PUBLISH 5 // registry -> owner: a peer's files for that shard, with attributes
+#define P2P_MSG_SHARD_LEAVE 6   // registry -> owner: a peer went away
+#define P2P_MSG_SHARD_SEARCH 7  // registry -> owner: SEARCH, always answered locally
+#define P2P_MSG_REPLICATE 8     // registry -> peer over UDP: copy a hot file
+#define P2P_MSG_FETCH_DELTA 9   // peer to peer: FETCH against an old copy, see p2p_delta.h
+#define P2P_MSG_PUBLISH_ATTRS 10 // [10][count:4] count x [attributes:24][name\0]
+#define P2P_MSG_SEARCH_FILTER 11 // [11][filter:33][name\0] -> [id:4][ip:4][port:2][attributes:24]
+#define P2P_MSG_SHARD_SEARCH_FILTER 12 // registry -> owner: SEARCH FILTER, answered locally
+#define P2P_MSG_SWARM 13        // [13][id:4][port:2][attributes:24][name\0] -> swarm reply, see below
+#define P2P_MSG_HAVE 14         // peer to peer: [14][name\0] -> [code:1][size:8][chunk size:4][bitfield]
+#define P2P_MSG_FETCH_CHUNK 15  // peer to peer: [15][index:4][port:2][name\0] -> [code:1] chunk data
+#define P2P_MSG_HASHES 16       // peer to peer: [16][name\0] -> [code:1][size:8][chunk hash:8]...
+
+#define P2P_MAX_NAME 101          // longest filename plus its NUL
+#define P2P_MAX_FETCH_NAME 100    // peers serve names of at most 99 bytes
+#define P2P_SEARCH_REPLY_LEN 10
+#define P2P_UDP_SEARCH_REPLY_LEN 16 // [2][request id:4][status:1] + SEARCH reply
+#define P2P_UDP_OK 0
+#define P2P_UDP_NOT_OWNER 1
+#define P2P_ATTRS_LEN 24
+#define P2P_FILTER_LEN 33
+#define P2P_FILTER_REPLY_LEN (P2P_SEARCH_REPLY_LEN + P2P_ATTRS_LEN)
+
+// Swarms. A file is split into chunks of P2P_SWARM_CHUNK bytes (the last
+// one shorter), and a peer downloading it serves the chunks it has to
+// the others. SWARM asks the registry who to get a file's chunks from;
+// its reply is [count:1][attributes:24] then P2P_SWARM_MAX_PEERS
+// locations, of which the first count are used. A nonzero port in the
+// request also makes the asker a member, reachable on that port, until
+// its connection closes or it stops asking for a while. HAVE returns a
+// peer's bitfield, chunk 0 in the top bit of the first byte, and the
+// port in FETCH CHUNK is the requester's serving port. HASHES returns
+// p2p_hash() of each chunk, so a downloader can check every chunk as it
+// lands; only a peer with the whole file answers it.
+#define P2P_SWARM_CHUNK (256 * 1024)
+#define P2P_SWARM_MAX_CHUNKS (1u << 20)
+#define P2P_SWARM_MAX_PEERS 16
+#define P2P_SWARM_REQUEST_LEN (1 + 4 + 2 + P2P_ATTRS_LEN) // before the name
+#define P2P_SWARM_REPLY_LEN (1 + P2P_ATTRS_LEN + P2P_SWARM_MAX_PEERS * P2P_SEARCH_REPLY_LEN)
+
+// SEARCH FILTER conditions
+#define P2P_FILTER_SIZE 0x01   // min_size <= size <= max_size
+#define P2P_FILTER_MTIME 0x02  // mtime >= min_mtime
+#define P2P_FILTER_DIGEST 0x04 // content digest equals digest; with an empty
+                               // name, any file with that content
+#define P2P_FILTER_NEWEST 0x08 // the newest version's holders, not just any
+
+// Where a SEARCH says a file is; all zero when nobody has it
+struct p2p_location {
+  uint32_t id;
+  uint32_t ip;   // network byte order, ready for sin_addr
+  uint16_t port; // host byte order
+};
+
+// What PUBLISH ATTRS says about a file; all zero when unknown
+struct p2p_file_attrs {
+  uint64_t size;
+  int64_t mtime;   // seconds since the epoch
+  uint64_t digest; // p2p_hash() of the contents, see p2p_delta.h
+};
+
+struct p2p_search_filter {
+  uint8_t flags;   // P2P_FILTER_*
+  uint64_t min_size;
+  uint64_t max_size;
+  int64_t min_mtime;
+  uint64_t digest;
+};
+
+static inline void p2p_put32(uint8_t *out, uint32_t v) {
+  for (int i = 3; i >= 0; i--, v >>= 8)
+    out[i] = (uint8_t)v;
+}
+
+static inline uint32_t p2p_get32(const uint8_t *in) {
+  return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+static inline void p2p_put64(uint8_t *out, uint64_t v) {
+  for (int i = 7; i >= 0; i--, v >>= 8)
+    out[i] = (uint8_t)v;
+}
+
+static inline uint64_t p2p_get64(const uint8_t *in) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = (v << 8) | in[i];
+  return v;
+}
+
+static inline void p2p_encode_attrs(uint8_t *out, const struct p2p_file_attrs *a) {
+  p2p_put64(out, a->size);
+  p2p_put64(out + 8, (uint64_t)a->mtime);
+  p2p_put64(out + 16, a->digest);
+}
+
+static inline void p2p_decode_attrs(const uint8_t *in, struct p2p_file_attrs *a) {
+  a->size = p2p_get64(in);
+  a->mtime = (int64_t)p2p_get64(in + 8);
+  a->digest = p2p_get64(in + 16);
+}
+
+static inline void p2p_encode_filter(uint8_t *out, const struct p2p_search_filter *f) {
+  out[0] = f->flags;
+  p2p_put64(out + 1, f->min_size);
+  p2p_put64(out + 9, f->max_size);
+  p2p_put64(out + 17, (uint64_t)f->min_mtime);
+  p2p_put64(out + 25, f->digest);
+}
+
+static inline void p2p_decode_filter(const uint8_t *in, struct p2p_search_filter *f) {
+  f->flags = in[0];
+  f->min_size = p2p_get64(in + 1);
+  f->max_size = p2p_get64(in + 9);
+  f->min_mtime = (int64_t)p2p_get64(in + 17);
+  f->digest = p2p_get64(in + 25);
+}
+
+static inline int p2p_filter_match(const struct p2p_search_filter *f,
+                                   const struct p2p_file_attrs *a) {
+  if ((f->flags & P2P_FILTER_SIZE) && (a->size < f->min_size || a->size > f->max_size))
+    return 0;
+  if ((f->flags & P2P_FILTER_MTIME) && a->mtime < f->min_mtime)
+    return 0;
+  if ((f->flags & P2P_FILTER_DIGEST) && a->digest != f->digest)
+    return 0;
+  return 1;
+}
+
+static inline size_t p2p_encode_join(uint8_t *out, uint32_t id) {
+  uint32_t id_net = htonl(id);
+  out[0] = P2P_MSG_JOIN;
+  memcpy(out + 1, &id_net, 4);
+  return 5;
+}
+
+// SEARCH or FETCH request for name; 0 if it doesn't fit in cap
+static inline size_t p2p_encode_request(uint8_t *out, size_t cap, uint8_t action,
+                                        const char *name) {
+  size_t len = strlen(name);
+  if (len + 2 > cap || len + 1 > P2P_MAX_NAME)
+    return 0;
+  out[0] = action;
+  memcpy(out + 1, name, len + 1);
+  return len + 2;
+}
+
+static inline void p2p_encode_location(uint8_t *out, const struct p2p_location *loc) {
+  uint32_t id_net = htonl(loc->id);
+  uint16_t port_net = htons(loc->port);
+  memcpy(out, &id_net, 4);
+  memcpy(out + 4, &loc->ip, 4);
+  memcpy(out + 8, &port_net, 2);
+}
+
+static inline void p2p_decode_location(const uint8_t *in, struct p2p_location *loc) {
+  uint32_t id_net;
+  uint16_t port_net;
+  memcpy(&id_net, in, 4);
+  memcpy(&loc->ip, in + 4, 4);
+  memcpy(&port_net, in + 8, 2);
+  loc->id = ntohl(id_net);
+  loc->port = ntohs(port_net);
+}
+
+// Chunks in a file of size bytes
+static inline uint32_t p2p_swarm_chunks(uint64_t size) {
+  return (uint32_t)((size + P2P_SWARM_CHUNK - 1) / P2P_SWARM_CHUNK);
+}
+
+// Bytes of a bitfield covering those chunks
+static inline size_t p2p_swarm_bits_len(uint64_t size) {
+  return (p2p_swarm_chunks(size) + 7) / 8;
+}
+
+static inline int p2p_bit_test(const uint8_t *bits, uint32_t i) {
+  return (bits[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static inline void p2p_bit_set(uint8_t *bits, uint32_t i) {
+  bits[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+}
+
+static inline void p2p_bit_clear(uint8_t *bits, uint32_t i) {
+  bits[i / 8] &= (uint8_t)~(0x80 >> (i % 8));
+}
+
+static inline int p2p_location_found(const struct p2p_location *loc) {
+  return loc->id != 0 || loc->ip != 0 || loc->port != 0;
+}
+
+// Position on the cluster's consistent-hash ring. Every registry and
+// peer must agree, so this is plain FNV-1a finished with a mixer that
+// spreads similar names and virtual-node keys apart.
+static inline uint32_t p2p_ring_hash(const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+// p2p_registry.h
+// libp2pcore: running the registry inside another program. The registry
+// keeps its state in globals, so a process hosts one at a time; it can
+// be stopped and opened again. Its TCP connections, shard links
+// included, run over TLS once p2p_tls_setup() has turned it on.
+
+#ifndef P2P_REGISTRY_H
+#define P2P_REGISTRY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct p2p_registry_options {
+  uint16_t port;      // TCP and UDP port; 0 picks a free one
+  int backlog;        // listen() backlog
+  double admit_rate;  // connections per second per source, in bursts of
+                      // twice that or max_peers; 0 admits all
+  int max_peers;      // locally joined peers (at most 256)
+  int quiet;          // don't print TEST] lines on stdout
+  int cpu;            // pin the event loop here and the catalog builder to
+                      // this CPU's NUMA node; -1 leaves both unpinned
+  int self_shard;     // our index in shards[]
+  int shard_count;    // 0 when stand-alone
+  const char *const *shards; // "host:port" of every cluster member, same order everywhere
+};
+
+// Fill in the defaults the registry program uses
+void p2p_registry_default_options(struct p2p_registry_options *opts);
+
+// Bind and listen. Returns the port bound, or -1 after printing why.
+int p2p_registry_open(const struct p2p_registry_options *opts);
+
+// Serve until p2p_registry_stop(), then close everything. Returns 0, or
+// -1 if the event loop failed.
+int p2p_registry_run(void);
+
+// Make p2p_registry_run() return; safe from any thread or a signal
+// handler while the registry is open
+void p2p_registry_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
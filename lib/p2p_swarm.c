@@ -0,0 +1,189 @@
+// p2p_swarm.c
+// libp2pcore: swarm downloads, the client side
+
+#define _GNU_SOURCE
+#include "p2p_swarm.h"
+#include "p2p_delta.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int p2p_swarm_query(int sock, uint32_t id, uint16_t port, const char *name,
+                    const struct p2p_file_attrs *attrs, struct p2p_swarm *swarm) {
+  uint8_t req[P2P_SWARM_REQUEST_LEN + P2P_MAX_NAME];
+  uint8_t reply[P2P_SWARM_REPLY_LEN];
+  size_t name_len = strlen(name) + 1;
+  if (name_len > P2P_MAX_NAME)
+    return P2P_EPROTO;
+
+  uint32_t id_net = htonl(id);
+  uint16_t port_net = htons(port);
+  req[0] = P2P_MSG_SWARM;
+  memcpy(req + 1, &id_net, 4);
+  memcpy(req + 5, &port_net, 2);
+  p2p_encode_attrs(req + 7, attrs);
+  memcpy(req + P2P_SWARM_REQUEST_LEN, name, name_len);
+  if (p2p_send_all(sock, req, P2P_SWARM_REQUEST_LEN + name_len) != 0)
+    return P2P_EPROTO;
+  if (p2p_recv_all(sock, reply, sizeof(reply)) != 0)
+    return P2P_ERECV;
+
+  swarm->count = reply[0] > P2P_SWARM_MAX_PEERS ? P2P_SWARM_MAX_PEERS : reply[0];
+  p2p_decode_attrs(reply + 1, &swarm->attrs);
+  for (int i = 0; i < swarm->count; i++)
+    p2p_decode_location(reply + 1 + P2P_ATTRS_LEN + i * P2P_SEARCH_REPLY_LEN, &swarm->peers[i]);
+  return P2P_OK;
+}
+
+// Send a HAVE or FETCH CHUNK request and read the response code
+static int request(int sock, const uint8_t *req, size_t len, uint64_t trace) {
+  uint8_t code;
+  if (p2p_send_all(sock, req, len) != 0)
+    return P2P_EPROTO;
+  P2P_TRACE(trace, P2P_TRACE_SENT, 0);
+  if (p2p_recv_all(sock, &code, 1) != 0)
+    return P2P_EPROTO;
+  P2P_TRACE(trace, P2P_TRACE_FIRST_BYTE, 0);
+  return code == 0 ? P2P_OK : P2P_ENOFILE;
+}
+
+int p2p_fetch_have(const char *host, const char *service, const char *name,
+                   uint64_t *size, uint8_t *bits, size_t cap) {
+  uint8_t req[1 + P2P_MAX_FETCH_NAME];
+  size_t len = p2p_encode_request(req, sizeof(req), P2P_MSG_HAVE, name);
+  if (len == 0)
+    return P2P_EPROTO;
+
+  int sock = p2p_connect(host, service, 0);
+  if (sock == -1)
+    return P2P_ECONNECT;
+  uint8_t head[12];
+  int rc = request(sock, req, len, 0);
+  if (rc == P2P_OK && p2p_recv_all(sock, head, sizeof(head)) != 0)
+    rc = P2P_ERECV;
+  if (rc == P2P_OK) {
+    uint32_t chunk_net;
+    memcpy(&chunk_net, head + 8, 4);
+    *size = p2p_get64(head);
+    if (ntohl(chunk_net) != P2P_SWARM_CHUNK || p2p_swarm_chunks(*size) > P2P_SWARM_MAX_CHUNKS ||
+        p2p_swarm_bits_len(*size) > cap)
+      rc = P2P_EPROTO;
+    else if (p2p_recv_all(sock, bits, p2p_swarm_bits_len(*size)) != 0)
+      rc = P2P_ERECV;
+  }
+  p2p_close(sock);
+  return rc;
+}
+
+int p2p_fetch_hashes(const char *host, const char *service, const char *name,
+                     uint64_t size, uint64_t *hashes) {
+  uint8_t req[1 + P2P_MAX_FETCH_NAME];
+  size_t len = p2p_encode_request(req, sizeof(req), P2P_MSG_HASHES, name);
+  if (len == 0 || p2p_swarm_chunks(size) > P2P_SWARM_MAX_CHUNKS)
+    return P2P_EPROTO;
+
+  int sock = p2p_connect(host, service, 0);
+  if (sock == -1)
+    return P2P_ECONNECT;
+  uint8_t buf[8 * 1024];
+  int rc = request(sock, req, len, 0);
+  if (rc == P2P_OK && p2p_recv_all(sock, buf, 8) != 0)
+    rc = P2P_ERECV;
+  if (rc == P2P_OK && p2p_get64(buf) != size)
+    rc = P2P_EPROTO;
+  uint32_t chunks = p2p_swarm_chunks(size);
+  for (uint32_t i = 0; rc == P2P_OK && i < chunks;) {
+    uint32_t n = chunks - i < sizeof(buf) / 8 ? chunks - i : sizeof(buf) / 8;
+    if (p2p_recv_all(sock, buf, 8 * (size_t)n) != 0) {
+      rc = P2P_ERECV;
+      break;
+    }
+    for (uint32_t j = 0; j < n; j++)
+      hashes[i + j] = p2p_get64(buf + 8 * j);
+    i += n;
+  }
+  p2p_close(sock);
+  return rc;
+}
+
+int p2p_swarm_hashes(int fd, uint64_t size, uint8_t *out) {
+  uint8_t *buf = malloc(P2P_SWARM_CHUNK);
+  if (!buf)
+    return P2P_ENOFILE;
+  int rc = P2P_OK;
+  for (uint64_t offset = 0; offset < size && rc == P2P_OK; offset += P2P_SWARM_CHUNK) {
+    size_t want = size - offset < P2P_SWARM_CHUNK ? (size_t)(size - offset) : P2P_SWARM_CHUNK;
+    size_t got = 0;
+    while (got < want) {
+      ssize_t n = pread(fd, buf + got, want - got, (off_t)(offset + got));
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        rc = P2P_ENOFILE;
+        break;
+      }
+      got += (size_t)n;
+    }
+    if (rc == P2P_OK)
+      p2p_put64(out + 8 * (offset / P2P_SWARM_CHUNK), p2p_hash(buf, want));
+  }
+  free(buf);
+  return rc;
+}
+
+int p2p_fetch_chunk(const char *host, const char *service, const char *name,
+                    uint32_t index, uint16_t port, uint64_t size,
+                    const struct p2p_sink *sink, size_t *received) {
+  uint8_t req[7 + P2P_MAX_FETCH_NAME];
+  size_t name_len = strlen(name) + 1;
+  *received = 0;
+  if (name_len > P2P_MAX_FETCH_NAME || index >= p2p_swarm_chunks(size))
+    return P2P_EPROTO;
+  uint32_t index_net = htonl(index);
+  uint16_t port_net = htons(port);
+  req[0] = P2P_MSG_FETCH_CHUNK;
+  memcpy(req + 1, &index_net, 4);
+  memcpy(req + 5, &port_net, 2);
+  memcpy(req + 7, name, name_len);
+
+  uint64_t start = (uint64_t)index * P2P_SWARM_CHUNK;
+  size_t want = size - start < P2P_SWARM_CHUNK ? (size_t)(size - start) : P2P_SWARM_CHUNK;
+  uint64_t trace = p2p_trace_begin(P2P_TRACE_FETCH_CHUNK);
+  int sock = p2p_connect_as(host, service, 0, P2P_NET_BULK);
+  if (sock == -1) {
+    P2P_TRACE(trace, P2P_TRACE_DONE, P2P_ECONNECT);
+    return P2P_ECONNECT;
+  }
+  P2P_TRACE(trace, P2P_TRACE_CONNECTED, 0);
+
+  // The chunk, then the end of the connection
+  int rc = request(sock, req, 7 + name_len, trace);
+  char buf[64 * 1024];
+  while (rc == P2P_OK) {
+    ssize_t n = p2p_recv(sock, buf, sizeof(buf), 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == 0)
+      break;
+    if (n < 0 || *received + (size_t)n > want)
+      rc = P2P_ERECV;
+    else if (p2p_sink_write(sink, buf, (size_t)n) != 0)
+      rc = P2P_ESINK;
+    else {
+      *received += (size_t)n;
+      P2P_TRACE(trace, P2P_TRACE_CHUNK, n);
+    }
+  }
+  if (rc == P2P_OK && *received != want)
+    rc = P2P_ERECV;
+  p2p_close(sock);
+  P2P_TRACE(trace, P2P_TRACE_DONE, rc);
+  return rc;
+}
@@ -0,0 +1,60 @@
+// p2p_swarm.h
+// libp2pcore: swarm downloads. Peers fetching the same file get it a
+// chunk at a time from everyone who has that chunk, the file's holders
+// and each other, so a new file's downloaders add upload capacity as
+// they arrive. Wire format in p2p_proto.h.
+
+#ifndef P2P_SWARM_H
+#define P2P_SWARM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "p2p_fetch.h"
+#include "p2p_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What SWARM returns
+struct p2p_swarm {
+  struct p2p_file_attrs attrs; // size and digest; all zero if unknown
+  int count;
+  struct p2p_location peers[P2P_SWARM_MAX_PEERS];
+};
+
+// SWARM for name on a registry socket. With port nonzero we also join
+// the swarm as peer id, serving chunks on port, for the file attrs
+// describes.
+int p2p_swarm_query(int sock, uint32_t id, uint16_t port, const char *name,
+                    const struct p2p_file_attrs *attrs, struct p2p_swarm *swarm);
+
+// HAVE: the size of the peer's copy of name, and into bits (cap bytes)
+// which of its chunks it has
+int p2p_fetch_have(const char *host, const char *service, const char *name,
+                   uint64_t *size, uint8_t *bits, size_t cap);
+
+// HASHES: the chunk hashes of the peer's copy of name, which must be size
+// bytes, into hashes (one per chunk). P2P_ENOFILE if the peer hasn't the
+// whole file.
+int p2p_fetch_hashes(const char *host, const char *service, const char *name,
+                     uint64_t size, uint64_t *hashes);
+
+// The chunk hashes of the first size bytes of fd, as HASHES sends them
+// (8 bytes each, big-endian) into out. P2P_ENOFILE if fd is shorter or
+// can't be read.
+int p2p_swarm_hashes(int fd, uint64_t size, uint8_t *out);
+
+// FETCH CHUNK index of name, a file of size bytes, into sink. port is
+// the one we serve chunks on, so the peer can tell we upload to it too;
+// 0 if we don't. P2P_ERECV unless the whole chunk arrives.
+int p2p_fetch_chunk(const char *host, const char *service, const char *name,
+                    uint32_t index, uint16_t port, uint64_t size,
+                    const struct p2p_sink *sink, size_t *received);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
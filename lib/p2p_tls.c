@@ -0,0 +1,468 @@
+// p2p_tls.c
+// libp2pcore: optional TLS, with the record layer in the kernel where
+// it will take it
+
+#define _GNU_SOURCE
+#include "p2p_tls.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+int p2p_tls_setup_env(void) {
+  const char *cert = getenv("P2P_TLS_CERT");
+  const char *key = getenv("P2P_TLS_KEY");
+  const char *ca = getenv("P2P_TLS_CA");
+  if (!cert && !key && !ca)
+    return P2P_OK;
+  return p2p_tls_setup(cert, key, ca);
+}
+
+#ifdef P2P_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_MAX_FD 65536
+#define TLS_RECORD 16384   // most plaintext one record carries
+#define TLS_WAIT_MS 5000   // for each step of a waiting handshake
+
+struct tls_conn {
+  SSL *ssl;
+  int done;        // handshake finished
+  int shut;        // close_notify sent
+  int offload;     // P2P_TLS_KTLS_* bits
+  uint8_t *unsent; // ciphertext not yet written, when encrypting in user space
+  size_t unsent_pos, unsent_len, unsent_cap;
+};
+
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+static int enabled = 0;
+static struct tls_conn *tls_conns[TLS_MAX_FD];
+
+static struct tls_conn *tls_of(int fd) {
+  return fd >= 0 && fd < TLS_MAX_FD ? tls_conns[fd] : NULL;
+}
+
+static SSL_CTX *new_ctx(const SSL_METHOD *method) {
+  SSL_CTX *ctx = SSL_CTX_new(method);
+  if (!ctx)
+    return NULL;
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // Offer the records to the kernel. Nothing may arrive after the
+  // handshake but data and close_notify: no renegotiation or tickets.
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET);
+  SSL_CTX_set_num_tickets(ctx, 0);
+  return ctx;
+}
+
+static void free_contexts(void) {
+  SSL_CTX_free(server_ctx);
+  SSL_CTX_free(client_ctx);
+  server_ctx = client_ctx = NULL;
+}
+
+int p2p_tls_setup(const char *cert, const char *key, const char *ca) {
+  free_contexts();
+  enabled = 0;
+
+  client_ctx = new_ctx(TLS_client_method());
+  if (!client_ctx) {
+    free_contexts();
+    return P2P_ETLS;
+  }
+  if (ca) {
+    if (SSL_CTX_load_verify_locations(client_ctx, ca, NULL) != 1) {
+      free_contexts();
+      return P2P_ETLS;
+    }
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+  } else {
+    fprintf(stderr, "WARNING: TLS without a CA: servers are not authenticated, "
+                    "so connections can be intercepted\n");
+  }
+
+  if (cert || key) {
+    server_ctx = cert && key ? new_ctx(TLS_server_method()) : NULL;
+    if (!server_ctx || SSL_CTX_use_certificate_chain_file(server_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(server_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(server_ctx) != 1) {
+      free_contexts();
+      return P2P_ETLS;
+    }
+  }
+  enabled = 1;
+  return P2P_OK;
+}
+
+int p2p_tls_enabled(void) { return enabled; }
+
+// Forget fd's TLS state without closing it
+static void drop_state(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t)
+    return;
+  SSL_free(t->ssl);
+  free(t->unsent);
+  free(t);
+  tls_conns[fd] = NULL;
+}
+
+int p2p_tls_start(int fd, int server, const char *host) {
+  SSL_CTX *ctx = server ? server_ctx : client_ctx;
+  if (!enabled || !ctx || fd < 0 || fd >= TLS_MAX_FD || tls_conns[fd])
+    return P2P_ETLS;
+
+  struct tls_conn *t = calloc(1, sizeof(*t));
+  if (!t)
+    return P2P_ETLS;
+  t->ssl = SSL_new(ctx);
+  if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1) {
+    SSL_free(t->ssl);
+    free(t);
+    return P2P_ETLS;
+  }
+  if (server) {
+    SSL_set_accept_state(t->ssl);
+  } else {
+    // The certificate names the address, or else the host name, which
+    // also goes out as SNI
+    X509_VERIFY_PARAM *param = SSL_get0_param(t->ssl);
+    if (host && X509_VERIFY_PARAM_set1_ip_asc(param, host) != 1 &&
+        (SSL_set1_host(t->ssl, host) != 1 || SSL_set_tlsext_host_name(t->ssl, host) != 1)) {
+      SSL_free(t->ssl);
+      free(t);
+      return P2P_ETLS;
+    }
+    SSL_set_connect_state(t->ssl);
+  }
+  tls_conns[fd] = t;
+  return P2P_OK;
+}
+
+int p2p_tls_handshake(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t)
+    return P2P_ETLS;
+  if (t->done)
+    return P2P_OK;
+
+  ERR_clear_error();
+  int rc = SSL_do_handshake(t->ssl);
+  if (rc != 1) {
+    switch (SSL_get_error(t->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+      return P2P_TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return P2P_TLS_WANT_WRITE;
+    default:
+      return P2P_ETLS;
+    }
+  }
+
+  t->done = 1;
+  if (BIO_get_ktls_send(SSL_get_wbio(t->ssl)))
+    t->offload |= P2P_TLS_KTLS_TX;
+  if (BIO_get_ktls_recv(SSL_get_rbio(t->ssl)))
+    t->offload |= P2P_TLS_KTLS_RX;
+  if (!(t->offload & P2P_TLS_KTLS_TX)) {
+    // Encrypt into memory and write the records out ourselves, so a full
+    // socket never leaves OpenSSL holding half of one
+    BIO *mem = BIO_new(BIO_s_mem());
+    if (!mem)
+      return P2P_ETLS;
+    SSL_set0_wbio(t->ssl, mem);
+  }
+  return P2P_OK;
+}
+
+// Start and finish the handshake, polling while it waits on the socket
+static int handshake_wait(int fd, int server, const char *host) {
+  if (p2p_tls_start(fd, server, host) != P2P_OK)
+    return P2P_ETLS;
+  for (;;) {
+    int rc = p2p_tls_handshake(fd);
+    if (rc == P2P_OK)
+      return P2P_OK;
+    if (rc < 0)
+      break;
+    struct pollfd pfd = {.fd = fd, .events = rc == P2P_TLS_WANT_READ ? POLLIN : POLLOUT};
+    int n = poll(&pfd, 1, TLS_WAIT_MS);
+    if (n == 0 || (n == -1 && errno != EINTR))
+      break;
+  }
+  drop_state(fd);
+  return P2P_ETLS;
+}
+
+int p2p_tls_client(int fd, const char *host) { return handshake_wait(fd, 0, host); }
+
+int p2p_tls_server(int fd) { return handshake_wait(fd, 1, NULL); }
+
+int p2p_tls_offload(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  return t ? t->offload : 0;
+}
+
+// Move what OpenSSL encrypted from its memory BIO to our unsent buffer
+static int take_ciphertext(struct tls_conn *t) {
+  BIO *mem = SSL_get_wbio(t->ssl);
+  size_t avail = BIO_ctrl_pending(mem);
+  if (avail == 0)
+    return 0;
+
+  if (t->unsent_pos > 0) {
+    memmove(t->unsent, t->unsent + t->unsent_pos, t->unsent_len - t->unsent_pos);
+    t->unsent_len -= t->unsent_pos;
+    t->unsent_pos = 0;
+  }
+  if (t->unsent_len + avail > t->unsent_cap) {
+    uint8_t *grown = realloc(t->unsent, t->unsent_len + avail);
+    if (!grown)
+      return -1;
+    t->unsent = grown;
+    t->unsent_cap = t->unsent_len + avail;
+  }
+  int n = BIO_read(mem, t->unsent + t->unsent_len, (int)avail);
+  if (n > 0)
+    t->unsent_len += (size_t)n;
+  return 0;
+}
+
+static int flush_unsent(struct tls_conn *t, int fd, int flags) {
+  while (t->unsent_pos < t->unsent_len) {
+    ssize_t n = send(fd, t->unsent + t->unsent_pos, t->unsent_len - t->unsent_pos,
+                     flags | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    t->unsent_pos += (size_t)n;
+  }
+  t->unsent_pos = t->unsent_len = 0;
+  return 0;
+}
+
+ssize_t p2p_send(int fd, const void *buf, size_t len, int flags) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t || (t->offload & P2P_TLS_KTLS_TX))
+    return send(fd, buf, len, flags);
+  if (!t->done) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  // One record at a time, and only once the last one is out
+  if (flush_unsent(t, fd, flags) != 0)
+    return -1;
+  if (len > TLS_RECORD)
+    len = TLS_RECORD;
+  if (len == 0)
+    return 0;
+  ERR_clear_error();
+  int n = SSL_write(t->ssl, buf, (int)len);
+  if (n <= 0) {
+    errno = EIO;
+    return -1;
+  }
+  if (take_ciphertext(t) != 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  // The record is accepted now; a full socket just leaves it unsent
+  if (flush_unsent(t, fd, flags) != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    return -1;
+  return n;
+}
+
+ssize_t p2p_sendmsg(int fd, const struct msghdr *msg, int flags) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t || (t->offload & P2P_TLS_KTLS_TX))
+    return sendmsg(fd, msg, flags);
+
+  // Gather one record's worth
+  uint8_t buf[TLS_RECORD];
+  size_t len = 0;
+  for (size_t i = 0; i < msg->msg_iovlen && len < sizeof(buf); i++) {
+    size_t n = msg->msg_iov[i].iov_len;
+    if (n > sizeof(buf) - len)
+      n = sizeof(buf) - len;
+    memcpy(buf + len, msg->msg_iov[i].iov_base, n);
+    len += n;
+  }
+  return p2p_send(fd, buf, len, flags);
+}
+
+ssize_t p2p_recv(int fd, void *buf, size_t len, int flags) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t)
+    return recv(fd, buf, len, flags);
+  if (!t->done) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if ((flags & MSG_DONTWAIT) && SSL_pending(t->ssl) == 0) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (t->unsent_len > 0)
+    flush_unsent(t, fd, MSG_DONTWAIT);
+
+  ERR_clear_error();
+  errno = 0;
+  int n = SSL_read(t->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+  if (n > 0)
+    return n;
+  switch (SSL_get_error(t->ssl, n)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0; // close_notify: the data really ended
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0)
+      errno = ECONNRESET;
+    return -1;
+  default:
+    errno = ECONNRESET; // includes a close without close_notify
+    return -1;
+  }
+}
+
+ssize_t p2p_sendfile(int sock, int fd, off_t *offset, size_t count) {
+  struct tls_conn *t = tls_of(sock);
+  if (!t || (t->offload & P2P_TLS_KTLS_TX))
+    return sendfile(sock, fd, offset, count);
+
+  uint8_t buf[TLS_RECORD];
+  ssize_t n = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), *offset);
+  if (n <= 0)
+    return n;
+  ssize_t sent = p2p_send(sock, buf, (size_t)n, 0);
+  if (sent > 0)
+    *offset += sent;
+  return sent;
+}
+
+size_t p2p_tls_pending(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  return t && t->done ? (size_t)SSL_pending(t->ssl) : 0;
+}
+
+size_t p2p_tls_unsent(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  return t ? t->unsent_len - t->unsent_pos : 0;
+}
+
+int p2p_tls_flush(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  return t ? flush_unsent(t, fd, 0) : 0;
+}
+
+int p2p_tls_shutdown(int fd) {
+  struct tls_conn *t = tls_of(fd);
+  if (!t || !t->done)
+    return P2P_OK;
+
+  if (!t->shut) {
+    ERR_clear_error();
+    int rc = SSL_shutdown(t->ssl);
+    if (rc < 0)
+      return SSL_get_error(t->ssl, rc) == SSL_ERROR_WANT_WRITE ? P2P_TLS_WANT_WRITE : P2P_ETLS;
+    t->shut = 1;
+    if (!(t->offload & P2P_TLS_KTLS_TX) && take_ciphertext(t) != 0)
+      return P2P_ETLS;
+  }
+  if (flush_unsent(t, fd, 0) != 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? P2P_TLS_WANT_WRITE : P2P_ETLS;
+  return P2P_OK;
+}
+
+int p2p_close(int fd) {
+  drop_state(fd);
+  return close(fd);
+}
+
+#else // !P2P_TLS
+
+int p2p_tls_setup(const char *cert, const char *key, const char *ca) {
+  (void)cert;
+  (void)key;
+  (void)ca;
+  return P2P_ETLS;
+}
+
+int p2p_tls_enabled(void) { return 0; }
+
+int p2p_tls_start(int fd, int server, const char *host) {
+  (void)fd;
+  (void)server;
+  (void)host;
+  return P2P_ETLS;
+}
+
+int p2p_tls_handshake(int fd) {
+  (void)fd;
+  return P2P_ETLS;
+}
+
+int p2p_tls_client(int fd, const char *host) { return p2p_tls_start(fd, 0, host); }
+
+int p2p_tls_server(int fd) { return p2p_tls_start(fd, 1, NULL); }
+
+int p2p_tls_offload(int fd) {
+  (void)fd;
+  return 0;
+}
+
+ssize_t p2p_send(int fd, const void *buf, size_t len, int flags) {
+  return send(fd, buf, len, flags);
+}
+
+ssize_t p2p_sendmsg(int fd, const struct msghdr *msg, int flags) {
+  return sendmsg(fd, msg, flags);
+}
+
+ssize_t p2p_recv(int fd, void *buf, size_t len, int flags) {
+  return recv(fd, buf, len, flags);
+}
+
+ssize_t p2p_sendfile(int sock, int fd, off_t *offset, size_t count) {
+  return sendfile(sock, fd, offset, count);
+}
+
+size_t p2p_tls_pending(int fd) {
+  (void)fd;
+  return 0;
+}
+
+size_t p2p_tls_unsent(int fd) {
+  (void)fd;
+  return 0;
+}
+
+int p2p_tls_flush(int fd) {
+  (void)fd;
+  return 0;
+}
+
+int p2p_tls_shutdown(int fd) {
+  (void)fd;
+  return P2P_OK;
+}
+
+int p2p_close(int fd) { return close(fd); }
+
+#endif
@@ -0,0 +1,94 @@
+// p2p_tls.h
+// libp2pcore: optional TLS for registry and FETCH connections. OpenSSL
+// runs the handshake, then the record layer is handed to the kernel
+// (kTLS) where it will take it, so sendfile() serving stays zero-copy on
+// encrypted sockets. Where it won't, records are encrypted in user space
+// behind the same calls. Built in with `make P2P_TLS=1`; without it TLS
+// can't be turned on and the calls below are the plain system calls.
+//
+// TLS state is kept per descriptor. Code that may run over TLS uses
+// p2p_send(), p2p_recv() and friends instead of the system calls and
+// p2p_close() to close. p2p_connect() starts TLS by itself once
+// p2p_tls_setup() has turned it on.
+
+#ifndef P2P_TLS_H
+#define P2P_TLS_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "p2p_fetch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// p2p_tls_handshake() and p2p_tls_shutdown(): call again once the socket
+// is readable or writable
+#define P2P_TLS_WANT_READ 1
+#define P2P_TLS_WANT_WRITE 2
+
+// p2p_tls_offload() bits
+#define P2P_TLS_KTLS_TX 1
+#define P2P_TLS_KTLS_RX 2
+
+// Turn TLS on for this process. cert and key (PEM files) are needed to
+// accept connections. With ca, a server's certificate must chain to it
+// and name the host or address connected to. Without ca any certificate
+// is accepted: connections are encrypted but not authenticated, and
+// whoever answers on an address can read and change what is sent, so
+// setup says so on stderr. Returns P2P_OK or P2P_ETLS.
+int p2p_tls_setup(const char *cert, const char *key, const char *ca);
+
+// p2p_tls_setup() from P2P_TLS_CERT, P2P_TLS_KEY and P2P_TLS_CA; P2P_OK
+// and TLS left off when none is set
+int p2p_tls_setup_env(void);
+
+int p2p_tls_enabled(void);
+
+// Attach TLS state to a connected socket, as the accepting side if
+// server. A client gives the host name or address it connected to, which
+// the server's certificate is checked against; servers give NULL. The
+// handshake is then driven by p2p_tls_handshake(), which returns P2P_OK
+// once it is done, P2P_TLS_WANT_* or P2P_ETLS.
+int p2p_tls_start(int fd, int server, const char *host);
+int p2p_tls_handshake(int fd);
+
+// Start and finish the handshake, waiting up to a few seconds even on a
+// non-blocking socket. On failure the TLS state is gone again.
+int p2p_tls_client(int fd, const char *host);
+int p2p_tls_server(int fd);
+
+// Which directions the kernel took over; 0 for plain sockets
+int p2p_tls_offload(int fd);
+
+// send(), recv() and sendfile() through the connection's TLS, if any.
+// Without kernel offload p2p_send() may keep up to one record of
+// ciphertext (p2p_tls_unsent()) that p2p_tls_flush() writes out; and
+// p2p_recv() may leave decrypted bytes (p2p_tls_pending()) that poll()
+// won't report.
+ssize_t p2p_send(int fd, const void *buf, size_t len, int flags);
+ssize_t p2p_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t p2p_recv(int fd, void *buf, size_t len, int flags);
+ssize_t p2p_sendfile(int sock, int fd, off_t *offset, size_t count);
+size_t p2p_tls_pending(int fd);
+size_t p2p_tls_unsent(int fd);
+
+// 0 once nothing is unsent, else -1 with errno set (EAGAIN: try again
+// when writable)
+int p2p_tls_flush(int fd);
+
+// Send close_notify, which tells the other end the data ended there
+// rather than being cut off. P2P_OK, P2P_TLS_WANT_WRITE or P2P_ETLS.
+int p2p_tls_shutdown(int fd);
+
+// Drop the TLS state and close the descriptor. Without a close_notify
+// first, the other end sees the data cut off.
+int p2p_close(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,189 @@
+// p2p_trace.c
+// libp2pcore: per-thread binary trace rings
+
+#define _GNU_SOURCE
+#include "p2p_trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct trace_ring {
+  struct trace_ring *next; // every ring, newest first
+  _Atomic uint64_t head;   // records ever written
+  atomic_int owned;        // a live thread writes here
+  uint32_t tid;
+  struct p2p_trace_record recs[P2P_TRACE_RING];
+};
+
+int p2p_tracing = 0;
+
+static _Atomic(struct trace_ring *) rings = NULL;
+static _Thread_local struct trace_ring *my_ring = NULL;
+static pthread_key_t ring_key; // runs ring_release() at thread exit
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Atomic uint32_t next_id = 0;
+static uint64_t id_base = 0; // process id, high half of request ids
+static char exit_path[4096];
+
+// Hand the exiting thread's ring to the next thread that traces
+static void ring_release(void *arg) {
+  struct trace_ring *r = arg;
+  my_ring = NULL;
+  atomic_store_explicit(&r->owned, 0, memory_order_release);
+}
+
+static void ring_key_create(void) { pthread_key_create(&ring_key, ring_release); }
+
+// A ring an exited thread left, or a new one. Rings are never freed, so
+// a dump keeps an exited thread's records until its ring is taken, and
+// there are never more rings than threads that traced at once.
+static struct trace_ring *ring_new(void) {
+  pthread_once(&ring_key_once, ring_key_create);
+  struct trace_ring *r;
+  for (r = atomic_load(&rings); r; r = r->next) {
+    int free_ring = 0;
+    if (atomic_compare_exchange_strong(&r->owned, &free_ring, 1))
+      break;
+  }
+  if (!r) {
+    r = calloc(1, sizeof(*r));
+    if (!r)
+      return NULL;
+    atomic_init(&r->owned, 1);
+    struct trace_ring *old = atomic_load(&rings);
+    do
+      r->next = old;
+    while (!atomic_compare_exchange_weak(&rings, &old, r));
+  }
+  r->tid = (uint32_t)syscall(SYS_gettid);
+  my_ring = r;
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+void p2p_trace_event(uint64_t id, int event, int64_t arg) {
+  struct trace_ring *r = my_ring ? my_ring : ring_new();
+  if (!r)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  // Only this thread writes the ring; the release store publishes the
+  // record to a dump running elsewhere
+  uint64_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  struct p2p_trace_record *rec = &r->recs[pos & (P2P_TRACE_RING - 1)];
+  rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+  rec->id = id;
+  rec->arg = arg;
+  rec->event = (uint32_t)event;
+  rec->tid = r->tid;
+  atomic_store_explicit(&r->head, pos + 1, memory_order_release);
+}
+
+uint64_t p2p_trace_begin(int kind) {
+  if (!p2p_tracing)
+    return 0;
+  uint64_t id = id_base | (atomic_fetch_add(&next_id, 1) + 1u);
+  p2p_trace_event(id, P2P_TRACE_BEGIN, kind);
+  return id;
+}
+
+int p2p_trace_dump(const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    return -1;
+  struct p2p_trace_header header = {.version = P2P_TRACE_VERSION,
+                                    .record_size = sizeof(struct p2p_trace_record)};
+  memcpy(header.magic, P2P_TRACE_MAGIC, sizeof(header.magic));
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+  for (struct trace_ring *r = atomic_load(&rings); r && ok; r = r->next) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t first = head > P2P_TRACE_RING ? head - P2P_TRACE_RING : 0;
+    for (uint64_t pos = first; pos < head && ok; pos++)
+      ok = fwrite(&r->recs[pos & (P2P_TRACE_RING - 1)], sizeof(r->recs[0]), 1, fp) == 1;
+  }
+  if (fclose(fp) != 0 || !ok) {
+    if (errno == 0)
+      errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static void dump_at_exit(void) {
+  p2p_tracing = 0;
+  if (p2p_trace_dump(exit_path) != 0)
+    perror(exit_path);
+}
+
+void p2p_trace_start(const char *path) {
+  static int registered = 0;
+  id_base = (uint64_t)getpid() << 32;
+  if (path) {
+    snprintf(exit_path, sizeof(exit_path), "%s", path);
+    if (!registered && atexit(dump_at_exit) == 0)
+      registered = 1;
+  }
+  p2p_tracing = 1;
+}
+
+void p2p_trace_setup_env(void) {
+  const char *base = getenv("P2P_TRACE");
+  if (!base || !*base)
+    return;
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.%d", base, (int)getpid());
+  p2p_trace_start(path);
+}
+
+const char *p2p_trace_kind_name(int kind) {
+  switch (kind) {
+  case P2P_TRACE_FETCH:
+    return "FETCH";
+  case P2P_TRACE_FETCH_DELTA:
+    return "FETCH DELTA";
+  case P2P_TRACE_SEARCH:
+    return "SEARCH";
+  case P2P_TRACE_SEARCH_UDP:
+    return "SEARCH UDP";
+  case P2P_TRACE_SERVE:
+    return "SERVE";
+  case P2P_TRACE_REG_SEARCH:
+    return "REGISTRY SEARCH";
+  case P2P_TRACE_FETCH_CHUNK:
+    return "FETCH CHUNK";
+  default:
+    return "unknown";
+  }
+}
+
+const char *p2p_trace_event_name(int event) {
+  switch (event) {
+  case P2P_TRACE_BEGIN:
+    return "begin";
+  case P2P_TRACE_CONNECTED:
+    return "connected";
+  case P2P_TRACE_REQUEST:
+    return "request";
+  case P2P_TRACE_SENT:
+    return "sent";
+  case P2P_TRACE_FORWARD:
+    return "forward";
+  case P2P_TRACE_FIRST_BYTE:
+    return "first byte";
+  case P2P_TRACE_CHUNK:
+    return "chunk";
+  case P2P_TRACE_DONE:
+    return "done";
+  default:
+    return "?";
+  }
+}
@@ -0,0 +1,99 @@
+// p2p_trace.h
+// libp2pcore: per-request tracing. Tracepoints append fixed-size binary
+// records to a ring owned by the calling thread, with no locks and no
+// system calls beyond reading the clock; when tracing is off each costs
+// a load and a branch. The rings are written to a file on demand or at
+// exit and read back by the p2ptrace tool, which rebuilds each request's
+// timeline.
+//
+// Request ids are unique across processes (the process id is the high
+// half), but a request only has the records of the process that began
+// it: a FETCH and the peer serving it are two requests. Timestamps are
+// CLOCK_MONOTONIC, so dumps of processes on one host can be loaded
+// together and their timelines lined up by time.
+
+#ifndef P2P_TRACE_H
+#define P2P_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What a request is; the argument of its P2P_TRACE_BEGIN record
+#define P2P_TRACE_FETCH 1       // whole-file FETCH
+#define P2P_TRACE_FETCH_DELTA 2 // delta FETCH
+#define P2P_TRACE_SEARCH 3      // SEARCH or SEARCH FILTER over TCP
+#define P2P_TRACE_SEARCH_UDP 4  // SEARCH over UDP
+#define P2P_TRACE_SERVE 5       // answering a FETCH
+#define P2P_TRACE_REG_SEARCH 6  // registry answering a SEARCH
+#define P2P_TRACE_FETCH_CHUNK 7 // one chunk of a swarm download
+
+// Events, in the order they happen within a request. Each request has a
+// subset; the argument is noted where there is one.
+#define P2P_TRACE_BEGIN 1      // kind
+#define P2P_TRACE_CONNECTED 2
+#define P2P_TRACE_REQUEST 3    // request fully received
+#define P2P_TRACE_SENT 4       // request (or, over UDP, a try of it) sent; try number
+#define P2P_TRACE_FORWARD 5    // passed on to another shard; shard index
+#define P2P_TRACE_FIRST_BYTE 6 // first byte of the response received or sent
+#define P2P_TRACE_CHUNK 7      // file bytes moved
+#define P2P_TRACE_DONE 8       // P2P_OK or a P2P_E* code
+
+// Records each thread's ring keeps, the newest; a power of two. Once a
+// thread exits its ring goes to the next thread that traces, so a dump
+// has what exited threads did until then.
+#define P2P_TRACE_RING 16384
+
+// Dumps: this header, then the records in host byte order
+#define P2P_TRACE_MAGIC "P2PTRACE"
+#define P2P_TRACE_VERSION 1
+
+struct p2p_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+struct p2p_trace_record {
+  uint64_t ts_ns; // CLOCK_MONOTONIC
+  uint64_t id;    // request
+  int64_t arg;
+  uint32_t event;
+  uint32_t tid;   // thread that wrote it
+};
+
+// Nonzero while tracing; read by P2P_TRACE()
+extern int p2p_tracing;
+
+// Start tracing. With a path, the rings are dumped there at exit.
+void p2p_trace_start(const char *path);
+
+// p2p_trace_start("$P2P_TRACE.<pid>") if P2P_TRACE is set
+void p2p_trace_setup_env(void);
+
+// Write every thread's ring to path. Records written meanwhile may be
+// torn. 0, or -1 with errno set.
+int p2p_trace_dump(const char *path);
+
+// New request id with its P2P_TRACE_BEGIN record; 0 when not tracing
+uint64_t p2p_trace_begin(int kind);
+
+void p2p_trace_event(uint64_t id, int event, int64_t arg);
+
+// Tracepoint; requests begun while tracing was off have id 0
+#define P2P_TRACE(id, event, arg)                                         \
+  do {                                                                    \
+    if (p2p_tracing && (id) != 0)                                         \
+      p2p_trace_event((id), (event), (arg));                              \
+  } while (0)
+
+const char *p2p_trace_kind_name(int kind);
+const char *p2p_trace_event_name(int event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
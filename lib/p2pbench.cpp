@@ -0,0 +1,171 @@
+// p2pbench.cpp
+// A registry and many peers inside one process, for quick end-to-end
+// timings without spawning programs:
+//   p2pbench [peers [searches_per_peer [file_KB [workers]]]]
+// Every peer serves one file of its own, from a FileServer with that
+// many pinned workers; each round all peers SEARCH for their neighbour's
+// file at once, then each peer fetches that file. Last the registry
+// restarts and every peer re-JOINs at once, through connection admission
+// and backing off as the peer program does when refused.
+// With P2P_TLS_CERT and P2P_TLS_KEY set (and the library built with
+// P2P_TLS=1) every connection runs over TLS instead; with P2P_TRACE set
+// every request is traced (see p2p_trace.h). P2P_NET* set the transport
+// profiles (see p2p_net.h).
+
+#include "p2p.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string file_name(int i) { return "f" + std::to_string(i) + ".bin"; }
+
+// Connect, JOIN and PUBLISH until the registry keeps the connection,
+// waiting as peer.c's schedule_rejoin() does between tries. A refused
+// connection is closed unread, so a SEARCH is what notices. Returns the
+// number of refusals.
+int rejoin(std::unique_ptr<p2p::Registry> &client, const std::string &reg_port,
+           uint16_t local_port, int i) {
+  std::minstd_rand rng(static_cast<unsigned>(i + 1));
+  for (int failures = 0;; failures++) {
+    try {
+      client.reset();
+      client = std::make_unique<p2p::Registry>("127.0.0.1", reg_port, local_port);
+      client->join(static_cast<uint32_t>(i + 1));
+      client->publish({file_name(i)});
+      client->search("probe").get();
+      return failures;
+    } catch (const p2p::Error &) {
+    } catch (const std::system_error &) {
+    }
+    long cap = std::min(200L << std::min(failures, 16), 30000L);
+    long delay = cap / 2 + static_cast<long>(rng() % (cap / 2 + 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  int peers = argc > 1 ? std::atoi(argv[1]) : 32;
+  int rounds = argc > 2 ? std::atoi(argv[2]) : 100;
+  long file_kb = argc > 3 ? std::atol(argv[3]) : 1024;
+  int workers = argc > 4 ? std::atoi(argv[4]) : 1;
+  if (argc > 5 || peers < 2 || peers > 256 || rounds < 1 || file_kb < 0 || workers < 1) {
+    std::fprintf(stderr, "usage: %s [peers (2-256) [searches_per_peer [file_KB [workers]]]]\n",
+                 argv[0]);
+    return 2;
+  }
+
+  if (p2p_tls_setup_env() != P2P_OK) {
+    std::fprintf(stderr, "p2pbench: can't set up TLS\n");
+    return 1;
+  }
+  p2p_trace_setup_env();
+  p2p_net_setup_env();
+
+  char tmpl[] = "/tmp/p2pbench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string root = tmpl;
+
+  int rc = 0;
+  try {
+    p2p_registry_options opts = p2p::Server::defaults();
+    opts.max_peers = peers;
+    opts.quiet = 1;
+    auto server = std::make_unique<p2p::Server>(opts);
+    std::string reg_port = std::to_string(server->port());
+
+    std::vector<std::unique_ptr<p2p::FileServer>> files;
+    std::vector<std::unique_ptr<p2p::Registry>> clients;
+    std::string data(file_kb * 1024, 'x');
+    for (int i = 0; i < peers; i++) {
+      std::string dir = root + "/" + std::to_string(i);
+      std::filesystem::create_directory(dir);
+      std::ofstream(dir + "/" + file_name(i), std::ios::binary) << data;
+
+      files.push_back(std::make_unique<p2p::FileServer>(dir, 0, static_cast<unsigned>(workers)));
+      clients.emplace_back();
+      rejoin(clients.back(), reg_port, files.back()->port(), i);
+    }
+
+    // PUBLISH has no reply; wait until the last one is visible
+    while (!clients[0]->search(file_name(peers - 1)).get())
+      usleep(1000);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<p2p::Location> found(peers);
+    for (int r = 0; r < rounds; r++) {
+      std::vector<std::future<std::optional<p2p::Location>>> pending;
+      for (int i = 0; i < peers; i++)
+        pending.push_back(clients[i]->search(file_name((i + 1) % peers)));
+      for (int i = 0; i < peers; i++) {
+        auto loc = pending[i].get();
+        if (!loc)
+          throw std::runtime_error("SEARCH missed " + file_name((i + 1) % peers));
+        found[i] = *loc;
+      }
+    }
+    double search_secs = seconds_since(start);
+    std::printf("SEARCH: %d in %.3f s, %.0f/s\n", peers * rounds, search_secs,
+                peers * rounds / search_secs);
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::future<size_t>> fetches;
+    for (int i = 0; i < peers; i++)
+      fetches.push_back(p2p::Peer(found[i]).fetch(file_name((i + 1) % peers),
+                                                  [](const void *, size_t) { return true; }));
+    size_t total = 0;
+    for (auto &f : fetches)
+      total += f.get();
+    double fetch_secs = seconds_since(start);
+    std::printf("FETCH: %d files, %zu bytes in %.3f s, %.1f MB/s%s\n", peers, total, fetch_secs,
+                total / fetch_secs / 1e6, p2p_tls_enabled() ? " over TLS" : "");
+
+    // Same port, empty registry: everyone reconnects at once
+    opts.port = server->port();
+    server.reset();
+    server = std::make_unique<p2p::Server>(opts);
+    start = std::chrono::steady_clock::now();
+    std::vector<std::future<int>> rejoins;
+    for (int i = 0; i < peers; i++)
+      rejoins.push_back(std::async(std::launch::async, rejoin, std::ref(clients[i]),
+                                   std::cref(reg_port), files[i]->port(), i));
+    int refused = 0;
+    for (auto &r : rejoins)
+      refused += r.get();
+    for (int i = 0; i < peers; i++)
+      while (!clients[0]->search(file_name(i)).get())
+        usleep(1000);
+    std::printf("re-JOIN: %d peers back in %.3f s, %d refused (admit rate %g)\n", peers,
+                seconds_since(start), refused, opts.admit_rate);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "p2pbench: %s\n", e.what());
+    rc = 1;
+  }
+
+  std::error_code ec;
+  std::filesystem::remove_all(root, ec);
+  return rc;
+}
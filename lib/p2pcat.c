@@ -0,0 +1,37 @@
+// p2pcat.c
+// Stream a file from a peer to stdout: p2pcat <peer_host> <peer_port> <filename>
+// When stdout is a pipe the data goes socket -> pipe with splice().
+// P2P_TLS_CA (or P2P_TLS_CERT and P2P_TLS_KEY) fetch over TLS; P2P_TRACE
+// traces the fetch (see p2p_trace.h); P2P_NET* tune it (see p2p_net.h).
+
+#include "p2p_fetch.h"
+#include "p2p_net.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <peer_host> <peer_port> <filename>\n", argv[0]);
+    return 2;
+  }
+
+  if (p2p_tls_setup_env() != P2P_OK) {
+    fprintf(stderr, "%s: can't set up TLS\n", argv[0]);
+    return 1;
+  }
+  p2p_trace_setup_env();
+  p2p_net_setup_env();
+
+  struct p2p_sink out = p2p_fd_sink(STDOUT_FILENO);
+  size_t received = 0;
+  int rc = p2p_fetch(argv[1], argv[2], argv[3], &out, &received);
+  if (rc != P2P_OK) {
+    fprintf(stderr, "%s: %s (%zu bytes received)\n", argv[3], p2p_strerror(rc),
+            received);
+    return 1;
+  }
+  return 0;
+}
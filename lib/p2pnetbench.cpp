@@ -0,0 +1,108 @@
+// p2pnetbench.cpp
+// Transport profiles (see p2p_net.h) off and then on, inside one process:
+//   p2pnetbench [requests [file_MB [fetches]]]
+// The control part times a PUBLISH followed by a SEARCH on one registry
+// connection, requests times over; the bulk part fetches a file_MB file
+// fetches times, one connection after another, so with profiles on the
+// first fetch measures the path and the rest are sized from it.
+// Loopback has next to no delay, so the buffers only come into play with
+// some added, e.g. `tc qdisc add dev lo root netem delay 25ms` (and
+// `tc qdisc del dev lo root` afterwards). P2P_NET_CC and P2P_NET_MBPS
+// apply to the runs with profiles on.
+
+#include "p2p.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Microseconds per PUBLISH and SEARCH pair, on a registry whose
+// connections are tuned as p2p_net_setup() last said
+double control_run(int requests) {
+  p2p_registry_options opts = p2p::Server::defaults();
+  opts.quiet = 1;
+  p2p::Server server(opts);
+  p2p::Registry client("127.0.0.1", std::to_string(server.port()));
+  client.join(1);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    std::string name = "c" + std::to_string(i);
+    client.publish({name});
+    if (!client.search(name).get())
+      throw std::runtime_error("SEARCH missed " + name);
+  }
+  return seconds_since(start) * 1e6 / requests;
+}
+
+// MB/s over fetches sequential FETCHes of name from root
+double bulk_run(const std::string &root, const std::string &name, int fetches) {
+  p2p::FileServer files(root);
+  p2p::Peer peer("127.0.0.1", std::to_string(files.port()));
+
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < fetches; i++)
+    total += peer.fetch(name, [](const void *, size_t) { return true; }).get();
+  return total / seconds_since(start) / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  int requests = argc > 1 ? std::atoi(argv[1]) : 1000;
+  long file_mb = argc > 2 ? std::atol(argv[2]) : 64;
+  int fetches = argc > 3 ? std::atoi(argv[3]) : 4;
+  if (argc > 4 || requests < 1 || file_mb < 1 || fetches < 1) {
+    std::fprintf(stderr, "usage: %s [requests [file_MB [fetches]]]\n", argv[0]);
+    return 2;
+  }
+
+  const char *cc = std::getenv("P2P_NET_CC");
+  const char *mbps = std::getenv("P2P_NET_MBPS");
+  uint64_t rate = mbps ? std::strtoull(mbps, nullptr, 10) * 1000000 / 8 : 0;
+
+  char tmpl[] = "/tmp/p2pnetbench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string root = tmpl;
+
+  int rc = 0;
+  try {
+    std::string name = "bulk.bin";
+    {
+      std::ofstream out(root + "/" + name, std::ios::binary);
+      std::string block(1 << 20, 'x');
+      for (long i = 0; i < file_mb; i++)
+        out << block;
+    }
+
+    for (int on = 0; on < 2; on++) {
+      p2p_net_setup(on, cc, rate);
+      double us = control_run(requests);
+      double mb_s = bulk_run(root, name, fetches);
+      std::printf("profiles %-3s: PUBLISH+SEARCH %.1f us, FETCH %ld MB x %d %.1f MB/s\n",
+                  on ? "on" : "off", us, file_mb, fetches, mb_s);
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "p2pnetbench: %s\n", e.what());
+    rc = 1;
+  }
+
+  std::error_code ec;
+  std::filesystem::remove_all(root, ec);
+  return rc;
+}
@@ -0,0 +1,639 @@
+// p2ptest.c
+// Behaviour tests for the library, run by `make check`: the delta plan
+// and encoder against a decoder written from the wire format in
+// p2p_delta.h, a plan abandoned by a fault in its data,
+// p2p_delta_request_len() on good and bad headers, UDP SEARCH against a
+// scripted registry, trace rings wrapping and passing to new threads,
+// p2ptrace's report of a dump, and bulk socket buffers sized from the
+// bandwidth-delay product. Prints each failure and exits 1 if there were
+// any.
+
+#define _GNU_SOURCE
+#include "p2p_client.h"
+#include "p2p_delta.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_proto.h"
+#include "p2p_trace.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                 \
+  do {                                                                              \
+    if (!(cond)) {                                                                  \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, \
+              #cond);                                                               \
+      failures++;                                                                   \
+    }                                                                               \
+  } while (0)
+
+// Deterministic bytes, so a failure reproduces
+static void fill(uint8_t *p, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; i++) {
+    seed = seed * 1103515245u + 12345u;
+    p[i] = (uint8_t)(seed >> 16);
+  }
+}
+
+// Signatures of each full block of old, as the fetcher sends them
+static uint8_t *signatures(const uint8_t *old, size_t old_len, uint32_t block,
+                           uint32_t *count) {
+  *count = (uint32_t)(old_len / block);
+  uint8_t *sigs = malloc((size_t)*count * P2P_DELTA_SIG_LEN + 1);
+  for (uint32_t i = 0; i < *count; i++) {
+    p2p_put32(sigs + (size_t)i * P2P_DELTA_SIG_LEN, p2p_weak_sum(old + (size_t)i * block, block));
+    p2p_put64(sigs + (size_t)i * P2P_DELTA_SIG_LEN + 4, p2p_hash(old + (size_t)i * block, block));
+  }
+  return sigs;
+}
+
+// Plan and encode new against old, cap bytes of reply at a time, then
+// apply the reply to old. Returns 0 if that rebuilt new exactly, with
+// the end op's size and digest right; *literal is the literal bytes the
+// plan sends.
+static int round_trip(const uint8_t *old, size_t old_len, const uint8_t *new, size_t new_len,
+                      uint32_t block, size_t cap, uint64_t *literal) {
+  uint32_t count;
+  uint8_t *sigs = signatures(old, old_len, block, &count);
+  struct p2p_delta_plan plan;
+  if (p2p_delta_plan(new, new_len, block, sigs, count, &plan) != 0) {
+    free(sigs);
+    return -1;
+  }
+  *literal = plan.literal_bytes;
+
+  // The whole reply, gathered from the encoder's pieces
+  size_t reply_cap = new_len * 2 + 4096, reply_len = 0;
+  uint8_t *reply = malloc(reply_cap);
+  uint8_t *piece = malloc(cap);
+  struct p2p_delta_encoder enc;
+  p2p_delta_encoder_init(&enc, new, new_len, &plan);
+  size_t n;
+  while ((n = p2p_delta_encode(&enc, piece, cap)) > 0 && reply_len + n <= reply_cap) {
+    memcpy(reply + reply_len, piece, n);
+    reply_len += n;
+  }
+
+  uint8_t *out = malloc(new_len + 1);
+  size_t out_len = 0, pos = 0;
+  int rc = -1;
+  while (pos < reply_len) {
+    uint8_t type = reply[pos];
+    if (type == P2P_DELTA_LITERAL && pos + 5 <= reply_len) {
+      uint32_t len = p2p_get32(reply + pos + 1);
+      if (pos + 5 + len > reply_len || out_len + len > new_len)
+        break;
+      memcpy(out + out_len, reply + pos + 5, len);
+      out_len += len;
+      pos += 5 + len;
+    } else if (type == P2P_DELTA_COPY && pos + 9 <= reply_len) {
+      uint32_t first = p2p_get32(reply + pos + 1), blocks = p2p_get32(reply + pos + 5);
+      if (first > count || blocks > count - first || out_len + (size_t)blocks * block > new_len)
+        break;
+      memcpy(out + out_len, old + (size_t)first * block, (size_t)blocks * block);
+      out_len += (size_t)blocks * block;
+      pos += 9;
+    } else if (type == P2P_DELTA_END && pos + 17 == reply_len) {
+      rc = p2p_get64(reply + pos + 1) == new_len &&
+                   p2p_get64(reply + pos + 9) == p2p_hash(new, new_len) && out_len == new_len &&
+                   memcmp(out, new, new_len) == 0
+               ? 0
+               : -1;
+      break;
+    } else {
+      break;
+    }
+  }
+
+  free(out);
+  free(piece);
+  free(reply);
+  p2p_delta_plan_free(&plan);
+  free(sigs);
+  return rc;
+}
+
+static void test_delta_identical(void) {
+  size_t len = 64 * 1024;
+  uint8_t *data = malloc(len);
+  fill(data, len, 1);
+  uint64_t literal;
+  CHECK(round_trip(data, len, data, len, 1024, 4096, &literal) == 0);
+  CHECK(literal == 0);
+  free(data);
+}
+
+// An insert shifts everything after it; only the block it lands in and
+// the inserted bytes should go as literals
+static void test_delta_shifted_insert(void) {
+  size_t old_len = 256 * 1024, insert_at = 100000, insert_len = 37;
+  uint32_t block = 1024;
+  uint8_t *old = malloc(old_len), *new = malloc(old_len + insert_len);
+  fill(old, old_len, 2);
+  memcpy(new, old, insert_at);
+  fill(new + insert_at, insert_len, 3);
+  memcpy(new + insert_at + insert_len, old + insert_at, old_len - insert_at);
+
+  uint64_t literal;
+  CHECK(round_trip(old, old_len, new, old_len + insert_len, block, 4096, &literal) == 0);
+  CHECK(literal <= insert_len + block);
+  // Small buffers split literals and ops across pieces
+  CHECK(round_trip(old, old_len, new, old_len + insert_len, block, 64, &literal) == 0);
+  free(old);
+  free(new);
+}
+
+static void test_delta_edits(void) {
+  size_t len = 40 * 1024 + 300; // ends in a partial block
+  uint32_t block = 1024;
+  uint8_t *old = malloc(len), *new = malloc(len + 5000);
+  fill(old, len, 4);
+  uint64_t literal;
+
+  // A deletion, the mirror of the insert
+  memcpy(new, old, 5000);
+  memcpy(new + 5000, old + 7000, len - 7000);
+  CHECK(round_trip(old, len, new, len - 2000, block, 4096, &literal) == 0);
+  CHECK(literal <= 2 * block);
+
+  // Appended data is all literal
+  memcpy(new, old, len);
+  fill(new + len, 5000, 5);
+  CHECK(round_trip(old, len, new, len + 5000, block, 4096, &literal) == 0);
+  CHECK(literal <= 5000 + block);
+
+  // Nothing in common, an empty result, no old copy, a tiny new file
+  fill(new, len, 6);
+  CHECK(round_trip(old, len, new, len, block, 4096, &literal) == 0);
+  CHECK(literal == len);
+  CHECK(round_trip(old, len, new, 0, block, 4096, &literal) == 0);
+  CHECK(round_trip(old, 0, new, len, block, 4096, &literal) == 0);
+  CHECK(round_trip(old, len, new, 10, block, 64, &literal) == 0);
+  free(old);
+  free(new);
+}
+
+static sigjmp_buf fault_env;
+
+static void on_fault(int sig) {
+  (void)sig;
+  siglongjmp(fault_env, 1);
+}
+
+// Planning over a mapping whose file was truncated faults part way; the
+// caller jumps out of the plan and must still be able to free it all
+static void test_delta_plan_fault(void) {
+  size_t len = 256 * 1024;
+  uint32_t block = 1024, count;
+  uint8_t *data = malloc(len);
+  fill(data, len, 7);
+  uint8_t *sigs = signatures(data, len, block, &count);
+
+  char path[] = "/tmp/p2ptest.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1 && write(fd, data, len) == (ssize_t)len);
+  uint8_t *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK(map != MAP_FAILED);
+  CHECK(ftruncate(fd, 4096) == 0);
+
+  struct sigaction sa = {0}, old_bus, old_segv;
+  sa.sa_handler = on_fault;
+  sigaction(SIGBUS, &sa, &old_bus);
+  sigaction(SIGSEGV, &sa, &old_segv);
+  static struct p2p_delta_plan plan; // changed between sigsetjmp() and the jump
+  if (map != MAP_FAILED && sigsetjmp(fault_env, 1) == 0) {
+    p2p_delta_plan(map, len, block, sigs, count, &plan);
+    CHECK(!"planning a truncated mapping faults");
+  } else {
+    CHECK(plan.scratch != NULL);
+    p2p_delta_plan_free(&plan);
+    CHECK(plan.scratch == NULL && plan.ops == NULL);
+  }
+  sigaction(SIGBUS, &old_bus, NULL);
+  sigaction(SIGSEGV, &old_segv, NULL);
+
+  if (map != MAP_FAILED)
+    munmap(map, len);
+  close(fd);
+  unlink(path);
+  free(sigs);
+  free(data);
+}
+
+// [9][name\0][block:4][count:4], returning its length
+static size_t delta_header(uint8_t *buf, const char *name, uint32_t block, uint32_t count) {
+  size_t len = strlen(name) + 1;
+  buf[0] = P2P_MSG_FETCH_DELTA;
+  memcpy(buf + 1, name, len);
+  p2p_put32(buf + 1 + len, block);
+  p2p_put32(buf + 5 + len, count);
+  return len + 9;
+}
+
+static void test_delta_request_len(void) {
+  uint8_t buf[256];
+  char name[P2P_MAX_FETCH_NAME + 1];
+
+  size_t len = delta_header(buf, "f", 1024, 3);
+  CHECK(p2p_delta_request_len(buf, len) == (long)len + 3 * P2P_DELTA_SIG_LEN);
+  // Any prefix of a good header asks for more
+  for (size_t i = 0; i < len; i++)
+    CHECK(p2p_delta_request_len(buf, i) == 0);
+
+  // Not a delta request
+  buf[0] = P2P_MSG_FETCH;
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+
+  // Block size and count out of range
+  len = delta_header(buf, "f", P2P_DELTA_MIN_BLOCK - 1, 3);
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+  len = delta_header(buf, "f", P2P_DELTA_MAX_BLOCK + 1, 3);
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+  len = delta_header(buf, "f", 1024, P2P_DELTA_MAX_BLOCKS + 1);
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+  len = delta_header(buf, "f", 1024, 0xffffffffu);
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+
+  // The longest name served is fine, one byte more is not, whether or
+  // not its NUL has arrived
+  memset(name, 'n', sizeof(name));
+  name[P2P_MAX_FETCH_NAME - 1] = '\0';
+  len = delta_header(buf, name, 1024, 0);
+  CHECK(p2p_delta_request_len(buf, len) == (long)len);
+  name[P2P_MAX_FETCH_NAME - 1] = 'n';
+  name[P2P_MAX_FETCH_NAME] = '\0';
+  len = delta_header(buf, name, 1024, 0);
+  CHECK(p2p_delta_request_len(buf, len) == -1);
+  CHECK(p2p_delta_request_len(buf, 1 + P2P_MAX_FETCH_NAME) == -1);
+  CHECK(p2p_delta_request_len(buf, P2P_MAX_FETCH_NAME) == 0);
+}
+
+// A registry's UDP SEARCH endpoint that answers the requests it gets by
+// a script, one action per request
+enum { UDP_DROP, UDP_ANSWER, UDP_STALE_FIRST, UDP_NOT_OWNER };
+
+struct udp_script {
+  int sock;
+  int actions[4];
+  int count;
+  uint32_t ids[8];
+  int seen; // requests received, including any past the script
+};
+
+static const struct p2p_location udp_found = {.id = 42, .ip = 0x0100007f, .port = 6000};
+
+static void udp_reply(int sock, const struct sockaddr_in *to, uint32_t id, uint8_t status,
+                      const struct p2p_location *loc, size_t len) {
+  uint8_t reply[P2P_UDP_SEARCH_REPLY_LEN];
+  reply[0] = P2P_MSG_SEARCH;
+  p2p_put32(reply + 1, id);
+  reply[5] = status;
+  p2p_encode_location(reply + 6, loc);
+  sendto(sock, reply, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+static void *udp_registry(void *arg) {
+  struct udp_script *s = arg;
+  for (;;) {
+    // Past the script, wait a little to catch requests that shouldn't come
+    struct pollfd pfd = {.fd = s->sock, .events = POLLIN};
+    if (poll(&pfd, 1, s->seen < s->count ? 2000 : 300) <= 0)
+      break;
+    uint8_t req[64];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(s->sock, req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+    if (n < 6 || req[0] != P2P_MSG_SEARCH || req[n - 1] != '\0' ||
+        strcmp((char *)req + 5, "song.mp3") != 0 || s->seen == 8)
+      break;
+    uint32_t id = p2p_get32(req + 1);
+    int action = s->seen < s->count ? s->actions[s->seen] : UDP_DROP;
+    s->ids[s->seen++] = id;
+
+    struct p2p_location stale = {.id = 7, .ip = 0x0200007f, .port = 7000};
+    if (action == UDP_STALE_FIRST) {
+      udp_reply(s->sock, &from, id - 1, P2P_UDP_OK, &stale, P2P_UDP_SEARCH_REPLY_LEN);
+      udp_reply(s->sock, &from, id, P2P_UDP_OK, &stale, P2P_UDP_SEARCH_REPLY_LEN - 1);
+    }
+    if (action == UDP_ANSWER || action == UDP_STALE_FIRST)
+      udp_reply(s->sock, &from, id, P2P_UDP_OK, &udp_found, P2P_UDP_SEARCH_REPLY_LEN);
+    else if (action == UDP_NOT_OWNER)
+      udp_reply(s->sock, &from, id, P2P_UDP_NOT_OWNER, &udp_found, P2P_UDP_SEARCH_REPLY_LEN);
+  }
+  return NULL;
+}
+
+// A UDP socket bound on loopback, and one connected to it
+static int udp_pair(int *client) {
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  int server = socket(AF_INET, SOCK_DGRAM, 0);
+  *client = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(bind(server, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  CHECK(getsockname(server, (struct sockaddr *)&addr, &len) == 0);
+  CHECK(connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  return server;
+}
+
+// Run p2p_search_udp() against the script; returns its result and
+// leaves what the registry saw in *s
+static int udp_search(struct udp_script *s, int tries, int timeout_ms, struct p2p_location *loc,
+                      double *elapsed) {
+  int client;
+  pthread_t tid;
+  s->sock = udp_pair(&client);
+  s->seen = 0;
+  pthread_create(&tid, NULL, udp_registry, s);
+  double start = p2p_monotonic_secs();
+  memset(loc, 0, sizeof(*loc));
+  int rc = p2p_search_udp(client, 1234, "song.mp3", tries, timeout_ms, loc);
+  *elapsed = p2p_monotonic_secs() - start;
+  pthread_join(tid, NULL);
+  close(client);
+  close(s->sock);
+  return rc;
+}
+
+static int same_location(const struct p2p_location *a, const struct p2p_location *b) {
+  return a->id == b->id && a->ip == b->ip && a->port == b->port;
+}
+
+static void test_search_udp(void) {
+  struct p2p_location loc;
+  double elapsed;
+
+  // Lost datagrams are sent again with the same id, each wait twice the
+  // last
+  struct udp_script lossy = {.actions = {UDP_DROP, UDP_DROP, UDP_ANSWER}, .count = 3};
+  CHECK(udp_search(&lossy, 3, 20, &loc, &elapsed) == P2P_OK);
+  CHECK(same_location(&loc, &udp_found));
+  CHECK(lossy.seen == 3 && lossy.ids[0] == 1234 && lossy.ids[1] == 1234 && lossy.ids[2] == 1234);
+  CHECK(elapsed >= 0.020 + 0.040 - 0.005); // poll() waits whole milliseconds
+
+  // Replies with another id, or cut short, are passed over
+  struct udp_script stale = {.actions = {UDP_STALE_FIRST}, .count = 1};
+  CHECK(udp_search(&stale, 1, 1000, &loc, &elapsed) == P2P_OK);
+  CHECK(same_location(&loc, &udp_found));
+  CHECK(elapsed < 0.5);
+
+  // A shard that doesn't own the name answers once; that's final
+  struct udp_script not_owner = {.actions = {UDP_NOT_OWNER}, .count = 1};
+  CHECK(udp_search(&not_owner, 3, 20, &loc, &elapsed) == P2P_EPROTO);
+  CHECK(not_owner.seen == 1);
+
+  // Nobody answering uses up the tries and no more
+  struct udp_script silent = {.actions = {UDP_DROP, UDP_DROP, UDP_DROP}, .count = 3};
+  CHECK(udp_search(&silent, 3, 10, &loc, &elapsed) == P2P_EPROTO);
+  CHECK(silent.seen == 3);
+  CHECK(elapsed >= 0.010 + 0.020 + 0.040 - 0.005);
+
+  // No UDP endpoint at all: the ICMP error ends it without waiting
+  int client;
+  int server = udp_pair(&client);
+  close(server);
+  double start = p2p_monotonic_secs();
+  CHECK(p2p_search_udp(client, 1, "song.mp3", 3, 1000, &loc) == P2P_EPROTO);
+  CHECK(p2p_monotonic_secs() - start < 0.5);
+  close(client);
+}
+
+// Trace records of request id in the dump at path, in ring order, into
+// recs (cap of them); how many there were
+static size_t dump_records(const char *path, uint64_t id, struct p2p_trace_record *recs,
+                           size_t cap) {
+  size_t n = 0;
+  FILE *fp = fopen(path, "rb");
+  struct p2p_trace_header header;
+  struct p2p_trace_record rec;
+  if (!fp)
+    return 0;
+  if (fread(&header, sizeof(header), 1, fp) == 1) {
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+      if (rec.id == id && n < cap)
+        recs[n] = rec;
+      n += rec.id == id;
+    }
+  }
+  fclose(fp);
+  return n;
+}
+
+struct trace_writer {
+  uint64_t id;
+  int count;
+};
+
+static void *trace_writer_run(void *arg) {
+  const struct trace_writer *w = arg;
+  for (int i = 0; i < w->count; i++)
+    p2p_trace_event(w->id, P2P_TRACE_CHUNK, i);
+  return NULL;
+}
+
+static void trace_in_thread(uint64_t id, int count) {
+  struct trace_writer w = {id, count};
+  pthread_t tid;
+  pthread_create(&tid, NULL, trace_writer_run, &w);
+  pthread_join(tid, NULL);
+}
+
+// A ring keeps its thread's newest records, and once the thread exits
+// the next thread to trace writes on in it
+static void test_trace_rings(void) {
+  static struct p2p_trace_record recs[P2P_TRACE_RING];
+  char path[] = "/tmp/p2ptest-trace.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  close(fd);
+  p2p_trace_start(NULL);
+
+  trace_in_thread(0xa, P2P_TRACE_RING + 100);
+  CHECK(p2p_trace_dump(path) == 0);
+  CHECK(dump_records(path, 0xa, recs, P2P_TRACE_RING) == P2P_TRACE_RING);
+  int in_order = 1;
+  for (int i = 0; i < P2P_TRACE_RING; i++)
+    in_order &= recs[i].arg == 100 + i && recs[i].tid == recs[0].tid;
+  CHECK(in_order);
+
+  trace_in_thread(0xb, 10);
+  CHECK(p2p_trace_dump(path) == 0);
+  CHECK(dump_records(path, 0xb, recs, P2P_TRACE_RING) == 10);
+  CHECK(dump_records(path, 0xa, recs, P2P_TRACE_RING) == P2P_TRACE_RING - 10);
+  CHECK(recs[0].arg == 110);
+  p2p_tracing = 0;
+  unlink(path);
+}
+
+// What p2ptrace makes of a dump: per kind, requests that finished, failed
+// or never ended, the bytes their chunks moved, and each request with -v
+static void test_trace_report(void) {
+  char path[] = "/tmp/p2ptest-trace.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  close(fd);
+  p2p_trace_start(NULL);
+  uint64_t ok = p2p_trace_begin(P2P_TRACE_FETCH);
+  P2P_TRACE(ok, P2P_TRACE_CONNECTED, 0);
+  P2P_TRACE(ok, P2P_TRACE_SENT, 0);
+  P2P_TRACE(ok, P2P_TRACE_FIRST_BYTE, 0);
+  P2P_TRACE(ok, P2P_TRACE_CHUNK, 1000);
+  P2P_TRACE(ok, P2P_TRACE_CHUNK, 500);
+  P2P_TRACE(ok, P2P_TRACE_DONE, P2P_OK);
+  uint64_t failed = p2p_trace_begin(P2P_TRACE_FETCH);
+  P2P_TRACE(failed, P2P_TRACE_DONE, P2P_ECONNECT);
+  uint64_t unfinished = p2p_trace_begin(P2P_TRACE_SEARCH);
+  P2P_TRACE(unfinished, P2P_TRACE_SENT, 1);
+  p2p_tracing = 0;
+  CHECK(p2p_trace_dump(path) == 0);
+
+  char cmd[64], out[8192], line[64];
+  snprintf(cmd, sizeof(cmd), "./p2ptrace -v %s", path);
+  FILE *fp = popen(cmd, "r");
+  size_t len = fp ? fread(out, 1, sizeof(out) - 1, fp) : 0;
+  out[len] = '\0';
+  CHECK(fp && pclose(fp) == 0);
+  CHECK(strstr(out, "FETCH: 2 requests, 1 failed, 0 incomplete, 1500 bytes in 2 chunks\n"));
+  CHECK(strstr(out, "SEARCH: 1 requests, 0 failed, 1 incomplete\n"));
+  CHECK(strstr(out, "  total (ok)          1 "));
+  snprintf(line, sizeof(line), "%016" PRIx64 " FETCH (thread", ok);
+  CHECK(strstr(out, line));
+
+  // Anything else is refused
+  fp = fopen(path, "wb");
+  CHECK(fp && fputs("not a trace\n", fp) >= 0 && fclose(fp) == 0);
+  snprintf(cmd, sizeof(cmd), "./p2ptrace %s 2>/dev/null", path);
+  fp = popen(cmd, "r");
+  CHECK(fp && pclose(fp) != 0);
+  unlink(path);
+}
+
+// The last number in a /proc/sys file, as p2p_net.c reads it
+static long sysctl_max(const char *path) {
+  FILE *fp = fopen(path, "r");
+  long v, last = 0;
+  while (fp && fscanf(fp, "%ld", &v) == 1)
+    last = v;
+  if (fp)
+    fclose(fp);
+  return last;
+}
+
+static int sock_buffer(int sock, int opt) {
+  int v = 0;
+  socklen_t len = sizeof(v);
+  getsockopt(sock, SOL_SOCKET, opt, &v, &len);
+  return v;
+}
+
+// A bulk-tuned loopback connection whose bandwidth-delay product is about
+// half of want, into buf[0] (receive) and buf[1] (send) as the kernel
+// reports them, doubled; returns the twice-BDP p2p_net_tune() worked from
+// and *rc what it returned
+static uint64_t tune_for(uint64_t want, int buf[2], int *rc) {
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0);
+  CHECK(getsockname(listener, (struct sockaddr *)&addr, &len) == 0);
+  CHECK(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  int server = accept(listener, NULL, NULL);
+
+  // With no data sent the handshake's RTT is the one tuning reads too
+  struct tcp_info info;
+  len = sizeof(info);
+  CHECK(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt > 0);
+  uint64_t rate = info.tcpi_rtt ? want * 1000000 / 2 / info.tcpi_rtt : 0;
+  p2p_net_setup(1, NULL, rate);
+  *rc = p2p_net_tune(sock, P2P_NET_BULK);
+  buf[0] = sock_buffer(sock, SO_RCVBUF);
+  buf[1] = sock_buffer(sock, SO_SNDBUF);
+  p2p_net_setup(1, NULL, 0);
+  close(server);
+  close(sock);
+  close(listener);
+  return 2 * (rate * info.tcpi_rtt / 1000000);
+}
+
+// Bulk buffers are set to twice the BDP where autotuning wouldn't reach
+// it, up to P2P_NET_MAX_BUFFER; without CAP_NET_ADMIN, up to what
+// net.core allows, and not at all if that's no more than autotuning
+static void test_net_buffers(void) {
+  long autotune[2] = {sysctl_max("/proc/sys/net/ipv4/tcp_rmem"),
+                      sysctl_max("/proc/sys/net/ipv4/tcp_wmem")};
+  long core[2] = {sysctl_max("/proc/sys/net/core/rmem_max"),
+                  sysctl_max("/proc/sys/net/core/wmem_max")};
+  long most = autotune[0] > autotune[1] ? autotune[0] : autotune[1];
+  long least = autotune[0] < autotune[1] ? autotune[0] : autotune[1];
+  int untuned[2], buf[2], rc;
+  tune_for(0, untuned, &rc);
+
+  // Within autotuning's reach: left to it
+  tune_for((uint64_t)least / 2, buf, &rc);
+  CHECK(rc == 0 && buf[0] == untuned[0] && buf[1] == untuned[1]);
+
+  if (geteuid() == 0 && most < P2P_NET_MAX_BUFFER) {
+    uint64_t want = tune_for(((uint64_t)most + P2P_NET_MAX_BUFFER) / 2, buf, &rc);
+    CHECK(rc == 0 && buf[0] == (int)(2 * want) && buf[1] == (int)(2 * want));
+    tune_for(4ull * P2P_NET_MAX_BUFFER, buf, &rc);
+    CHECK(rc == 0 && buf[0] == 2 * P2P_NET_MAX_BUFFER && buf[1] == 2 * P2P_NET_MAX_BUFFER);
+  }
+
+  // Unprivileged, in a child that gives root up if it has it
+  pid_t child = fork();
+  if (child == 0) {
+    failures = 0;
+    if (geteuid() == 0 && setuid(65534) != 0)
+      _exit(1);
+    uint64_t want = tune_for(4ull * P2P_NET_MAX_BUFFER, buf, &rc);
+    int refused = 0;
+    for (int dir = 0; dir < 2; dir++) {
+      if (core[dir] <= autotune[dir]) {
+        CHECK(buf[dir] == untuned[dir]);
+        refused = 1;
+      } else {
+        long capped = (long)want < core[dir] ? (long)want : core[dir];
+        CHECK(buf[dir] == 2 * capped);
+      }
+    }
+    CHECK(rc == (refused ? -1 : 0));
+    _exit(failures);
+  }
+  int status = 0;
+  CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status));
+  failures += WEXITSTATUS(status);
+}
+
+int main(void) {
+  test_delta_identical();
+  test_delta_shifted_insert();
+  test_delta_edits();
+  test_delta_plan_fault();
+  test_delta_request_len();
+  test_search_udp();
+  test_trace_rings();
+  test_trace_report();
+  test_net_buffers();
+  if (failures) {
+    fprintf(stderr, "p2ptest: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("p2ptest: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,186 @@
+// p2ptrace.c
+// Read trace dumps (see p2p_trace.h) and report where requests spend
+// their time: p2ptrace [-v] <dump>...
+// For each kind of request, how long it took to reach each milestone
+// from the one before, and in all. -v also prints every request.
+
+#include "p2p_fetch.h"
+#include "p2p_trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KINDS (P2P_TRACE_FETCH_CHUNK + 1)
+#define PHASES (P2P_TRACE_DONE + 2) // one per event, and the total
+
+struct durations {
+  uint64_t *ns;
+  size_t len, cap;
+};
+
+struct kind_stats {
+  size_t requests, failed, incomplete, chunks;
+  uint64_t bytes;
+  struct durations phase[PHASES];
+};
+
+static struct p2p_trace_record *recs;
+static size_t nrecs, caprecs;
+static struct kind_stats stats[KINDS];
+
+static int load(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+  struct p2p_trace_header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, P2P_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != P2P_TRACE_VERSION ||
+      header.record_size != sizeof(struct p2p_trace_record)) {
+    fprintf(stderr, "%s: not a trace dump\n", path);
+    fclose(fp);
+    return -1;
+  }
+  for (;;) {
+    if (nrecs == caprecs) {
+      size_t cap = caprecs ? caprecs * 2 : 65536;
+      struct p2p_trace_record *grown = realloc(recs, cap * sizeof(*recs));
+      if (!grown) {
+        perror("realloc");
+        fclose(fp);
+        return -1;
+      }
+      recs = grown;
+      caprecs = cap;
+    }
+    size_t n = fread(recs + nrecs, sizeof(*recs), caprecs - nrecs, fp);
+    nrecs += n;
+    if (n == 0)
+      break;
+  }
+  fclose(fp);
+  return 0;
+}
+
+static int by_request(const void *a, const void *b) {
+  const struct p2p_trace_record *x = a, *y = b;
+  if (x->id != y->id)
+    return x->id < y->id ? -1 : 1;
+  if (x->ts_ns != y->ts_ns)
+    return x->ts_ns < y->ts_ns ? -1 : 1;
+  return x->event < y->event ? -1 : x->event > y->event;
+}
+
+static int by_value(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void add(struct durations *d, uint64_t ns) {
+  if (d->len == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 256;
+    uint64_t *grown = realloc(d->ns, cap * sizeof(*grown));
+    if (!grown) {
+      perror("realloc");
+      exit(1);
+    }
+    d->ns = grown;
+    d->cap = cap;
+  }
+  d->ns[d->len++] = ns;
+}
+
+// One request's records, in time order
+static void request(const struct p2p_trace_record *r, size_t n, int verbose) {
+  if (r[0].event != P2P_TRACE_BEGIN || r[0].arg <= 0 || r[0].arg >= KINDS)
+    return; // began before the oldest record kept
+  int kind = (int)r[0].arg;
+  struct kind_stats *ks = &stats[kind];
+  uint64_t last = r[0].ts_ns;
+  int done = 0;
+  int64_t rc = P2P_OK;
+
+  ks->requests++;
+  if (verbose)
+    printf("%016" PRIx64 " %s (thread %" PRIu32 ")\n", r[0].id, p2p_trace_kind_name(kind),
+           r[0].tid);
+  for (size_t i = 1; i < n; i++) {
+    uint32_t event = r[i].event;
+    if (event == P2P_TRACE_CHUNK) {
+      ks->chunks++;
+      ks->bytes += (uint64_t)r[i].arg;
+      continue;
+    }
+    if (event == P2P_TRACE_BEGIN || event >= PHASES - 1)
+      continue;
+    if (verbose)
+      printf("  %+12.1f us  %s %" PRId64 "\n", (r[i].ts_ns - r[0].ts_ns) / 1e3,
+             p2p_trace_event_name((int)event), r[i].arg);
+    add(&ks->phase[event], r[i].ts_ns - last);
+    last = r[i].ts_ns;
+    if (event == P2P_TRACE_DONE) {
+      done = 1;
+      rc = r[i].arg;
+    }
+  }
+  if (!done)
+    ks->incomplete++;
+  else if (rc != P2P_OK)
+    ks->failed++;
+  else
+    add(&ks->phase[PHASES - 1], last - r[0].ts_ns);
+}
+
+static void report(int kind) {
+  struct kind_stats *ks = &stats[kind];
+  printf("%s: %zu requests, %zu failed, %zu incomplete", p2p_trace_kind_name(kind),
+         ks->requests, ks->failed, ks->incomplete);
+  if (ks->chunks)
+    printf(", %" PRIu64 " bytes in %zu chunks", ks->bytes, ks->chunks);
+  printf("\n  %-12s %8s %10s %10s %10s %10s %10s  (us)\n", "to", "count", "mean", "p50", "p90",
+         "p99", "max");
+  for (int phase = P2P_TRACE_BEGIN + 1; phase < PHASES; phase++) {
+    struct durations *d = &ks->phase[phase];
+    if (d->len == 0)
+      continue;
+    qsort(d->ns, d->len, sizeof(d->ns[0]), by_value);
+    double sum = 0;
+    for (size_t i = 0; i < d->len; i++)
+      sum += (double)d->ns[i];
+    printf("  %-12s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           phase == PHASES - 1 ? "total (ok)" : p2p_trace_event_name(phase), d->len,
+           sum / (double)d->len / 1e3, d->ns[d->len / 2] / 1e3, d->ns[d->len * 9 / 10] / 1e3,
+           d->ns[d->len * 99 / 100] / 1e3, d->ns[d->len - 1] / 1e3);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+  if (argc < 2 + verbose) {
+    fprintf(stderr, "usage: %s [-v] <dump>...\n", argv[0]);
+    return 2;
+  }
+  for (int i = 1 + verbose; i < argc; i++) {
+    if (load(argv[i]) != 0)
+      return 1;
+  }
+
+  qsort(recs, nrecs, sizeof(*recs), by_request);
+  for (size_t i = 0, j; i < nrecs; i = j) {
+    for (j = i + 1; j < nrecs && recs[j].id == recs[i].id; j++)
+      ;
+    request(recs + i, j - i, verbose);
+  }
+
+  if (verbose)
+    printf("\n");
+  for (int kind = 1; kind < KINDS; kind++) {
+    if (stats[kind].requests)
+      report(kind);
+  }
+  return 0;
+}
@@ -0,0 +1,374 @@
+// peertest.c
+// Behaviour tests for peer internals, run by `make check`: upload
+// scheduling, the order swarm chunks are fetched in, and swarm downloads
+// with default settings, of a good copy and of one that changes under
+// its hashes. peer.c is compiled in whole, without its main(), so the
+// tests see its state directly. Prints each failure and exits 1 if there
+// were any.
+
+#define PEER_LIBRARY
+#include "peer.c"
+
+#include <sys/wait.h>
+
+#include "p2p_io.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                 \
+  do {                                                                              \
+    if (!(cond)) {                                                                  \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, \
+              #cond);                                                               \
+      failures++;                                                                   \
+    }                                                                               \
+  } while (0)
+
+#define TEST_FILE_SIZE (64 * 1024 * 1024)
+
+static char test_file[] = "/tmp/peertest.XXXXXX";
+static int peer_ends[UPLOAD_MAX_SESSIONS]; // the fetchers' side of each session
+
+// A session sending the test file to host from a socket pair, as
+// upload_request() leaves a FETCH
+static struct upload *add_session(int slot, const char *host, int small) {
+  int sv[2];
+  struct upload *u = &uploads[slot];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  int sndbuf = 4 * 1024 * 1024; // room for a whole banked deficit
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  memset(u, 0, sizeof(*u));
+  u->state = UPLOAD_SENDING;
+  u->fd = sv[0];
+  peer_ends[slot] = sv[1];
+  inet_pton(AF_INET, host, &u->remote);
+  u->req[0] = P2P_MSG_FETCH;
+  u->file_fd = open(test_file, O_RDONLY | O_CLOEXEC);
+  u->chunk_fd = -1;
+  u->end = TEST_FILE_SIZE;
+  u->small = small;
+  u->code_sent = 1;
+  u->started = u->last_progress = now_secs();
+  remote_bucket(u);
+  return u;
+}
+
+// Read whatever the sessions have sent, so their sockets take more
+static void drain(void) {
+  static uint8_t buf[64 * 1024];
+  for (int i = 0; i < UPLOAD_MAX_SESSIONS; i++) {
+    if (uploads[i].state == UPLOAD_FREE)
+      continue;
+    while (recv(peer_ends[i], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+      ;
+  }
+}
+
+static void close_sessions(void) {
+  for (int i = 0; i < UPLOAD_MAX_SESSIONS; i++) {
+    if (uploads[i].state == UPLOAD_FREE)
+      continue;
+    upload_close(&uploads[i]);
+    close(peer_ends[i]);
+  }
+  memset(remotes, 0, sizeof(remotes));
+}
+
+// One pass with every session writable, and tokens the global bucket
+// holds for it (-1 for no limit)
+static void pump(long tokens) {
+  fd_set write_set;
+  FD_ZERO(&write_set);
+  for (int i = 0; i < UPLOAD_MAX_SESSIONS; i++) {
+    if (uploads[i].state != UPLOAD_FREE)
+      FD_SET(uploads[i].fd, &write_set);
+  }
+  // A bucket holds at most a quarter second of its rate, so this rate
+  // keeps it at tokens however long the pass takes to start
+  global_bucket.rate = tokens < 0 ? 0 : 4.0 * tokens;
+  global_bucket.tokens = tokens < 0 ? 0 : (double)tokens;
+  global_bucket.last = now_secs();
+  upload_pump(&write_set);
+}
+
+// Each host earns a quantum a pass, split between its sessions
+static void test_drr_quantum(void) {
+  struct upload *a = add_session(0, "10.0.0.1", 0);
+  struct upload *b = add_session(1, "10.0.0.1", 0);
+  struct upload *c = add_session(2, "10.0.0.2", 0);
+  pump(-1);
+  CHECK(a->offset == UPLOAD_QUANTUM / 2 && b->offset == UPLOAD_QUANTUM / 2);
+  CHECK(c->offset == UPLOAD_QUANTUM);
+  CHECK(a->deficit == 0 && b->deficit == 0 && c->deficit == 0);
+
+  drain();
+  pump(-1);
+  CHECK(a->offset == UPLOAD_QUANTUM && b->offset == UPLOAD_QUANTUM);
+  CHECK(c->offset == 2 * UPLOAD_QUANTUM);
+  close_sessions();
+}
+
+// What a pass doesn't let a session send it may send later, up to four
+// quanta; a session that can't send at all stops earning there
+static void test_drr_deficit(void) {
+  struct upload *u = add_session(0, "10.0.0.1", 0);
+  long limit = UPLOAD_QUANTUM / 4;
+  pump(limit);
+  CHECK(u->offset == (size_t)limit);
+  CHECK(u->deficit == UPLOAD_QUANTUM - limit);
+  drain();
+  pump(limit);
+  CHECK(u->deficit == 2 * (UPLOAD_QUANTUM - limit));
+
+  // The fetcher stops reading: writable as far as select() knows, but
+  // every send comes back short
+  while (send(u->fd, "x", 1, MSG_DONTWAIT) == 1)
+    ;
+  size_t stuck = u->offset;
+  for (int i = 0; i < 10; i++)
+    pump(-1);
+  CHECK(u->offset == stuck);
+  CHECK(u->deficit == 4 * UPLOAD_QUANTUM);
+
+  // Once it reads again, the banked deficit goes out in one pass
+  drain();
+  pump(-1);
+  CHECK(u->offset - stuck == 4 * UPLOAD_QUANTUM);
+  close_sessions();
+}
+
+// Small files are served first, and sessions short of tokens take turns
+static void test_drr_tiers(void) {
+  struct upload *big = add_session(0, "10.0.0.1", 0);
+  struct upload *big2 = add_session(1, "10.0.0.2", 0);
+  struct upload *small = add_session(2, "10.0.0.3", 1);
+  long limit = UPLOAD_QUANTUM / 2;
+  pump(limit);
+  CHECK(small->offset == (size_t)limit);
+  CHECK(big->offset == 0 && big2->offset == 0);
+
+  // With the small file out of the way the two big ones take turns
+  upload_close(small);
+  close(peer_ends[2]);
+  drain();
+  pump(limit);
+  CHECK(big->offset + big2->offset == (size_t)limit);
+  drain();
+  pump(limit);
+  CHECK(big->offset + big2->offset == 2 * (size_t)limit);
+  CHECK(big->offset == (size_t)limit && big2->offset == (size_t)limit);
+  close_sessions();
+}
+
+// A session held back by its host's limit while a later one sends is
+// first in line once its host may send again
+static void test_drr_starved(void) {
+  // The pass after one where only slot 3 sent starts at slot 4, and so
+  // reaches the sessions below in slot order
+  add_session(3, "10.0.0.4", 0);
+  pump(-1);
+  upload_close(&uploads[3]);
+  close(peer_ends[3]);
+
+  struct upload *held = add_session(0, "10.0.0.1", 0);
+  struct upload *b = add_session(1, "10.0.0.2", 0);
+  struct upload *c = add_session(2, "10.0.0.3", 0);
+
+  // A byte a second, and at most a quarter second of it banked, never
+  // makes a whole byte
+  struct rate_bucket *rb = remote_bucket(held);
+  rb->rate = 1;
+  rb->tokens = 0;
+  rb->last = now_secs();
+  long limit = UPLOAD_QUANTUM / 2;
+  pump(limit);
+  CHECK(held->offset == 0 && b->offset == (size_t)limit && c->offset == 0);
+
+  // Next in turn after b is c, but held was passed over first
+  rb->rate = 0;
+  drain();
+  pump(limit);
+  CHECK(held->offset == (size_t)limit && c->offset == 0);
+  close_sessions();
+}
+
+// A registry that answers every SWARM on its socket with one holder and
+// no attributes, as it does when peers publish without them
+struct fake_registry {
+  int fd;
+  uint16_t holder_port;
+  uint64_t joined_size; // what the last SWARM joining said the file's size was
+  const char *corrupt;  // a file to change a byte of on joining, or NULL
+};
+
+static void *fake_registry_run(void *arg) {
+  struct fake_registry *r = arg;
+  uint8_t req[P2P_SWARM_REQUEST_LEN + 1];
+  while (p2p_recv_all(r->fd, req, sizeof(req)) == 0) {
+    uint8_t c = req[P2P_SWARM_REQUEST_LEN];
+    while (c != 0 && p2p_recv_all(r->fd, &c, 1) == 0)
+      ;
+    struct p2p_file_attrs attrs;
+    uint16_t port;
+    p2p_decode_attrs(req + 7, &attrs);
+    memcpy(&port, req + 5, 2);
+    if (port != 0)
+      r->joined_size = attrs.size;
+    int fd = port != 0 && r->corrupt ? open(r->corrupt, O_WRONLY) : -1;
+    if (fd != -1) {
+      CHECK(pwrite(fd, "!", 1, P2P_SWARM_CHUNK + 5) == 1);
+      close(fd);
+    }
+
+    uint8_t reply[P2P_SWARM_REPLY_LEN] = {1};
+    struct p2p_location holder = {.id = 2, .ip = htonl(INADDR_LOOPBACK), .port = r->holder_port};
+    p2p_encode_location(reply + 1 + P2P_ATTRS_LEN, &holder);
+    if (p2p_send_all(r->fd, reply, sizeof(reply)) != 0)
+      break;
+  }
+  return NULL;
+}
+
+#define SWARM_TEST_SIZE (SWARM_MIN_CHUNKS * P2P_SWARM_CHUNK + 1000)
+
+// Download a file from its swarm, the only holder being a child serving
+// it from its shared directory and the registry knowing no attributes.
+// With corrupt the holder's copy changes after it has sent the chunk
+// hashes. Returns what swarm_fetch() did; the file downloaded must match.
+static int swarm_download(int corrupt, uint64_t *received, uint64_t *joined_size) {
+  char dir[] = "/tmp/peertest-swarm.XXXXXX";
+  CHECK(mkdtemp(dir) != NULL && chdir(dir) == 0);
+  mkdir(SHARED_DIR, 0755);
+  uint8_t *data = malloc(SWARM_TEST_SIZE), *copy = malloc(SWARM_TEST_SIZE);
+  for (size_t i = 0; i < SWARM_TEST_SIZE; i++)
+    data[i] = (uint8_t)random();
+  data[P2P_SWARM_CHUNK + 5] = '?';
+  int fd = open(SHARED_DIR "/big", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd != -1 && write(fd, data, SWARM_TEST_SIZE) == SWARM_TEST_SIZE);
+  close(fd);
+
+  global_bucket.rate = 0; // no limit, whatever the tests before left
+  struct fake_registry reg = {.holder_port = (uint16_t)open_listener(),
+                              .corrupt = corrupt ? SHARED_DIR "/big" : NULL};
+  pid_t holder = fork();
+  if (holder == 0) {
+    for (;;)
+      serve_events(0, -1);
+  }
+  my_peer_id = 1;
+  serve_port = (uint16_t)open_listener();
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  sockfd = sv[0];
+  reg.fd = sv[1];
+  pthread_t tid;
+  pthread_create(&tid, NULL, fake_registry_run, &reg);
+
+  *received = 0;
+  int rc = swarm_fetch("big", "copy", received);
+  *joined_size = reg.joined_size;
+  fd = open("copy", O_RDONLY);
+  if (fd != -1) {
+    CHECK(read(fd, copy, SWARM_TEST_SIZE) == SWARM_TEST_SIZE);
+    CHECK(memcmp(data, copy, SWARM_TEST_SIZE) == 0);
+    close(fd);
+  }
+  CHECK(access("copy.part", F_OK) == -1);
+
+  shutdown(sv[1], SHUT_RDWR);
+  pthread_join(tid, NULL);
+  close(sv[0]);
+  close(sv[1]);
+  sockfd = -1;
+  kill(holder, SIGKILL);
+  waitpid(holder, NULL, 0);
+  pthread_mutex_lock(&swarm_lock);
+  if (swarm_find("big"))
+    swarm_file_free(swarm_find("big"));
+  pthread_mutex_unlock(&swarm_lock);
+  unlink("copy");
+  unlink(SHARED_DIR "/big");
+  rmdir(SHARED_DIR);
+  CHECK(chdir("/") == 0 && rmdir(dir) == 0);
+  free(data);
+  free(copy);
+  return rc;
+}
+
+// With no attributes from the registry the size comes from a holder's
+// HAVE and each chunk is checked against the holder's HASHES; a chunk
+// that doesn't match is never kept, and the download fails rather than
+// save it
+static void test_swarm_default(void) {
+  uint64_t received, joined_size;
+  CHECK(swarm_download(0, &received, &joined_size) == 0);
+  CHECK(received == SWARM_TEST_SIZE);
+  CHECK(joined_size == SWARM_TEST_SIZE); // passed on to later downloaders
+
+  CHECK(swarm_download(1, &received, &joined_size) == -1);
+  CHECK(received <= SWARM_TEST_SIZE - P2P_SWARM_CHUNK);
+}
+
+// The chunk held by the fewest neighbours is fetched first, from one
+// that is free; ties are broken at random
+static void test_swarm_pick(void) {
+  uint8_t have[1] = {0}, inflight[1] = {0}, bits[3][1] = {{0}};
+  struct swarm_file f = {.chunks = 8, .have = have};
+  struct swarm_download d = {.file = &f, .inflight = inflight, .nb_count = 3};
+  for (int i = 0; i < 3; i++)
+    d.nb[i].bits = bits[i];
+  // Neighbour 0 has every chunk, 1 chunks 2-7, 2 chunks 4-7
+  for (uint32_t c = 0; c < 8; c++) {
+    for (int i = 0; i < 3; i++) {
+      if (c >= 2u * i)
+        p2p_bit_set(bits[i], c);
+    }
+  }
+
+  uint32_t index;
+  struct swarm_neighbour *from;
+  int seen[8] = {0};
+  for (int i = 0; i < 100; i++) {
+    CHECK(swarm_pick(&d, &index, &from) == 0 && from == &d.nb[0]);
+    seen[index]++;
+  }
+  CHECK(seen[0] > 0 && seen[1] > 0 && seen[0] + seen[1] == 100);
+
+  // Chunks we have or are fetching are passed over
+  p2p_bit_set(have, 0);
+  p2p_bit_set(have, 1);
+  p2p_bit_set(inflight, 3);
+  CHECK(swarm_pick(&d, &index, &from) == 0 && index == 2 && from != &d.nb[2]);
+
+  // So are neighbours that are busy or have failed too often
+  d.nb[0].busy = d.nb[1].busy = 1;
+  CHECK(swarm_pick(&d, &index, &from) == 0 && index >= 4 && from == &d.nb[2]);
+  d.nb[2].failures = SWARM_MAX_FAILURES;
+  CHECK(swarm_pick(&d, &index, &from) == -1);
+}
+
+int main(void) {
+  int fd = mkstemp(test_file);
+  if (fd == -1 || ftruncate(fd, TEST_FILE_SIZE) != 0) {
+    perror("peertest: test file");
+    return 1;
+  }
+  close(fd);
+  upload_init(0, 0);
+
+  test_drr_quantum();
+  test_drr_deficit();
+  test_drr_tiers();
+  test_drr_starved();
+  test_swarm_pick();
+  test_swarm_default();
+
+  unlink(test_file);
+  if (failures) {
+    fprintf(stderr, "peertest: %d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("peertest: all checks passed\n");
+  return 0;
+}
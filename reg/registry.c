@@ -3,6 +3,7 @@
 // Aaron Robinson Almazan
 // Basira Daqiq 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,328 +12,2914 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <signal.h>
 
-#define MAX_PEERS 5
+#include "p2p_proto.h"
+#include "p2p_cpu.h"
+#include "p2p_io.h"
+#include "p2p_net.h"
+#include "p2p_registry.h"
+#include "p2p_tls.h"
+#include "p2p_trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define MAX_PEERS 5             // default limit on locally joined peers
+#define PEER_CAPACITY 256       // most local peers any configuration allows
 #define MAX_FILES 10
-#define MAX_FILENAME_LEN 101
+#define MAX_FILENAME_LEN P2P_MAX_NAME
 #define BUFFER_SIZE 2048
 
+// Replies are queued per connection and written once per pass of the
+// event loop. A client with OUT_HIGH_WATER bytes unsent is not read
+// from until it catches up.
+#define MAX_CONNS 65536
+#define MAX_EVENTS 64
+#define OUT_CHUNK_SIZE 4096
+#define OUT_IOV_MAX 64
+#define OUT_HIGH_WATER (64 * 1024)
+
+// Connection admission. Each source address gets a token bucket of
+// 2 * admit_rate connections, refilled at admit_rate per second, so one
+// host reconnecting in a storm can't crowd out the rest. The bucket holds
+// at least max_local_peers, so every peer behind one address (a NAT, or
+// one host running them all) can re-JOIN at once after a restart.
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_ADMIT_RATE 20
+#define ACCEPT_BATCH 64         // connections accepted per wakeup
+#define ADMIT_TABLE_SIZE 1024   // sources tracked; must be a power of two
+#define ADMIT_PROBE 8
+
+// Cluster mode: the filename keyspace is split between several registries
+// by consistent hashing. Peers published through another shard are kept
+// as remote entries on the shard that owns the names.
+#define MAX_SHARDS 16
+#define VNODES_PER_SHARD 64
+#define MAX_REMOTE_PEERS 64
+#define MAX_ENTRIES (PEER_CAPACITY + MAX_REMOTE_PEERS)
+#define MAX_PENDING 64        // proxied SEARCHes in flight per shard link
+#define LINK_RETRY_SECS 1
+
+// Message action codes are in p2p_proto.h.
+// SEARCH is also answered over UDP on the registry's port number:
+// [P2P_MSG_SEARCH][request id:4][name\0] gets back
+// [P2P_MSG_SEARCH][request id:4][status:1][10-byte SEARCH reply].
+// A shard that doesn't own the name says so and the client uses TCP.
+#define UDP_REQUEST_MAX (5 + MAX_FILENAME_LEN)
+#define UDP_BATCH 64          // datagrams per recvmmsg/sendmmsg
+#define UDP_ROUNDS 16         // batches per wakeup before serving TCP again
+
+// Hot-file replication. A file searched for HOT_SEARCHES times within a
+// window gets copied to the least loaded peers that don't have it.
+#define HOT_WINDOW_SECS 10
+#define HOT_SEARCHES 20
+#define HOT_COOLDOWN_SECS 30  // between replication rounds for one file
+#define REPLICAS_PER_ROUND 2
+
+// Swarms: peers downloading a file a chunk at a time, which serve each
+// other what they have. Membership lasts while the connection a peer
+// asked on is open and it keeps asking.
+#define MAX_SWARM_MEMBERS 256
+#define SWARM_TTL_SECS 60
+
+// Interned filename storage. Names are copied into the arena once, the
+// first time they are published; everything else refers to them by slot.
+#define NAME_ARENA_SIZE (64 * 1024)
+#define NAME_TABLE_SIZE 1024  // must be a power of two
+#define NAME_TABLE_LIMIT (NAME_TABLE_SIZE / 4 * 3)
+
+struct name_slot
+{
+  uint32_t hash;
+  uint32_t off;     // offset of the NUL-terminated name in name_arena
+  uint16_t len;
+  uint16_t used;
+  int refs;         // number of peer file entries pointing here
+  uint32_t searches;      // SEARCHes in the current window
+  time_t replicated_at;   // last replication round
+};
+
 struct peer_entry
 {
-    uint32_t id;
-    int socket_fd;
-    char files[MAX_FILES][MAX_FILENAME_LEN];
-    int num_files;
-    struct sockaddr_in addr;
-    int joined;  // Has this peer sent JOIN?
-};
+    uint32_t id;
+    int socket_fd;
+    int files[MAX_FILES];  // name_table slots
+    int num_files;
+    // What PUBLISH ATTRS said about each file, a column per attribute;
+    // zero after a plain PUBLISH
+    uint64_t sizes[MAX_FILES];
+    int64_t mtimes[MAX_FILES];
+    uint64_t digests[MAX_FILES];
+    struct sockaddr_in addr;
+    int joined;  // Has this peer sent JOIN?
+    int remote;  // Published through another shard; socket_fd is that shard's link
+    uint32_t load;  // SEARCH replies that named this peer in the current window
+};
+
+// A piece of a connection's output queue
+struct out_chunk
+{
+  struct out_chunk *next;
+  size_t start, end;   // unsent bytes are data[start..end)
+  uint8_t data[OUT_CHUNK_SIZE];
+};
+
+// Per-connection receive buffer; messages are parsed in place
+struct conn
+{
+  uint8_t buf[BUFFER_SIZE];
+  int len;
+  unsigned gen;   // distinguishes reuse of the same fd
+  int shard;      // outgoing link to this shard, or -1
+  int waiting;    // proxied SEARCH replies still owed to this client
+  struct out_chunk *out_head, *out_tail;  // queued output
+  size_t out_bytes;
+  int dirty;        // on the flush list
+  uint32_t events;  // epoll interest currently registered
+  int handshake;    // P2P_TLS_WANT_* while the TLS handshake runs, else 0
+};
+
+// Another registry in the cluster and our outgoing link to it
+struct shard
+{
+  struct sockaddr_in addr;
+  int link_fd;
+  time_t retry_at;
+  int pending_fd[MAX_PENDING];       // clients waiting for replies, in order
+  unsigned pending_gen[MAX_PENDING];
+  int pending_filter[MAX_PENDING];   // reply is a SEARCH FILTER one
+  uint64_t pending_trace[MAX_PENDING];
+  int pending_head;
+  int pending_count;
+};
+
+struct ring_point
+{
+  uint32_t hash;
+  int shard;
+};
+
+// A peer in a file's swarm. Names are kept here rather than interned:
+// most swarms are for names nobody has published under them yet.
+struct swarm_member
+{
+  int socket_fd;     // connection it asked on
+  time_t seen;       // last SWARM
+  uint32_t hash;
+  uint16_t len;      // 0 if the slot is free
+  char name[MAX_FILENAME_LEN];
+  uint32_t id;
+  struct sockaddr_in addr;      // where it serves chunks
+  struct p2p_file_attrs attrs;  // of the file it is fetching
+};
+
+struct admit_slot
+{
+  uint32_t ip;     // network order, 0 if unused
+  double tokens;
+  double last;     // monotonic time of the last refill
+};
+
+struct peer_entry peers[MAX_ENTRIES];
+int peer_count = 0;
+
+struct conn *conns[MAX_CONNS];
+unsigned conn_gen = 0;
+int epoll_fd = -1;
+int dirty_fds[MAX_CONNS];    // connections with output to flush
+int dirty_count = 0;
+struct out_chunk *free_chunks = NULL;
+
+struct admit_slot admit_table[ADMIT_TABLE_SIZE];
+double admit_rate = DEFAULT_ADMIT_RATE;  // 0 admits everything
+
+struct shard shards[MAX_SHARDS];
+int shard_count = 0;  // 0 when running stand-alone
+int self_shard = 0;
+struct ring_point ring[MAX_SHARDS * VNODES_PER_SHARD];
+int ring_len = 0;
+
+int hint_fd = -1;          // UDP socket for REPLICATE hints
+int udp_fd = -1;           // UDP SEARCH endpoint
+int listen_fd = -1;
+int stop_fd = -1;          // signalled by p2p_registry_stop(); only
+                           // touched with __atomic builtins
+int max_local_peers = MAX_PEERS;
+int test_output = 1;       // print the TEST] lines
+int loop_cpu = -1;         // CPU the event loop is pinned to, or -1
+uint64_t trace_id = 0;     // trace of the SEARCH being handled, if any
+
+#define test_log(...) do { if (test_output) printf(__VA_ARGS__); } while (0)
+time_t window_start = 0;   // start of the current rate window
+
+char name_arena[NAME_ARENA_SIZE];
+size_t arena_used = 0;
+
+struct swarm_member swarm[MAX_SWARM_MEMBERS];
+unsigned swarm_turn = 0;   // rotates which members a reply lists first
+struct name_slot name_table[NAME_TABLE_SIZE];
+int names_used = 0;
+
+// Byte-scanning primitives. Each has a scalar version plus SSE/AVX2
+// versions on x86; init_simd() picks the best one the CPU supports.
+
+// Pointer to the first NUL in p[0..n), or NULL
+const uint8_t* find_nul_scalar(const uint8_t *p, size_t n)
+{
+  return memchr(p, 0, n);
+}
+
+// FNV-1a over a name of known length
+uint32_t hash_name_scalar(const uint8_t *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    {
+      h ^= name[i];
+      h *= 16777619u;
+    }
+  return h;
+}
+
+int names_equal_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  return memcmp(a, b, len) == 0;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+const uint8_t* find_nul_sse2(const uint8_t *p, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+      if (mask) return p + i + __builtin_ctz(mask);
+    }
+  return find_nul_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+const uint8_t* find_nul_avx2(const uint8_t *p, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+      unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+      if (mask) return p + i + __builtin_ctz(mask);
+    }
+  return find_nul_sse2(p + i, n - i);
+}
+
+// CRC32C, eight bytes per instruction
+__attribute__((target("sse4.2")))
+uint32_t hash_name_crc32(const uint8_t *name, size_t len)
+{
+  uint64_t h = 0xffffffffu;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    {
+      uint64_t w;
+      memcpy(&w, name + i, 8);
+      h = _mm_crc32_u64(h, w);
+    }
+  uint32_t h32 = (uint32_t)h;
+  for (; i < len; i++)
+    {
+      h32 = _mm_crc32_u8(h32, name[i]);
+    }
+  return h32 ^ (uint32_t)len;
+}
+
+__attribute__((target("sse2")))
+int names_equal_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return 0;
+    }
+  return memcmp(a + i, b + i, len - i) == 0;
+}
+
+__attribute__((target("avx2")))
+int names_equal_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    {
+      __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+      __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+      if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffffu) return 0;
+    }
+  return names_equal_sse2(a + i, b + i, len - i);
+}
+#endif
+
+const uint8_t* (*find_nul)(const uint8_t *p, size_t n) = find_nul_scalar;
+uint32_t (*hash_name)(const uint8_t *name, size_t len) = hash_name_scalar;
+int (*names_equal)(const uint8_t *a, const uint8_t *b, size_t len) = names_equal_scalar;
+
+// Select the scanning routines once at startup. The hash must not change
+// after names have been interned.
+void init_simd(void)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    {
+      find_nul = find_nul_sse2;
+      names_equal = names_equal_sse2;
+    }
+  if (__builtin_cpu_supports("avx2"))
+    {
+      find_nul = find_nul_avx2;
+      names_equal = names_equal_avx2;
+    }
+  if (__builtin_cpu_supports("sse4.2"))
+    {
+      hash_name = hash_name_crc32;
+    }
+#endif
+}
+
+const char* name_str(int slot)
+{
+  return name_arena + name_table[slot].off;
+}
+
+// Find an interned name; returns its slot or -1
+int lookup_name(const uint8_t *name, size_t len, uint32_t hash)
+{
+  uint32_t i = hash & (NAME_TABLE_SIZE - 1);
+  while (name_table[i].used)
+    {
+      struct name_slot *ns = &name_table[i];
+      if (ns->hash == hash && ns->len == len &&
+	  names_equal((const uint8_t*)name_arena + ns->off, name, len))
+	{
+	  return (int)i;
+	}
+      i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    }
+  return -1;
+}
+
+// Place a name that is already in the arena into the table
+int insert_slot(uint32_t hash, uint32_t off, uint16_t len)
+{
+  uint32_t i = hash & (NAME_TABLE_SIZE - 1);
+  while (name_table[i].used)
+    {
+      i = (i + 1) & (NAME_TABLE_SIZE - 1);
+    }
+  name_table[i].hash = hash;
+  name_table[i].off = off;
+  name_table[i].len = len;
+  name_table[i].used = 1;
+  name_table[i].refs = 0;
+  name_table[i].searches = 0;
+  name_table[i].replicated_at = 0;
+  names_used++;
+  return (int)i;
+}
+
+// Drop names no peer references any more and repack the arena.
+// Slot numbers change, so the peers' file lists are remapped.
+void compact_names(void)
+{
+  static struct name_slot old_table[NAME_TABLE_SIZE];
+  static char old_arena[NAME_ARENA_SIZE];
+  static int remap[NAME_TABLE_SIZE];
+
+  memcpy(old_table, name_table, sizeof(name_table));
+  memcpy(old_arena, name_arena, arena_used);
+  memset(name_table, 0, sizeof(name_table));
+  names_used = 0;
+  arena_used = 0;
+
+  for (int i = 0; i < NAME_TABLE_SIZE; i++)
+    {
+      remap[i] = -1;
+      if (!old_table[i].used || old_table[i].refs == 0) continue;
+
+      uint16_t len = old_table[i].len;
+      memcpy(name_arena + arena_used, old_arena + old_table[i].off, len + 1);
+      remap[i] = insert_slot(old_table[i].hash, (uint32_t)arena_used, len);
+      name_table[remap[i]].refs = old_table[i].refs;
+      name_table[remap[i]].searches = old_table[i].searches;
+      name_table[remap[i]].replicated_at = old_table[i].replicated_at;
+      arena_used += len + 1;
+    }
+
+  for (int i = 0; i < peer_count; i++)
+    {
+      for (int j = 0; j < peers[i].num_files; j++)
+	{
+	  peers[i].files[j] = remap[peers[i].files[j]];
+	}
+    }
+}
+
+// Return the slot for a name, copying it into the arena if it is new
+int intern_name(const uint8_t *name, size_t len)
+{
+  uint32_t hash = hash_name(name, len);
+  int slot = lookup_name(name, len, hash);
+  if (slot >= 0) return slot;
+
+  if (names_used >= NAME_TABLE_LIMIT || arena_used + len + 1 > NAME_ARENA_SIZE)
+    {
+      compact_names();
+      if (names_used >= NAME_TABLE_LIMIT || arena_used + len + 1 > NAME_ARENA_SIZE)
+	{
+	  fprintf(stderr, "Name table full\n");
+	  return -1;
+	}
+    }
+
+  memcpy(name_arena + arena_used, name, len + 1);
+  slot = insert_slot(hash, (uint32_t)arena_used, (uint16_t)len);
+  arena_used += len + 1;
+  return slot;
+}
+
+// Release every file a peer has published
+void release_files(struct peer_entry *peer)
+{
+  for (int i = 0; i < peer->num_files; i++)
+    {
+      name_table[peer->files[i]].refs--;
+    }
+  peer->num_files = 0;
+}
+
+// Start watching a new connection
+struct conn* add_connection(int fd)
+{
+  if (fd >= MAX_CONNS)
+    {
+      fprintf(stderr, "Too many connections\n");
+      return NULL;
+    }
+
+  struct conn *c = calloc(1, sizeof(struct conn));
+  if (!c)
+    {
+      perror("calloc");
+      return NULL;
+    }
+  c->gen = ++conn_gen;
+  c->shard = -1;
+  c->events = EPOLLIN;
+
+  // fd must already be non-blocking
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      free(c);
+      return NULL;
+    }
+  conns[fd] = c;
+  return c;
+}
+
+// Register the events a connection currently wants: input unless its
+// receive buffer or output queue is full, output while anything is
+// queued. A TLS handshake waits on just the one it asked for.
+void update_events(int fd, struct conn *c)
+{
+  uint32_t want = 0;
+  if (c->handshake)
+    {
+      want = c->handshake == P2P_TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+    }
+  else
+    {
+      if (c->len < BUFFER_SIZE && c->out_bytes < OUT_HIGH_WATER)
+	{
+	  want |= EPOLLIN;
+	}
+      if (c->out_bytes > 0 || p2p_tls_unsent(fd) > 0)
+	{
+	  want |= EPOLLOUT;
+	}
+    }
+  if (want != c->events)
+    {
+      struct epoll_event ev = { .events = want, .data.fd = fd };
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+	{
+	  perror("epoll_ctl");
+	}
+      c->events = want;
+    }
+}
+
+// Put a connection on the list flushed at the end of this loop pass
+void mark_dirty(int fd, struct conn *c)
+{
+  if (!c->dirty && dirty_count < MAX_CONNS)
+    {
+      c->dirty = 1;
+      dirty_fds[dirty_count++] = fd;
+    }
+}
+
+// Queue bytes for a connection; returns 0 on success, -1 on error
+int queue_output(int fd, const void *data, size_t len)
+{
+  struct conn *c = conns[fd];
+  const uint8_t *p = data;
+  if (!c) return -1;
+
+  while (len > 0)
+    {
+      struct out_chunk *t = c->out_tail;
+      if (!t || t->end == OUT_CHUNK_SIZE)
+	{
+	  // Chunks are recycled, so steady traffic doesn't allocate
+	  t = free_chunks;
+	  if (t)
+	    {
+	      free_chunks = t->next;
+	    }
+	  else if (!(t = malloc(sizeof(*t))))
+	    {
+	      perror("malloc");
+	      return -1;
+	    }
+	  t->next = NULL;
+	  t->start = t->end = 0;
+	  if (c->out_tail) c->out_tail->next = t;
+	  else c->out_head = t;
+	  c->out_tail = t;
+	}
+
+      size_t n = OUT_CHUNK_SIZE - t->end;
+      if (n > len) n = len;
+      memcpy(t->data + t->end, p, n);
+      t->end += n;
+      c->out_bytes += n;
+      p += n;
+      len -= n;
+    }
+  mark_dirty(fd, c);
+  return 0;
+}
+
+// Return a connection's queued chunks to the free list
+void discard_output(struct conn *c)
+{
+  while (c->out_head)
+    {
+      struct out_chunk *t = c->out_head;
+      c->out_head = t->next;
+      t->next = free_chunks;
+      free_chunks = t;
+    }
+  c->out_tail = NULL;
+  c->out_bytes = 0;
+}
+
+// Write queued output, up to OUT_IOV_MAX chunks per gathered send, until
+// the queue is empty or the socket is full. Returns -1 if the connection
+// failed.
+int flush_output(int fd, struct conn *c)
+{
+  // Without kernel TLS, a record already encrypted goes out first
+  if (p2p_tls_flush(fd) < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+  while (c->out_head)
+    {
+      struct iovec iov[OUT_IOV_MAX];
+      int cnt = 0;
+      for (struct out_chunk *t = c->out_head; t && cnt < OUT_IOV_MAX; t = t->next)
+	{
+	  iov[cnt].iov_base = t->data + t->start;
+	  iov[cnt].iov_len = t->end - t->start;
+	  cnt++;
+	}
+
+      // sendmsg() is writev() plus MSG_NOSIGNAL
+      struct msghdr mh;
+      memset(&mh, 0, sizeof(mh));
+      mh.msg_iov = iov;
+      mh.msg_iovlen = cnt;
+      ssize_t n = p2p_sendmsg(fd, &mh, MSG_NOSIGNAL);
+      if (n < 0)
+	{
+	  if (errno == EINTR) continue;
+	  if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;  // wait for EPOLLOUT
+	  return -1;
+	}
+
+      c->out_bytes -= n;
+      while (n > 0)
+	{
+	  struct out_chunk *t = c->out_head;
+	  size_t avail = t->end - t->start;
+	  if ((size_t)n < avail)
+	    {
+	      t->start += n;
+	      break;
+	    }
+	  n -= avail;
+	  c->out_head = t->next;
+	  t->next = free_chunks;
+	  free_chunks = t;
+	}
+      if (!c->out_head)
+	{
+	  c->out_tail = NULL;
+	}
+      else if (c->out_head->start > 0)
+	{
+	  return 0;  // short write: the socket buffer is full
+	}
+    }
+  return 0;
+}
+
+void drop_connection(int fd);
+
+// ---- Cluster ring ----
+
+// Ring positions must agree between every registry and peer, so they
+// use the shared p2p_ring_hash() rather than the CPU-selected hash
+uint32_t ring_hash(const uint8_t *data, size_t len)
+{
+  return p2p_ring_hash(data, len);
+}
+
+int compare_points(const void *a, const void *b)
+{
+  const struct ring_point *pa = a, *pb = b;
+  if (pa->hash != pb->hash) return pa->hash < pb->hash ? -1 : 1;
+  return pa->shard - pb->shard;
+}
+
+// Each shard gets VNODES_PER_SHARD points hashed from its address
+void build_ring(void)
+{
+  ring_len = 0;
+  for (int k = 0; k < shard_count; k++)
+    {
+      for (int v = 0; v < VNODES_PER_SHARD; v++)
+	{
+	  uint8_t key[8];
+	  uint16_t vnode = htons((uint16_t)v);
+	  memcpy(key, &shards[k].addr.sin_addr.s_addr, 4);
+	  memcpy(key + 4, &shards[k].addr.sin_port, 2);
+	  memcpy(key + 6, &vnode, 2);
+	  ring[ring_len].hash = ring_hash(key, sizeof(key));
+	  ring[ring_len].shard = k;
+	  ring_len++;
+	}
+    }
+  qsort(ring, ring_len, sizeof(ring[0]), compare_points);
+}
+
+// Shard that owns a filename: the first ring point at or after its hash
+int owner_of(const uint8_t *name, size_t len)
+{
+  if (shard_count == 0) return self_shard;
+
+  uint32_t h = ring_hash(name, len);
+  int lo = 0, hi = ring_len;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (ring[mid].hash < h) lo = mid + 1;
+      else hi = mid;
+    }
+  return ring[lo == ring_len ? 0 : lo].shard;
+}
+
+// ---- Shard links ----
+
+void forward_publish(int k, struct peer_entry *peer);
+
+// Connected link to shard k, or -1. Down links are retried at most
+// every LINK_RETRY_SECS; on (re)connect the shard is sent every local
+// peer's names so it catches up on anything it missed.
+int shard_link(int k)
+{
+  struct shard *sh = &shards[k];
+  if (sh->link_fd >= 0) return sh->link_fd;
+  if (time(NULL) < sh->retry_at) return -1;
+  sh->retry_at = time(NULL) + LINK_RETRY_SECS;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror("socket");
+      return -1;
+    }
+  if (connect(fd, (struct sockaddr*)&sh->addr, sizeof(sh->addr)) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  p2p_net_tune(fd, P2P_NET_CONTROL);
+
+  struct conn *c = NULL;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 || !(c = add_connection(fd)))
+    {
+      close(fd);
+      return -1;
+    }
+  if (p2p_tls_enabled())
+    {
+      // The shard may be linking to us at the same moment, so the
+      // handshake runs on the event loop; what we queue waits for it
+      char host[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &sh->addr.sin_addr, host, sizeof(host));
+      if (p2p_tls_start(fd, 0, host) != P2P_OK)
+	{
+	  drop_connection(fd);
+	  return -1;
+	}
+      c->handshake = P2P_TLS_WANT_WRITE;
+      update_events(fd, c);
+    }
+  c->shard = k;
+  sh->link_fd = fd;
+  sh->pending_head = 0;
+  sh->pending_count = 0;
+  test_log("TEST] SHARD %d UP\n", k);
+
+  for (int i = 0; i < peer_count; i++)
+    {
+      if (!peers[i].remote && peers[i].joined)
+	{
+	  forward_publish(k, &peers[i]);
+	}
+    }
+  return shards[k].link_fd;
+}
+
+// Queue a message on shard k's link. Write errors show up when the
+// link is flushed, which drops it.
+int send_to_shard(int k, const void *buf, size_t len)
+{
+  int fd = shard_link(k);
+  if (fd < 0) return -1;
+  return queue_output(fd, buf, len);
+}
+
+// Retry any links that are down
+void reconnect_shards(void)
+{
+  for (int k = 0; k < shard_count; k++)
+    {
+      if (k != self_shard)
+	{
+	  shard_link(k);
+	}
+    }
+}
+
+// Columns of a peer's file j gathered into one struct
+void file_attrs(const struct peer_entry *peer, int j, struct p2p_file_attrs *attrs)
+{
+  attrs->size = peer->sizes[j];
+  attrs->mtime = peer->mtimes[j];
+  attrs->digest = peer->digests[j];
+}
+
+// Encode a peer's id and address as sent in shard messages
+size_t put_peer_ident(uint8_t *out, const struct peer_entry *peer)
+{
+  uint32_t id_net = htonl(peer->id);
+  memcpy(out, &id_net, 4);
+  memcpy(out + 4, &peer->addr.sin_addr.s_addr, 4);
+  memcpy(out + 8, &peer->addr.sin_port, 2);
+  return 10;
+}
+
+// Tell shard k which of a local peer's names it owns. Sent even when
+// there are none, so the shard drops any it had before.
+void forward_publish(int k, struct peer_entry *peer)
+{
+  uint8_t msg[15 + MAX_FILES * (P2P_ATTRS_LEN + MAX_FILENAME_LEN)];
+  size_t len = 0;
+  uint32_t count = 0;
+
+  msg[len++] = P2P_MSG_SHARD_PUBLISH;
+  len += put_peer_ident(msg + len, peer);
+  len += 4;  // count, filled in below
+  for (int i = 0; i < peer->num_files; i++)
+    {
+      struct name_slot *ns = &name_table[peer->files[i]];
+      if (owner_of((const uint8_t*)name_arena + ns->off, ns->len) != k) continue;
+      struct p2p_file_attrs attrs;
+      file_attrs(peer, i, &attrs);
+      p2p_encode_attrs(msg + len, &attrs);
+      len += P2P_ATTRS_LEN;
+      memcpy(msg + len, name_arena + ns->off, ns->len + 1);
+      len += ns->len + 1;
+      count++;
+    }
+  uint32_t count_net = htonl(count);
+  memcpy(msg + 11, &count_net, 4);
+
+  send_to_shard(k, msg, len);
+}
+
+void forward_leave(struct peer_entry *peer)
+{
+  uint8_t msg[11];
+  msg[0] = P2P_MSG_SHARD_LEAVE;
+  put_peer_ident(msg + 1, peer);
+  for (int k = 0; k < shard_count; k++)
+    {
+      if (k != self_shard && shards[k].link_fd >= 0)
+	{
+	  send_to_shard(k, msg, sizeof(msg));
+	}
+    }
+}
+
+// ---- Catalog snapshots ----
+//
+// SEARCH reads an immutable snapshot of every (name, holder) pair sorted
+// by name hash, plus the few peer entries changed since it was taken.
+// A builder thread merges those changes into a new snapshot, off the
+// event loop, and the event loop swaps it in between requests: a double
+// buffer with one reader, since SEARCH only ever runs on the event loop
+// thread. The builder reads the old snapshot until the swap, so the old
+// one is freed right there. The files' attributes sit
+// in columns beside the records, and a second index orders the records
+// by content digest.
+
+struct cat_record
+{
+  uint32_t hash;
+  uint16_t len;
+  uint16_t entry;     // index into peers[]
+  uint32_t gen;       // entry_gen[entry] when recorded; stale once it moves on
+  uint32_t name_off;  // into the snapshot's names
+};
+
+struct digest_ref
+{
+  uint64_t digest;
+  uint32_t rec;     // index into the snapshot's records
+};
+
+struct catalog
+{
+  int count;
+  size_t names_len;
+  struct cat_record *recs;
+  uint64_t *sizes;    // attribute columns, parallel to recs
+  int64_t *mtimes;
+  uint64_t *digests;
+  int digest_count;
+  struct digest_ref *by_digest;  // records with a known digest, sorted
+  char *names;
+};
+
+// A changed entry's record with its attributes, as the builder gets it
+struct job_record
+{
+  struct cat_record rec;
+  struct p2p_file_attrs attrs;
+};
+
+// Input for one merge, captured by the event loop
+struct merge_job
+{
+  const struct catalog *base;
+  int cpu;    // the event loop's CPU, -1 if it isn't pinned
+  int peer_count;
+  uint32_t gens[MAX_ENTRIES];
+  int count;  // records of the changed entries
+  struct job_record recs[MAX_ENTRIES * MAX_FILES];
+  size_t names_len;
+  char names[MAX_ENTRIES * MAX_FILES * MAX_FILENAME_LEN];
+};
+
+struct catalog *catalog = NULL;   // current snapshot, NULL before the first merge
+uint32_t entry_gen[MAX_ENTRIES];  // bumped whenever peers[i] changes
+uint32_t catalog_gen = 0;
+int delta[MAX_ENTRIES];           // entries changed since the snapshot
+int in_delta[MAX_ENTRIES];
+int delta_count = 0;
+
+struct merge_job merge;
+uint32_t merge_gen = 0;           // catalog_gen when the running merge was captured
+int merging = 0;
+int merge_ready = 0;              // job handed to the builder
+struct catalog *merged = NULL;    // builder's result
+pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+int merge_quit = 0;               // tells the builder to exit
+pthread_t merge_tid;
+int merge_event_fd = -1;          // signalled when a merge finishes
+
+// Note that peers[i] changed, so SEARCH looks at it directly until the
+// next snapshot includes it
+void catalog_touch(int i)
+{
+  entry_gen[i] = ++catalog_gen;
+  if (!in_delta[i])
+    {
+      in_delta[i] = 1;
+      delta[delta_count++] = i;
+    }
+}
+
+int compare_records(const void *a, const void *b)
+{
+  const struct cat_record *ra = a, *rb = b;
+  if (ra->hash != rb->hash) return ra->hash < rb->hash ? -1 : 1;
+  return (int)ra->entry - (int)rb->entry;
+}
+
+int compare_job_records(const void *a, const void *b)
+{
+  const struct job_record *ja = a, *jb = b;
+  return compare_records(&ja->rec, &jb->rec);
+}
+
+int compare_digest_refs(const void *a, const void *b)
+{
+  const struct digest_ref *da = a, *db = b;
+  if (da->digest != db->digest) return da->digest < db->digest ? -1 : 1;
+  return da->rec < db->rec ? -1 : da->rec > db->rec;
+}
+
+// New snapshot: the base's records for entries that haven't changed,
+// merged with the changed entries' records. NULL if out of memory.
+struct catalog* merge_catalog(struct merge_job *job)
+{
+  const struct catalog *base = job->base;
+  int base_count = base ? base->count : 0;
+  size_t names_cap = job->names_len + (base ? base->names_len : 0);
+  size_t max_recs = (size_t)(base_count + job->count);
+  size_t recs_size = max_recs * sizeof(struct cat_record);
+  size_t column_size = max_recs * sizeof(uint64_t);
+  size_t refs_size = max_recs * sizeof(struct digest_ref);
+
+  struct catalog *cat = malloc(sizeof(*cat) + recs_size + 3 * column_size + refs_size + names_cap);
+  if (!cat) return NULL;
+  cat->recs = (struct cat_record*)(cat + 1);
+  cat->sizes = (uint64_t*)((char*)cat->recs + recs_size);
+  cat->mtimes = (int64_t*)((char*)cat->sizes + column_size);
+  cat->digests = (uint64_t*)((char*)cat->mtimes + column_size);
+  cat->by_digest = (struct digest_ref*)((char*)cat->digests + column_size);
+  cat->names = (char*)cat->by_digest + refs_size;
+
+  qsort(job->recs, job->count, sizeof(job->recs[0]), compare_job_records);
+
+  int a = 0, b = 0, n = 0;
+  size_t used = 0;
+  while (a < base_count || b < job->count)
+    {
+      const struct cat_record *ra = a < base_count ? &base->recs[a] : NULL;
+      if (ra && (ra->entry >= job->peer_count || job->gens[ra->entry] != ra->gen))
+	{
+	  a++;  // entry changed or went away
+	  continue;
+	}
+      const struct cat_record *rb = b < job->count ? &job->recs[b].rec : NULL;
+
+      const struct cat_record *r;
+      const char *names;
+      if (rb && (!ra || compare_records(rb, ra) < 0))
+	{
+	  r = rb;
+	  names = job->names;
+	  cat->sizes[n] = job->recs[b].attrs.size;
+	  cat->mtimes[n] = job->recs[b].attrs.mtime;
+	  cat->digests[n] = job->recs[b].attrs.digest;
+	  b++;
+	}
+      else
+	{
+	  r = ra;
+	  names = base->names;
+	  cat->sizes[n] = base->sizes[a];
+	  cat->mtimes[n] = base->mtimes[a];
+	  cat->digests[n] = base->digests[a];
+	  a++;
+	}
+      cat->recs[n] = *r;
+      cat->recs[n].name_off = (uint32_t)used;
+      memcpy(cat->names + used, names + r->name_off, r->len + 1);
+      used += r->len + 1;
+      n++;
+    }
+  cat->count = n;
+  cat->names_len = used;
+
+  int refs = 0;
+  for (int i = 0; i < n; i++)
+    {
+      if (cat->digests[i] == 0) continue;  // published without attributes
+      cat->by_digest[refs].digest = cat->digests[i];
+      cat->by_digest[refs].rec = (uint32_t)i;
+      refs++;
+    }
+  qsort(cat->by_digest, refs, sizeof(cat->by_digest[0]), compare_digest_refs);
+  cat->digest_count = refs;
+  return cat;
+}
+
+void* merge_thread(void *arg)
+{
+  int pinned_cpu = -1;
+  (void)arg;
+  for (;;)
+    {
+      pthread_mutex_lock(&merge_lock);
+      while (!merge_ready && !merge_quit)
+	{
+	  pthread_cond_wait(&merge_cond, &merge_lock);
+	}
+      if (merge_quit)
+	{
+	  pthread_mutex_unlock(&merge_lock);
+	  break;
+	}
+      merge_ready = 0;
+      pthread_mutex_unlock(&merge_lock);
+
+      // Build on the event loop's NUMA node, so the snapshot's pages are
+      // local to the thread that searches them
+      if (merge.cpu >= 0 && merge.cpu != pinned_cpu)
+	{
+	  if (p2p_pin_node(p2p_cpu_node(merge.cpu)) < 0)
+	    {
+	      perror("pin catalog builder");
+	    }
+	  pinned_cpu = merge.cpu;
+	}
+
+      struct catalog *cat = merge_catalog(&merge);
+
+      pthread_mutex_lock(&merge_lock);
+      merged = cat;
+      pthread_mutex_unlock(&merge_lock);
+
+      uint64_t one = 1;
+      if (write(merge_event_fd, &one, sizeof(one)) < 0)
+	{
+	  perror("write merge event");
+	}
+    }
+  return NULL;
+}
+
+// Start the builder thread; without it SEARCH keeps using the delta
+void catalog_init(void)
+{
+  if (merge_event_fd >= 0) return;  // already running
+  merge_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (merge_event_fd < 0)
+    {
+      perror("eventfd");
+      return;
+    }
+  merge_quit = 0;
+  if (pthread_create(&merge_tid, NULL, merge_thread, NULL) != 0)
+    {
+      fprintf(stderr, "Can't start catalog builder\n");
+      close(merge_event_fd);
+      merge_event_fd = -1;
+    }
+}
+
+// Stop and join the builder; catalog_reset() has landed its last merge
+void catalog_stop(void)
+{
+  if (merge_event_fd < 0) return;
+  pthread_mutex_lock(&merge_lock);
+  merge_quit = 1;
+  pthread_cond_signal(&merge_cond);
+  pthread_mutex_unlock(&merge_lock);
+  pthread_join(merge_tid, NULL);
+  close(merge_event_fd);
+  merge_event_fd = -1;
+}
+
+// Hand the changed entries to the builder if it is idle
+void start_merge(void)
+{
+  if (merging || delta_count == 0 || merge_event_fd < 0) return;
+
+  merge.base = catalog;
+  merge.cpu = loop_cpu;
+  merge.peer_count = peer_count;
+  memcpy(merge.gens, entry_gen, sizeof(entry_gen));
+  merge.count = 0;
+  merge.names_len = 0;
+  for (int d = 0; d < delta_count; d++)
+    {
+      int i = delta[d];
+      if (i >= peer_count || !peers[i].joined) continue;
+      for (int j = 0; j < peers[i].num_files; j++)
+	{
+	  const struct name_slot *ns = &name_table[peers[i].files[j]];
+	  file_attrs(&peers[i], j, &merge.recs[merge.count].attrs);
+	  struct cat_record *r = &merge.recs[merge.count++].rec;
+	  r->hash = ns->hash;
+	  r->len = ns->len;
+	  r->entry = (uint16_t)i;
+	  r->gen = entry_gen[i];
+	  r->name_off = (uint32_t)merge.names_len;
+	  memcpy(merge.names + merge.names_len, name_arena + ns->off, ns->len + 1);
+	  merge.names_len += ns->len + 1;
+	}
+    }
+  merge_gen = catalog_gen;
+  merging = 1;
+
+  pthread_mutex_lock(&merge_lock);
+  merge_ready = 1;
+  pthread_cond_signal(&merge_cond);
+  pthread_mutex_unlock(&merge_lock);
+}
+
+// Swap in the builder's snapshot and drop the entries it now covers
+void finish_merge(void)
+{
+  uint64_t count;
+  if (read(merge_event_fd, &count, sizeof(count)) < 0) return;
+
+  pthread_mutex_lock(&merge_lock);
+  struct catalog *next = merged;
+  merged = NULL;
+  pthread_mutex_unlock(&merge_lock);
+  merging = 0;
+  if (!next) return;  // out of memory; the delta still has everything
+
+  // The builder is done with the old snapshot and SEARCH runs on this
+  // thread, so nothing still reads it
+  free(catalog);
+  catalog = next;
+
+  int kept = 0;
+  for (int d = 0; d < delta_count; d++)
+    {
+      int i = delta[d];
+      if (entry_gen[i] > merge_gen)
+	{
+	  delta[kept++] = i;  // changed again while merging
+	}
+      else
+	{
+	  in_delta[i] = 0;
+	}
+    }
+  delta_count = kept;
+}
+
+// ---- Peer table ----
+
+// Find a locally joined peer by socket
+struct peer_entry* find_peer_by_socket(int sockfd)
+{
+    for (int i = 0; i < peer_count; i++)
+      {
+        if (peers[i].socket_fd == sockfd && !peers[i].remote)
+	  {
+            return &peers[i];
+	  }
+      }
+    return NULL;
+}
+
+// Find a peer published to us by the shard on link_fd
+struct peer_entry* find_remote_peer(int link_fd, const uint8_t *ident)
+{
+  uint32_t id_net;
+  memcpy(&id_net, ident, 4);
+  for (int i = 0; i < peer_count; i++)
+    {
+      struct peer_entry *p = &peers[i];
+      if (p->remote && p->socket_fd == link_fd && p->id == ntohl(id_net) &&
+	  memcmp(&p->addr.sin_addr.s_addr, ident + 4, 4) == 0 &&
+	  memcmp(&p->addr.sin_port, ident + 8, 2) == 0)
+	{
+	  return p;
+	}
+    }
+  return NULL;
+}
+
+int local_peer_count(void)
+{
+  int n = 0;
+  for (int i = 0; i < peer_count; i++)
+    {
+      if (!peers[i].remote) n++;
+    }
+  return n;
+}
+
+// Remove peers[i], moving the last entry into its place. Snapshot
+// records of the old last index are out of range from here on, and a
+// later JOIN there bumps its generation, so only i changes.
+void remove_entry(int i)
+{
+  release_files(&peers[i]);
+  peer_count--;
+  if (i < peer_count)
+    {
+      peers[i] = peers[peer_count];
+    }
+  memset(&peers[peer_count], 0, sizeof(peers[0]));
+  catalog_touch(i);
+}
+
+// Remove every entry attached to a socket: the local peer on it, or all
+// remote peers a shard link carried
+void remove_peer(int sockfd)
+{
+  for (int i = 0; i < peer_count; )
+    {
+      if (peers[i].socket_fd == sockfd)
+	{
+	  if (!peers[i].remote && peers[i].joined)
+	    {
+	      forward_leave(&peers[i]);
+	    }
+	  remove_entry(i);
+	}
+      else
+	{
+	  i++;
+	}
+    }
+}
+
+// Parse count NUL-terminated names from msg[pos..len), each preceded by
+// its attributes if with_attrs, into a peer's file list, replacing what
+// it had
+int parse_names(struct peer_entry *peer, const uint8_t *msg, int len, int pos, uint32_t count,
+		int with_attrs)
+{
+  if (count > MAX_FILES) count = MAX_FILES;
+
+  release_files(peer);
+
+  int file_idx = 0;
+  while (pos < len && file_idx < (int)count)
+    {
+      struct p2p_file_attrs attrs = {0};
+      if (with_attrs)
+	{
+	  if (len - pos < P2P_ATTRS_LEN) break;
+	  p2p_decode_attrs(msg + pos, &attrs);
+	  pos += P2P_ATTRS_LEN;
+	}
+      const uint8_t *name = msg + pos;
+      const uint8_t *end = find_nul(name, len - pos);
+      if (!end) break;
+      int name_len = (int)(end - name);
+
+      if (name_len > 0 && name_len < MAX_FILENAME_LEN)
+	{
+	  // Interning may compact the table, so keep num_files current
+	  // for the remap
+	  int slot = intern_name(name, name_len);
+	  if (slot >= 0)
+	    {
+	      name_table[slot].refs++;
+	      peer->sizes[file_idx] = attrs.size;
+	      peer->mtimes[file_idx] = attrs.mtime;
+	      peer->digests[file_idx] = attrs.digest;
+	      peer->files[file_idx++] = slot;
+	      peer->num_files = file_idx;
+	    }
+        }
+        
+      pos += name_len + 1;
+    }
+  catalog_touch((int)(peer - peers));
+  return file_idx;
+}
+
+// Handle JOIN message
+void handle_join(int sockfd, const uint8_t *msg, int len)
+{
+  if (len < 5) return;
+  
+  uint32_t peer_id_net;
+  memcpy(&peer_id_net, msg + 1, 4);
+  uint32_t peer_id = ntohl(peer_id_net);
+  
+  // Get peer's address using getpeername
+  struct sockaddr_in peer_addr;
+  socklen_t addr_len = sizeof(peer_addr);
+  if (getpeername(sockfd, (struct sockaddr*)&peer_addr, &addr_len) < 0)
+    {
+      perror("getpeername");
+      return;
+    }
+  
+  // Find or create peer entry
+  struct peer_entry *peer = find_peer_by_socket(sockfd);
+  if (!peer)
+    {
+      if (local_peer_count() >= max_local_peers || peer_count >= MAX_ENTRIES)
+	{
+	  fprintf(stderr, "Max peers reached\n");
+	  return;
+	}
+    peer = &peers[peer_count++];
+    peer->socket_fd = sockfd;
+    peer->num_files = 0;
+    peer->remote = 0;
+    }
+  
+  peer->id = peer_id;
+  peer->addr = peer_addr;
+  peer->joined = 1;
+  catalog_touch((int)(peer - peers));
+  
+  test_log("TEST] JOIN %u\n", peer_id);
+}
+
+// Handle PUBLISH and PUBLISH ATTRS messages
+void handle_publish(int sockfd, const uint8_t *msg, int len)
+{
+  if (len < 5) return;
+  
+  struct peer_entry *peer = find_peer_by_socket(sockfd);
+  if (!peer || !peer->joined) return;
+  
+  uint32_t count_net;
+  memcpy(&count_net, msg + 1, 4);
+  
+  // A new PUBLISH replaces the previous file list
+  int file_idx = parse_names(peer, msg, len, 5, ntohl(count_net),
+			     msg[0] == P2P_MSG_PUBLISH_ATTRS);
+  
+  // Print output
+  if (test_output)
+    {
+      printf("TEST] PUBLISH %d", file_idx);
+      for (int i = 0; i < file_idx; i++)
+	{
+	  printf(" %s", name_str(peer->files[i]));
+	}
+      printf("\n");
+    }
+
+  // Hand each other shard the names it owns
+  for (int k = 0; k < shard_count; k++)
+    {
+      if (k != self_shard)
+	{
+	  forward_publish(k, peer);
+	}
+    }
+}
+
+// Handle SHARD PUBLISH: another registry's peer published names we own
+void handle_shard_publish(int sockfd, const uint8_t *msg, int len)
+{
+  if (len < 15) return;
+
+  struct peer_entry *peer = find_remote_peer(sockfd, msg + 1);
+  if (!peer)
+    {
+      if (peer_count >= MAX_ENTRIES)
+	{
+	  fprintf(stderr, "Max remote peers reached\n");
+	  return;
+	}
+      uint32_t id_net;
+      memcpy(&id_net, msg + 1, 4);
+      peer = &peers[peer_count++];
+      memset(peer, 0, sizeof(*peer));
+      peer->id = ntohl(id_net);
+      peer->socket_fd = sockfd;
+      peer->addr.sin_family = AF_INET;
+      memcpy(&peer->addr.sin_addr.s_addr, msg + 5, 4);
+      memcpy(&peer->addr.sin_port, msg + 9, 2);
+      peer->joined = 1;
+      peer->remote = 1;
+    }
+
+  uint32_t count_net;
+  memcpy(&count_net, msg + 11, 4);
+  parse_names(peer, msg, len, 15, ntohl(count_net), 1);
+}
+
+// Handle SHARD LEAVE: a peer of another registry disconnected
+void handle_shard_leave(int sockfd, const uint8_t *msg, int len)
+{
+  if (len < 11) return;
+
+  struct peer_entry *peer = find_remote_peer(sockfd, msg + 1);
+  if (peer)
+    {
+      remove_entry((int)(peer - peers));
+    }
+}
+
+// Handle CLUSTER MAP: reply with the shard count, virtual nodes per shard
+// and each shard's address. A stand-alone registry reports no shards.
+void handle_cluster_map(int sockfd)
+{
+  uint8_t msg[4 + MAX_SHARDS * 6];
+  uint16_t count_net = htons((uint16_t)shard_count);
+  uint16_t vnodes_net = htons(VNODES_PER_SHARD);
+  size_t len = 0;
+
+  memcpy(msg, &count_net, 2);
+  memcpy(msg + 2, &vnodes_net, 2);
+  len = 4;
+  for (int k = 0; k < shard_count; k++)
+    {
+      memcpy(msg + len, &shards[k].addr.sin_addr.s_addr, 4);
+      memcpy(msg + len + 4, &shards[k].addr.sin_port, 2);
+      len += 6;
+    }
+
+  if (queue_output(sockfd, msg, len) < 0)
+    {
+      fprintf(stderr, "Dropping cluster map reply\n");
+    }
+}
+
+// Pass a SEARCH or SEARCH FILTER for a name owned elsewhere on to its
+// shard. The client stops being served until the reply comes back so
+// replies stay in order. Returns -1 if the shard can't be reached.
+int forward_search(int sockfd, int k, const uint8_t *msg, int len)
+{
+  struct shard *sh = &shards[k];
+  if (sh->pending_count == MAX_PENDING) return -1;
+
+  int filtered = msg[0] == P2P_MSG_SEARCH_FILTER;
+  uint8_t fwd[1 + P2P_FILTER_LEN + MAX_FILENAME_LEN];
+  if (len > (int)sizeof(fwd)) return -1;
+  memcpy(fwd, msg, len);
+  fwd[0] = filtered ? P2P_MSG_SHARD_SEARCH_FILTER : P2P_MSG_SHARD_SEARCH;
+  if (send_to_shard(k, fwd, len) < 0) return -1;
+
+  int tail = (sh->pending_head + sh->pending_count) % MAX_PENDING;
+  sh->pending_fd[tail] = sockfd;
+  sh->pending_gen[tail] = conns[sockfd]->gen;
+  sh->pending_filter[tail] = filtered;
+  sh->pending_trace[tail] = trace_id;
+  sh->pending_count++;
+  P2P_TRACE(trace_id, P2P_TRACE_FORWARD, k);
+  trace_id = 0;  // finished by deliver_reply
+  conns[sockfd]->waiting++;
+
+  test_log("TEST] SEARCH %s -> shard %d\n",
+	   (const char*)msg + (filtered ? 1 + P2P_FILTER_LEN : 1), k);
+  return 0;
+}
+
+void process_messages(int fd, struct conn *c);
+
+// Deliver a proxied SEARCH reply to the oldest waiting client
+void deliver_reply(struct shard *sh, const uint8_t *reply, size_t len)
+{
+  if (sh->pending_count == 0) return;
+
+  int fd = sh->pending_fd[sh->pending_head];
+  unsigned gen = sh->pending_gen[sh->pending_head];
+  uint64_t trace = sh->pending_trace[sh->pending_head];
+  sh->pending_head = (sh->pending_head + 1) % MAX_PENDING;
+  sh->pending_count--;
+
+  struct conn *c = conns[fd];
+  if (!c || c->gen != gen)
+    {
+      P2P_TRACE(trace, P2P_TRACE_DONE, P2P_ESINK);
+      return;  // client went away
+    }
+  P2P_TRACE(trace, P2P_TRACE_DONE, P2P_OK);
+
+  if (queue_output(fd, reply, len) < 0)
+    {
+      fprintf(stderr, "Dropping search response\n");
+    }
+  if (--c->waiting == 0)
+    {
+      // Resume anything the client pipelined behind the SEARCH
+      process_messages(fd, c);
+    }
+}
+
+// Length of the reply the oldest waiting client expects
+size_t pending_reply_len(const struct shard *sh)
+{
+  if (sh->pending_count > 0 && sh->pending_filter[sh->pending_head])
+    {
+      return P2P_FILTER_REPLY_LEN + 1;  // plus the name, if any
+    }
+  return 10;
+}
+
+// Read SEARCH replies coming back on our link to a shard
+void handle_link_data(int fd, struct conn *c)
+{
+  struct shard *sh = &shards[c->shard];
+  int pos = 0;
+  for (;;)
+    {
+      int n = (int)pending_reply_len(sh);
+      if (c->len - pos < n) break;
+      if (n > 10)
+	{
+	  // A SEARCH FILTER reply ends with the found name's NUL
+	  const uint8_t *end = find_nul(c->buf + pos + P2P_FILTER_REPLY_LEN,
+					c->len - pos - P2P_FILTER_REPLY_LEN);
+	  if (!end) break;
+	  n = (int)(end - (c->buf + pos)) + 1;
+	}
+      deliver_reply(sh, c->buf + pos, n);
+      pos += n;
+    }
+  memmove(c->buf, c->buf + pos, c->len - pos);
+  c->len -= pos;
+  (void)fd;
+}
+
+// Start a new rate window once the current one has run out
+void roll_window(time_t now)
+{
+  if (now - window_start < HOT_WINDOW_SECS) return;
+
+  window_start = now;
+  for (int i = 0; i < NAME_TABLE_SIZE; i++)
+    {
+      name_table[i].searches = 0;
+    }
+  for (int i = 0; i < peer_count; i++)
+    {
+      peers[i].load = 0;
+    }
+}
+
+int holds_file(const struct peer_entry *peer, int slot)
+{
+  for (int j = 0; j < peer->num_files; j++)
+    {
+      if (peer->files[j] == slot) return 1;
+    }
+  return 0;
+}
+
+// Ask the least loaded local peers without a copy of a hot file to fetch
+// it from holder and publish it
+void replicate_hot(int slot, const struct peer_entry *holder, time_t now)
+{
+  struct name_slot *ns = &name_table[slot];
+  ns->replicated_at = now;
+
+  uint8_t msg[11 + MAX_FILENAME_LEN];
+  msg[0] = P2P_MSG_REPLICATE;
+  put_peer_ident(msg + 1, holder);
+  memcpy(msg + 11, name_arena + ns->off, ns->len + 1);
+
+  int chosen[REPLICAS_PER_ROUND];
+  int n_chosen = 0;
+  while (n_chosen < REPLICAS_PER_ROUND)
+    {
+      int best = -1;
+      for (int i = 0; i < peer_count; i++)
+	{
+	  if (peers[i].remote || !peers[i].joined || holds_file(&peers[i], slot)) continue;
+	  int taken = 0;
+	  for (int c = 0; c < n_chosen; c++)
+	    {
+	      if (chosen[c] == i) taken = 1;
+	    }
+	  if (!taken && (best < 0 || peers[i].load < peers[best].load)) best = i;
+	}
+      if (best < 0) break;
+      chosen[n_chosen++] = best;
+
+      if (sendto(hint_fd, msg, 11 + ns->len + 1, 0,
+		 (struct sockaddr*)&peers[best].addr, sizeof(peers[best].addr)) < 0)
+	{
+	  perror("sendto replicate");
+	  continue;
+	}
+      test_log("TEST] REPLICATE %s %u -> %u\n", name_arena + ns->off, holder->id, peers[best].id);
+    }
+}
+
+// A candidate answer to a SEARCH
+struct holder
+{
+  struct peer_entry *peer;
+  struct p2p_file_attrs attrs;
+  const char *name;   // as the holder published it
+  struct peer_entry **all;  // if set, every holder passing the filter goes here too
+  int all_len, all_cap;
+};
+
+const struct p2p_search_filter no_filter;
+
+// Keep p's copy if it passes the filter and beats the best so far: less
+// loaded, or with newest set, newer. Ties go to the earliest entry.
+void consider(struct holder *best, struct peer_entry *p, const struct p2p_file_attrs *attrs,
+	      const char *name, const struct p2p_search_filter *filter, int newest)
+{
+  if (!p2p_filter_match(filter, attrs)) return;
+  if (best->all && best->all_len < best->all_cap)
+    {
+      best->all[best->all_len++] = p;
+    }
+  if (best->peer)
+    {
+      if (newest && attrs->mtime != best->attrs.mtime)
+	{
+	  if (attrs->mtime < best->attrs.mtime) return;
+	}
+      else if (p->load > best->peer->load || (p->load == best->peer->load && p > best->peer))
+	{
+	  return;
+	}
+    }
+  best->peer = p;
+  best->attrs = *attrs;
+  best->name = name;
+}
+
+// Look at every holder of a name, or with an empty name every holder of
+// filter->digest: the snapshot's records for unchanged entries, then the
+// changed entries
+void scan_holders(const uint8_t *name, size_t len, uint32_t hash, int slot,
+		  const struct p2p_search_filter *filter, int newest, struct holder *best)
+{
+  const struct catalog *cat = catalog;
+  struct p2p_file_attrs attrs;
+  if (cat && len > 0)
+    {
+      int lo = 0, hi = cat->count;
+      while (lo < hi)
+	{
+	  int mid = (lo + hi) / 2;
+	  if (cat->recs[mid].hash < hash) lo = mid + 1;
+	  else hi = mid;
+	}
+      for (int r = lo; r < cat->count && cat->recs[r].hash == hash; r++)
+	{
+	  const struct cat_record *rec = &cat->recs[r];
+	  if (rec->len != len || rec->entry >= peer_count || entry_gen[rec->entry] != rec->gen ||
+	      !names_equal((const uint8_t*)cat->names + rec->name_off, name, len))
+	    {
+	      continue;
+	    }
+	  attrs.size = cat->sizes[r];
+	  attrs.mtime = cat->mtimes[r];
+	  attrs.digest = cat->digests[r];
+	  consider(best, &peers[rec->entry], &attrs, cat->names + rec->name_off, filter, newest);
+	}
+    }
+  else if (cat)
+    {
+      int lo = 0, hi = cat->digest_count;
+      while (lo < hi)
+	{
+	  int mid = (lo + hi) / 2;
+	  if (cat->by_digest[mid].digest < filter->digest) lo = mid + 1;
+	  else hi = mid;
+	}
+      for (int d = lo; d < cat->digest_count && cat->by_digest[d].digest == filter->digest; d++)
+	{
+	  uint32_t r = cat->by_digest[d].rec;
+	  const struct cat_record *rec = &cat->recs[r];
+	  if (rec->entry >= peer_count || entry_gen[rec->entry] != rec->gen) continue;
+	  attrs.size = cat->sizes[r];
+	  attrs.mtime = cat->mtimes[r];
+	  attrs.digest = cat->digests[r];
+	  consider(best, &peers[rec->entry], &attrs, cat->names + rec->name_off, filter, newest);
+	}
+    }
+
+  if (len > 0 && slot < 0) return;  // no changed entry has the name
+  for (int d = 0; d < delta_count; d++)
+    {
+      struct peer_entry *p = &peers[delta[d]];
+      if (delta[d] >= peer_count || !p->joined) continue;
+      for (int j = 0; j < p->num_files; j++)
+	{
+	  if (len > 0 ? p->files[j] != slot : p->digests[j] != filter->digest) continue;
+	  file_attrs(p, j, &attrs);
+	  consider(best, p, &attrs, name_str(p->files[j]), filter, newest);
+	}
+    }
+}
+
+// Least loaded holder of a name whose copy passes the filter. With
+// P2P_FILTER_NEWEST, the least loaded of those with the newest copy's
+// contents, so identical replicas share the load whatever their mtimes.
+struct peer_entry* find_holder(const uint8_t *name, size_t len, uint32_t hash, int slot,
+			       const struct p2p_search_filter *filter, struct holder *found)
+{
+  struct holder best = {0};
+  int newest = (filter->flags & P2P_FILTER_NEWEST) != 0;
+  scan_holders(name, len, hash, slot, filter, newest, &best);
+  if (newest && best.peer && best.attrs.digest != 0)
+    {
+      struct p2p_search_filter same = *filter;
+      same.flags |= P2P_FILTER_DIGEST;
+      same.digest = best.attrs.digest;
+      best.peer = NULL;
+      scan_holders(name, len, hash, slot, &same, 0, &best);
+    }
+  if (found) *found = best;
+  return best.peer;
+}
+
+// Count a SEARCH answered with result toward its load, and replicate the
+// name once it gets hot
+void note_search(struct peer_entry *result, int slot)
+{
+  time_t now = time(NULL);
+  roll_window(now);
+
+  if (result && slot >= 0)
+    {
+      result->load++;
+      struct name_slot *ns = &name_table[slot];
+      if (++ns->searches >= HOT_SEARCHES && hint_fd >= 0 &&
+	  now - ns->replicated_at >= HOT_COOLDOWN_SECS)
+	{
+	  replicate_hot(slot, result, now);
+	}
+    }
+}
+
+// Answer a SEARCH from the local table into the 10-byte reply. The name
+// is looked up where it sits in the request; nothing is copied.
+void lookup_search(const char *filename, size_t name_len, uint8_t *response)
+{
+  const uint8_t *name = (const uint8_t*)filename;
+
+  // Search for file. Spread requesters over the holders: the least
+  // loaded one wins.
+  struct peer_entry *result = NULL;
+  int slot = -1;
+  if (name_len < MAX_FILENAME_LEN)
+    {
+      uint32_t hash = hash_name(name, name_len);
+      slot = lookup_name(name, name_len, hash);
+      result = find_holder(name, name_len, hash, slot, &no_filter, NULL);
+    }
+  note_search(result, slot);
+    
+    // Build response (10 bytes)
+    if (result)
+      {
+        uint32_t peer_id_net = htonl(result->id);
+        uint32_t ip_net = result->addr.sin_addr.s_addr;  // Already in network order
+        uint16_t port_net = result->addr.sin_port;        // Already in network order
+        
+        memcpy(response, &peer_id_net, 4);
+        memcpy(response + 4, &ip_net, 4);
+        memcpy(response + 8, &port_net, 2);
+        
+        // Convert to host order for printing
+        uint32_t ip_host = ntohl(ip_net);
+        uint16_t port_host = ntohs(port_net);
+        
+        // Format IP as dotted decimal
+        char ip_str[INET_ADDRSTRLEN];
+        struct in_addr addr;
+        addr.s_addr = htonl(ip_host);
+        inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
+        
+        test_log("TEST] SEARCH %s %u %s:%u\n", filename, result->id, ip_str, port_host);
+      }
+    else
+      {
+        memset(response, 0, 10);
+        test_log("TEST] SEARCH %s 0 0.0.0.0:0\n", filename);
+      }
+}
+
+// Handle SEARCH message, over TCP from a peer or from another shard
+void handle_search(int sockfd, const uint8_t *msg, int len) {
+  if (len < 2) return;
+  
+  const char *filename = (const char*)msg + 1;
+  size_t name_len = len - 2;  // message ends with the name's NUL
+
+  // In a cluster, names owned by another shard are looked up there
+  if (msg[0] == P2P_MSG_SEARCH && shard_count > 0)
+    {
+      int k = owner_of(msg + 1, name_len);
+      if (k != self_shard && forward_search(sockfd, k, msg, len) == 0) return;
+    }
+
+  uint8_t response[10];
+  lookup_search(filename, name_len, response);
+
+  // Queue response; it goes out with the rest of this pass's replies
+  if (queue_output(sockfd, response, 10) < 0)
+    {
+      fprintf(stderr, "Dropping search response\n");
+    }
+}
+
+// Handle SEARCH FILTER: the location, the attributes the holder
+// published and the name it has the file under, which only differs for
+// a search by digest. Those cover our own peers' files and the names
+// this shard owns.
+void handle_search_filter(int sockfd, const uint8_t *msg, int len)
+{
+  const uint8_t *name = msg + 1 + P2P_FILTER_LEN;
+  size_t name_len = len - 2 - P2P_FILTER_LEN;
+  struct p2p_search_filter filter;
+  p2p_decode_filter(msg + 1, &filter);
+
+  if (msg[0] == P2P_MSG_SEARCH_FILTER && shard_count > 0 && name_len > 0)
+    {
+      int k = owner_of(name, name_len);
+      if (k != self_shard && forward_search(sockfd, k, msg, len) == 0) return;
+    }
+
+  struct holder found = {0};
+  int slot = -1;
+  if (name_len > 0 && name_len < MAX_FILENAME_LEN)
+    {
+      uint32_t hash = hash_name(name, name_len);
+      slot = lookup_name(name, name_len, hash);
+      find_holder(name, name_len, hash, slot, &filter, &found);
+    }
+  else if (name_len == 0 && (filter.flags & P2P_FILTER_DIGEST))
+    {
+      find_holder(name, 0, 0, -1, &filter, &found);
+    }
+  note_search(found.peer, slot);
+
+  uint8_t response[P2P_FILTER_REPLY_LEN + MAX_FILENAME_LEN];
+  size_t response_len = P2P_FILTER_REPLY_LEN + 1;
+  memset(response, 0, response_len);
+  if (found.peer)
+    {
+      uint32_t id_net = htonl(found.peer->id);
+      size_t found_len = strlen(found.name);
+      memcpy(response, &id_net, 4);
+      memcpy(response + 4, &found.peer->addr.sin_addr.s_addr, 4);
+      memcpy(response + 8, &found.peer->addr.sin_port, 2);
+      p2p_encode_attrs(response + P2P_SEARCH_REPLY_LEN, &found.attrs);
+      memcpy(response + P2P_FILTER_REPLY_LEN, found.name, found_len + 1);
+      response_len += found_len;
+
+      char ip_str[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &found.peer->addr.sin_addr, ip_str, sizeof(ip_str));
+      test_log("TEST] SEARCH FILTER %s %u %s:%u %s %" PRIu64 " %" PRId64 "\n",
+	       (const char*)name, found.peer->id, ip_str, ntohs(found.peer->addr.sin_port),
+	       found.name, found.attrs.size, found.attrs.mtime);
+    }
+  else
+    {
+      test_log("TEST] SEARCH FILTER %s 0 0.0.0.0:0\n", (const char*)name);
+    }
+
+  if (queue_output(sockfd, response, response_len) < 0)
+    {
+      fprintf(stderr, "Dropping search response\n");
+    }
+}
+
+// ---- Swarms ----
+
+int in_swarm(const struct swarm_member *m, const uint8_t *name, size_t len, uint32_t hash,
+	     time_t now)
+{
+  return m->len == len && now - m->seen <= SWARM_TTL_SECS && m->hash == hash &&
+    names_equal((const uint8_t*)m->name, name, len);
+}
+
+// Add the peer asking on sockfd to a swarm, as reachable at its address
+// and port_net, or refresh its membership
+void join_swarm(int sockfd, const uint8_t *name, size_t len, uint32_t hash, uint32_t id,
+		uint16_t port_net, const struct p2p_file_attrs *attrs, time_t now)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(sockfd, (struct sockaddr*)&addr, &addr_len) < 0) return;
+  addr.sin_port = port_net;
+
+  struct swarm_member *m = NULL;
+  for (int i = 0; i < MAX_SWARM_MEMBERS && !m; i++)
+    {
+      if (swarm[i].socket_fd == sockfd && in_swarm(&swarm[i], name, len, hash, now))
+	{
+	  m = &swarm[i];
+	}
+    }
+  // Else a free slot, or one whose member stopped asking
+  for (int i = 0; i < MAX_SWARM_MEMBERS && !m; i++)
+    {
+      if (swarm[i].len == 0 || now - swarm[i].seen > SWARM_TTL_SECS) m = &swarm[i];
+    }
+  if (!m)
+    {
+      fprintf(stderr, "Swarm table full\n");
+      return;
+    }
+
+  m->socket_fd = sockfd;
+  m->seen = now;
+  m->hash = hash;
+  m->len = (uint16_t)len;
+  memcpy(m->name, name, len + 1);
+  m->id = id;
+  m->addr = addr;
+  m->attrs = *attrs;
+}
+
+// Forget the memberships made over a connection
+void leave_swarms(int sockfd)
+{
+  for (int i = 0; i < MAX_SWARM_MEMBERS; i++)
+    {
+      if (swarm[i].socket_fd == sockfd) swarm[i].len = 0;
+    }
+}
+
+// Handle SWARM: the file's attributes and the peers to fetch its chunks
+// from, its holders first and then other members of its swarm. With a
+// port the asker joins the swarm too.
+void handle_swarm(int sockfd, const uint8_t *msg, int len)
+{
+  const uint8_t *name = msg + P2P_SWARM_REQUEST_LEN;
+  size_t name_len = len - P2P_SWARM_REQUEST_LEN - 1;
+  uint8_t reply[P2P_SWARM_REPLY_LEN] = {0};
+  uint8_t *out = reply + 1 + P2P_ATTRS_LEN;
+  int count = 0;
+  time_t now = time(NULL);
+
+  uint32_t id_net;
+  uint16_t port_net;
+  struct p2p_file_attrs attrs;
+  memcpy(&id_net, msg + 1, 4);
+  memcpy(&port_net, msg + 5, 2);
+  p2p_decode_attrs(msg + 7, &attrs);
+
+  struct sockaddr_in asker;
+  socklen_t addr_len = sizeof(asker);
+  if (name_len > 0 && name_len < MAX_FILENAME_LEN &&
+      getpeername(sockfd, (struct sockaddr*)&asker, &addr_len) == 0)
+    {
+      uint32_t hash = hash_name(name, name_len);
+      int slot = lookup_name(name, name_len, hash);
+      struct peer_entry *holders[P2P_SWARM_MAX_PEERS];
+      struct holder best = { .all = holders, .all_cap = P2P_SWARM_MAX_PEERS };
+      scan_holders(name, name_len, hash, slot, &no_filter, 0, &best);
+      struct p2p_file_attrs known = best.attrs;
+      for (int i = 0; i < best.all_len; i++)
+	{
+	  out += put_peer_ident(out, holders[i]);
+	  count++;
+	}
+
+      // Start from a different member each time so that in a swarm
+      // bigger than a reply every member gets listed to someone
+      unsigned start = swarm_turn++;
+      for (int n = 0; n < MAX_SWARM_MEMBERS && count < P2P_SWARM_MAX_PEERS; n++)
+	{
+	  const struct swarm_member *m = &swarm[(start + n) % MAX_SWARM_MEMBERS];
+	  if (!in_swarm(m, name, name_len, hash, now) ||
+	      (m->addr.sin_addr.s_addr == asker.sin_addr.s_addr && m->addr.sin_port == port_net))
+	    {
+	      continue;
+	    }
+	  int listed = 0;
+	  for (int i = 0; i < best.all_len; i++)
+	    {
+	      if (holders[i]->addr.sin_addr.s_addr == m->addr.sin_addr.s_addr &&
+		  holders[i]->addr.sin_port == m->addr.sin_port) listed = 1;
+	    }
+	  if (listed) continue;
+	  if (!best.peer && known.size == 0) known = m->attrs;
+	  uint32_t member_id = htonl(m->id);
+	  memcpy(out, &member_id, 4);
+	  memcpy(out + 4, &m->addr.sin_addr.s_addr, 4);
+	  memcpy(out + 8, &m->addr.sin_port, 2);
+	  out += P2P_SEARCH_REPLY_LEN;
+	  count++;
+	}
+
+      if (port_net != 0)
+	{
+	  join_swarm(sockfd, name, name_len, hash, ntohl(id_net), port_net, &attrs, now);
+	}
+      reply[0] = (uint8_t)count;
+      p2p_encode_attrs(reply + 1, &known);
+    }
+
+  test_log("TEST] SWARM %s %d\n", (const char*)name, count);
+  if (queue_output(sockfd, reply, sizeof(reply)) < 0)
+    {
+      fprintf(stderr, "Dropping swarm response\n");
+    }
+}
+
+// Drain the UDP SEARCH socket a batch at a time, answering each batch
+// with one sendmmsg. Malformed datagrams get no reply; replies that
+// don't fit in the socket buffer are dropped and the client retries.
+void handle_udp_searches(void)
+{
+  static uint8_t reqs[UDP_BATCH][UDP_REQUEST_MAX];
+  static uint8_t replies[UDP_BATCH][P2P_UDP_SEARCH_REPLY_LEN];
+  static struct sockaddr_in from[UDP_BATCH];
+  static struct iovec req_iov[UDP_BATCH], reply_iov[UDP_BATCH];
+  static struct mmsghdr in[UDP_BATCH], out[UDP_BATCH];
+
+  for (int round = 0; round < UDP_ROUNDS; round++)
+    {
+      for (int i = 0; i < UDP_BATCH; i++)
+	{
+	  req_iov[i].iov_base = reqs[i];
+	  req_iov[i].iov_len = UDP_REQUEST_MAX;
+	  memset(&in[i], 0, sizeof(in[i]));
+	  in[i].msg_hdr.msg_name = &from[i];
+	  in[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	  in[i].msg_hdr.msg_iov = &req_iov[i];
+	  in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+      int n = recvmmsg(udp_fd, in, UDP_BATCH, MSG_DONTWAIT, NULL);
+      if (n < 0)
+	{
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    {
+	      perror("recvmmsg");
+	    }
+	  return;
+	}
+
+      int m = 0;
+      for (int i = 0; i < n; i++)
+	{
+	  const uint8_t *req = reqs[i];
+	  size_t len = in[i].msg_len;
+	  // One NUL-terminated name after the action code and request id
+	  if (len < 7 || req[0] != P2P_MSG_SEARCH || (in[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+	      find_nul(req + 5, len - 5) != req + len - 1)
+	    {
+	      continue;
+	    }
+	  size_t name_len = len - 6;
+
+	  uint8_t *reply = replies[m];
+	  reply[0] = P2P_MSG_SEARCH;
+	  memcpy(reply + 1, req + 1, 4);
+	  if (shard_count > 0 && owner_of(req + 5, name_len) != self_shard)
+	    {
+	      reply[5] = P2P_UDP_NOT_OWNER;
+	      memset(reply + 6, 0, 10);
+	    }
+	  else
+	    {
+	      reply[5] = P2P_UDP_OK;
+	      lookup_search((const char*)req + 5, name_len, reply + 6);
+	    }
+
+	  reply_iov[m].iov_base = reply;
+	  reply_iov[m].iov_len = P2P_UDP_SEARCH_REPLY_LEN;
+	  memset(&out[m], 0, sizeof(out[m]));
+	  out[m].msg_hdr.msg_name = &from[i];
+	  out[m].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+	  out[m].msg_hdr.msg_iov = &reply_iov[m];
+	  out[m].msg_hdr.msg_iovlen = 1;
+	  m++;
+	}
+
+      int sent = 0;
+      while (sent < m)
+	{
+	  int k = sendmmsg(udp_fd, out + sent, m - sent, MSG_DONTWAIT);
+	  if (k < 0)
+	    {
+	      if (errno == EINTR) continue;
+	      if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+		  perror("sendmmsg");
+		}
+	      break;
+	    }
+	  sent += k;
+	}
+
+      if (n < UDP_BATCH) return;  // drained
+    }
+}
+
+// Length of the complete message at the start of buf, 0 if more bytes
+// are needed, or -1 if the message can never be parsed
+int message_length(const uint8_t *buf, int len)
+{
+  if (len < 1) return 0;
+
+  switch (buf[0])
+    {
+    case P2P_MSG_JOIN:  // action + peer id
+      return len >= 5 ? 5 : 0;
+    case P2P_MSG_PUBLISH:  // action + count + count names
+    case P2P_MSG_PUBLISH_ATTRS:  // the same with attributes before each name
+    case P2P_MSG_SHARD_PUBLISH:  // action + peer id/ip/port + count + count of those
+      {
+	int pos = buf[0] == P2P_MSG_SHARD_PUBLISH ? 15 : 5;
+	int attrs_len = buf[0] == P2P_MSG_PUBLISH ? 0 : P2P_ATTRS_LEN;
+	if (len < pos) return 0;
+	uint32_t count_net;
+	memcpy(&count_net, buf + pos - 4, 4);
+	uint32_t count = ntohl(count_net);
+	for (uint32_t i = 0; i < count; i++)
+	  {
+	    if (len - pos < attrs_len) return 0;
+	    pos += attrs_len;
+	    const uint8_t *end = find_nul(buf + pos, len - pos);
+	    if (!end) return 0;
+	    pos = (int)(end - buf) + 1;
+	  }
+	return pos;
+      }
+    case P2P_MSG_CLUSTER_MAP:  // action only
+      return 1;
+    case P2P_MSG_SHARD_LEAVE:  // action + peer id/ip/port
+      return len >= 11 ? 11 : 0;
+    case P2P_MSG_SEARCH:  // action + name
+    case P2P_MSG_SHARD_SEARCH:
+      {
+	const uint8_t *end = find_nul(buf + 1, len - 1);
+	return end ? (int)(end - buf) + 1 : 0;
+      }
+    case P2P_MSG_SEARCH_FILTER:  // action + filter + name
+    case P2P_MSG_SHARD_SEARCH_FILTER:
+    case P2P_MSG_SWARM:  // action + id + port + attributes + name
+      {
+	int pos = buf[0] == P2P_MSG_SWARM ? P2P_SWARM_REQUEST_LEN : 1 + P2P_FILTER_LEN;
+	if (len <= pos) return 0;
+	const uint8_t *end = find_nul(buf + pos, len - pos);
+	return end ? (int)(end - buf) + 1 : 0;
+      }
+    default:
+      return -1;
+    }
+}
+
+// Dispatch every complete message in the connection's buffer
+void process_messages(int fd, struct conn *c)
+{
+  int pos = 0;
+  while (pos < c->len && !c->waiting && c->out_bytes < OUT_HIGH_WATER)
+    {
+      const uint8_t *msg = c->buf + pos;
+      int n = message_length(msg, c->len - pos);
+      if (n == 0) break;
+      if (n < 0)
+	{
+	  fprintf(stderr, "Unknown message type %u\n", msg[0]);
+	  pos = c->len;  // can't resynchronize, drop what we have
+	  break;
+	}
+
+      switch (msg[0])
+	{
+	case P2P_MSG_JOIN:
+	  handle_join(fd, msg, n);
+	  break;
+	case P2P_MSG_PUBLISH:
+	case P2P_MSG_PUBLISH_ATTRS:
+	  handle_publish(fd, msg, n);
+	  break;
+	case P2P_MSG_SEARCH:
+	case P2P_MSG_SHARD_SEARCH:
+	  trace_id = p2p_trace_begin(P2P_TRACE_REG_SEARCH);
+	  handle_search(fd, msg, n);
+	  break;
+	case P2P_MSG_SEARCH_FILTER:
+	case P2P_MSG_SHARD_SEARCH_FILTER:
+	  trace_id = p2p_trace_begin(P2P_TRACE_REG_SEARCH);
+	  handle_search_filter(fd, msg, n);
+	  break;
+	case P2P_MSG_CLUSTER_MAP:
+	  handle_cluster_map(fd);
+	  break;
+	case P2P_MSG_SWARM:
+	  handle_swarm(fd, msg, n);
+	  break;
+	case P2P_MSG_SHARD_PUBLISH:
+	  handle_shard_publish(fd, msg, n);
+	  break;
+	case P2P_MSG_SHARD_LEAVE:
+	  handle_shard_leave(fd, msg, n);
+	  break;
+	}
+      // Answered here unless forward_search took it; the reply is queued
+      P2P_TRACE(trace_id, P2P_TRACE_DONE, P2P_OK);
+      trace_id = 0;
+      pos += n;
+    }
+
+  // Keep any partial message for the next recv
+  if (pos > 0)
+    {
+      memmove(c->buf, c->buf + pos, c->len - pos);
+      c->len -= pos;
+    }
+  // A full buffer behind a proxied SEARCH or a backed-up output queue
+  // just stops reads (see update_events); otherwise it can't be parsed
+  if (c->len == BUFFER_SIZE && !c->waiting && c->out_bytes < OUT_HIGH_WATER)
+    {
+      fprintf(stderr, "Message too large, dropping\n");
+      c->len = 0;
+    }
+}
+
+// Close a connection and forget everything attached to it
+void drop_connection(int fd)
+{
+  struct conn *c = conns[fd];
+
+  p2p_close(fd);  // also removes it from the epoll set
+  remove_peer(fd);
+  leave_swarms(fd);
+  conns[fd] = NULL;
+
+  if (c && c->shard >= 0)
+    {
+      // Clients waiting on this link get "not found"
+      struct shard *sh = &shards[c->shard];
+      uint8_t none[P2P_FILTER_REPLY_LEN + 1] = {0};
+      sh->link_fd = -1;
+      test_log("TEST] SHARD %d DOWN\n", c->shard);
+      while (sh->pending_count > 0)
+	{
+	  deliver_reply(sh, none, pending_reply_len(sh));
+	}
+    }
+  if (c)
+    {
+      discard_output(c);
+    }
+  free(c);
+}
+
+// Read what a connection sent and act on it. A TLS record can hold more
+// than the buffer has room for, and epoll won't report the decrypted
+// rest, so reading goes on while it lasts and the connection takes input.
+void read_connection(int fd, struct conn *c)
+{
+  unsigned gen = c->gen;
+  do
+    {
+      int n = p2p_recv(fd, c->buf + c->len, BUFFER_SIZE - c->len, 0);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+	  return;
+	}
+      if (n <= 0)
+	{
+	  // Connection closed or error
+	  drop_connection(fd);
+	  return;
+	}
+      c->len += n;
+      if (c->shard >= 0)
+	{
+	  handle_link_data(fd, c);
+	}
+      else
+	{
+	  process_messages(fd, c);
+	  update_events(fd, c);
+	}
+    }
+  while (conns[fd] && conns[fd]->gen == gen && c->len < BUFFER_SIZE &&
+	 c->out_bytes < OUT_HIGH_WATER && p2p_tls_pending(fd) > 0);
+}
+
+// Advance a TLS handshake; the connection is served once it is done
+void continue_handshake(int fd, struct conn *c)
+{
+  int rc = p2p_tls_handshake(fd);
+  if (rc < 0)
+    {
+      drop_connection(fd);
+      return;
+    }
+  c->handshake = rc;
+  if (rc == P2P_OK && c->out_bytes > 0)
+    {
+      mark_dirty(fd, c);
+    }
+  update_events(fd, c);
+}
+
+// Write out everything queued during this pass of the event loop. Input
+// held back by a full queue is processed once there is room again, which
+// may queue more output for a later entry of the list.
+void flush_all(void)
+{
+  for (int i = 0; i < dirty_count; i++)
+    {
+      int fd = dirty_fds[i];
+      struct conn *c = conns[fd];
+      if (!c || !c->dirty) continue;  // dropped since it was queued
+      c->dirty = 0;
+      if (c->handshake) continue;     // flushed when it completes
+
+      if (flush_output(fd, c) < 0)
+	{
+	  perror("send");
+	  drop_connection(fd);
+	  continue;
+	}
+      if (c->shard < 0 && c->len > 0 && !c->waiting)
+	{
+	  process_messages(fd, c);
+	}
+      if (p2p_tls_pending(fd) > 0)
+	{
+	  read_connection(fd, c);
+	  if (!conns[fd]) continue;
+	}
+      update_events(fd, c);
+    }
+  dirty_count = 0;
+}
+
+// Take a token from the source's bucket; returns 0 if it has none left.
+// A source not in the table starts with a full bucket, so when the probe
+// window is full the least recently refilled source is forgotten.
+int admit(uint32_t ip, double now)
+{
+  if (admit_rate <= 0) return 1;
 
-struct peer_entry peers[MAX_PEERS];
-int peer_count = 0;
+  uint32_t h = ip * 2654435761u;
+  struct admit_slot *slot = NULL, *victim = NULL;
+  for (int i = 0; i < ADMIT_PROBE; i++)
+    {
+      struct admit_slot *s = &admit_table[(h + i) & (ADMIT_TABLE_SIZE - 1)];
+      if (s->ip == ip)
+	{
+	  slot = s;
+	  break;
+	}
+      // Prefer an empty slot, then the stalest
+      if (!victim || (victim->ip != 0 && (s->ip == 0 || s->last < victim->last)))
+	{
+	  victim = s;
+	}
+    }
 
-// Find peer by socket
-struct peer_entry* find_peer_by_socket(int sockfd)
-{
-    for (int i = 0; i < peer_count; i++)
-      {
-        if (peers[i].socket_fd == sockfd)
-	  {
-            return &peers[i];
-	  }
-      }
-    return NULL;
+  double burst = 2 * admit_rate;
+  if (burst < max_local_peers) burst = max_local_peers;
+  if (!slot)
+    {
+      slot = victim;
+      slot->ip = ip;
+      slot->tokens = burst;
+    }
+  else
+    {
+      slot->tokens += (now - slot->last) * admit_rate;
+      if (slot->tokens > burst) slot->tokens = burst;
+    }
+  slot->last = now;
+
+  if (slot->tokens < 1) return 0;
+  slot->tokens -= 1;
+  return 1;
 }
 
-// Remove peer by socket
-void remove_peer(int sockfd)
+// Drain up to ACCEPT_BATCH pending connections, refusing sources that
+// are over their admission rate
+void accept_connections(void)
 {
-  for (int i = 0; i < peer_count; i++)
+  double now = p2p_monotonic_secs();
+  int refused = 0;
+
+  for (int i = 0; i < ACCEPT_BATCH; i++)
     {
-      if (peers[i].socket_fd == sockfd)
+      struct sockaddr_in cli_addr;
+      socklen_t cli_len = sizeof(cli_addr);
+      int new_fd = accept4(listen_fd, (struct sockaddr*)&cli_addr, &cli_len,
+			   SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (new_fd < 0)
 	{
-	  // Shift remaining peers down
-	  for (int j = i; j < peer_count - 1; j++)
+	  if (errno == EINTR || errno == ECONNABORTED) continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
 	    {
-	      peers[j] = peers[j + 1];
+	      perror("accept4");
 	    }
-	  peer_count--;
-	  return;
+	  break;
 	}
+
+      struct conn *c;
+      if (!admit(cli_addr.sin_addr.s_addr, now))
+	{
+	  refused++;
+	  close(new_fd);
+	}
+      else if (!(c = add_connection(new_fd)))
+	{
+	  close(new_fd);
+	}
+      else
+	{
+	  // Requests and replies are small; none waits on Nagle
+	  p2p_net_tune(new_fd, P2P_NET_CONTROL);
+	  // Over TLS nothing is read until the client's hello has been answered
+	  if (p2p_tls_enabled() && p2p_tls_start(new_fd, 1, NULL) != P2P_OK)
+	    {
+	      drop_connection(new_fd);
+	    }
+	  else if (p2p_tls_enabled())
+	    {
+	      c->handshake = P2P_TLS_WANT_READ;
+	    }
+	}
+    }
+
+  if (refused > 0)
+    {
+      fprintf(stderr, "Refused %d connection(s) over the admission rate\n", refused);
     }
 }
 
-// Handle JOIN message
-void handle_join(int sockfd, uint8_t *msg, int len)
+// Parse "host:port" into an IPv4 address
+int resolve_shard(const char *spec, struct sockaddr_in *out)
 {
-  if (len < 5) return;
-  
-  uint32_t peer_id_net;
-  memcpy(&peer_id_net, msg + 1, 4);
-  uint32_t peer_id = ntohl(peer_id_net);
-  
-  // Get peer's address using getpeername
-  struct sockaddr_in peer_addr;
-  socklen_t addr_len = sizeof(peer_addr);
-  if (getpeername(sockfd, (struct sockaddr*)&peer_addr, &addr_len) < 0)
+  char host[256];
+  const char *colon = strrchr(spec, ':');
+  if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) return -1;
+  memcpy(host, spec, colon - spec);
+  host[colon - spec] = '\0';
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(host, colon + 1, &hints, &res);
+  if (rc != 0)
     {
-      perror("getpeername");
-      return;
+      fprintf(stderr, "%s: %s\n", spec, gai_strerror(rc));
+      return -1;
     }
-  
-  // Find or create peer entry
-  struct peer_entry *peer = find_peer_by_socket(sockfd);
-  if (!peer)
+  memcpy(out, res->ai_addr, sizeof(*out));
+  freeaddrinfo(res);
+  return 0;
+}
+
+// ---- Embedding (p2p_registry.h) ----
+
+void p2p_registry_default_options(struct p2p_registry_options *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->backlog = DEFAULT_BACKLOG;
+  opts->admit_rate = DEFAULT_ADMIT_RATE;
+  opts->max_peers = MAX_PEERS;
+  opts->cpu = -1;
+}
+
+// Forget the peers, names and links of a previous run
+void reset_state(void)
+{
+  memset(peers, 0, sizeof(peers));
+  peer_count = 0;
+  memset(name_table, 0, sizeof(name_table));
+  names_used = 0;
+  arena_used = 0;
+  memset(swarm, 0, sizeof(swarm));
+  memset(shards, 0, sizeof(shards));
+  shard_count = 0;
+  self_shard = 0;
+  ring_len = 0;
+  memset(admit_table, 0, sizeof(admit_table));
+  window_start = 0;
+  dirty_count = 0;
+}
+
+// Drop the snapshot and delta once any merge in flight has landed
+void catalog_reset(void)
+{
+  while (merging)
     {
-      if (peer_count >= MAX_PEERS)
-	{
-	  fprintf(stderr, "Max peers reached\n");
-	  return;
-	}
-    peer = &peers[peer_count++];
-    peer->socket_fd = sockfd;
-    peer->num_files = 0;
+      struct pollfd pfd = { .fd = merge_event_fd, .events = POLLIN };
+      if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+      finish_merge();
     }
-  
-  peer->id = peer_id;
-  peer->addr = peer_addr;
-  peer->joined = 1;
-  
-  printf("TEST] JOIN %u\n", peer_id);
+  free(catalog);
+  catalog = NULL;
+  memset(entry_gen, 0, sizeof(entry_gen));
+  memset(in_delta, 0, sizeof(in_delta));
+  delta_count = 0;
+  catalog_gen = 0;
 }
 
-// Handle PUBLISH message
-void handle_publish(int sockfd, uint8_t *msg, int len)
+// Close every connection and socket of this run
+void close_all(void)
 {
-  if (len < 5) return;
-  
-  struct peer_entry *peer = find_peer_by_socket(sockfd);
-  if (!peer || !peer->joined) return;
-  
-  uint32_t count_net;
-  memcpy(&count_net, msg + 1, 4);
-  uint32_t count = ntohl(count_net);
-  
-  if (count > MAX_FILES) count = MAX_FILES;
-  
-  // Parse null-terminated filenames
-  int pos = 5;
-  int file_idx = 0;
-  while (pos < len && file_idx < (int)count)
+  for (int fd = 0; fd < MAX_CONNS; fd++)
+    {
+      struct conn *c = conns[fd];
+      if (!c) continue;
+      discard_output(c);
+      free(c);
+      conns[fd] = NULL;
+      p2p_close(fd);
+    }
+
+  // Taken first, so a late p2p_registry_stop() can't write to it closed
+  int fd = __atomic_exchange_n(&stop_fd, -1, __ATOMIC_ACQ_REL);
+  if (fd >= 0)
+    {
+      close(fd);
+    }
+  int *fds[] = { &listen_fd, &udp_fd, &hint_fd, &epoll_fd };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
     {
-      int name_len = 0;
-      while (pos + name_len < len && msg[pos + name_len] != 0)
+      if (*fds[i] >= 0)
 	{
-	name_len++;
+	  close(*fds[i]);
+	  *fds[i] = -1;
 	}
-      
-      if (pos + name_len < len && name_len > 0 && name_len < MAX_FILENAME_LEN)
-	{
-	memcpy(peer->files[file_idx], msg + pos, name_len + 1);
-	file_idx++;
-        }
-        
-      pos += name_len + 1;
     }
-  
-  peer->num_files = file_idx;
-  
-  // Print output
-  printf("TEST] PUBLISH %d", file_idx);
-  for (int i = 0; i < file_idx; i++)
+  catalog_reset();
+  catalog_stop();
+  shard_count = 0;
+  self_shard = 0;
+
+  // The chunk pool outlives connections, not the registry
+  while (free_chunks)
     {
-      printf(" %s", peer->files[i]);
+      struct out_chunk *t = free_chunks;
+      free_chunks = t->next;
+      free(t);
     }
-  printf("\n");
 }
 
-// Handle SEARCH message
-void handle_search(int sockfd, uint8_t *msg, int len) {
-  if (len < 2) return;
-  
-  // Extract filename (null-terminated)
-  char filename[MAX_FILENAME_LEN];
-  int name_len = 0;
-  while (name_len < len - 1 && name_len < MAX_FILENAME_LEN - 1 && msg[1 + name_len] != 0)
+// Register fd for input on the event loop
+int watch_fd(int fd)
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
     {
-      filename[name_len] = msg[1 + name_len];
-      name_len++;
+      perror("epoll_ctl");
+      return -1;
     }
-  filename[name_len] = '\0';
-  
-  // Search for file
-  struct peer_entry *result = NULL;
-  for (int i = 0; i < peer_count; i++)
+  return 0;
+}
+
+int p2p_registry_open(const struct p2p_registry_options *opts)
+{
+  if (epoll_fd >= 0)
     {
-      if (!peers[i].joined) continue;
-      for (int j = 0; j < peers[i].num_files; j++)
-	{
-	if (strcmp(peers[i].files[j], filename) == 0)
-	  {
-	    result = &peers[i];
-	    break;
-	  }
-	}
-      if (result) break;
+      fprintf(stderr, "Registry already open\n");
+      return -1;
+    }
+  if (opts->backlog <= 0 || opts->max_peers <= 0 || opts->max_peers > PEER_CAPACITY ||
+      opts->shard_count < 0 || opts->shard_count > MAX_SHARDS)
+    {
+      fprintf(stderr, "Bad registry options\n");
+      return -1;
     }
-    
-    // Build response (10 bytes)
-    uint8_t response[10];
-    if (result)
-      {
-        uint32_t peer_id_net = htonl(result->id);
-        uint32_t ip_net = result->addr.sin_addr.s_addr;  // Already in network order
-        uint16_t port_net = result->addr.sin_port;        // Already in network order
-        
-        memcpy(response, &peer_id_net, 4);
-        memcpy(response + 4, &ip_net, 4);
-        memcpy(response + 8, &port_net, 2);
-        
-        // Convert to host order for printing
-        uint32_t ip_host = ntohl(ip_net);
-        uint16_t port_host = ntohs(port_net);
-        
-        // Format IP as dotted decimal
-        char ip_str[INET_ADDRSTRLEN];
-        struct in_addr addr;
-        addr.s_addr = htonl(ip_host);
-        inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
-        
-        printf("TEST] SEARCH %s %u %s:%u\n", filename, result->id, ip_str, port_host);
-      }
-    else
-      {
-        memset(response, 0, 10);
-        printf("TEST] SEARCH %s 0 0.0.0.0:0\n", filename);
-      }
-    
-    // Send response
-    if (send(sockfd, response, 10, 0) != 10)
-      {
-        perror("send search response");
-      }
-}
 
-int main(int argc, char *argv[]) {
-  if (argc != 2)
+  init_simd();
+  catalog_init();
+  reset_state();
+  max_local_peers = opts->max_peers;
+  admit_rate = opts->admit_rate;
+  test_output = !opts->quiet;
+  loop_cpu = opts->cpu;
+
+  // Cluster members, listed in the same order for every registry
+  if (opts->shard_count > 0)
     {
-      fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-      exit(1);
+      shard_count = opts->shard_count;
+      self_shard = opts->self_shard;
+      if (self_shard < 0 || self_shard >= shard_count)
+	{
+	  fprintf(stderr, "Self index out of range\n");
+	  close_all();
+	  return -1;
+	}
+      for (int k = 0; k < shard_count; k++)
+	{
+	  if (resolve_shard(opts->shards[k], &shards[k].addr) < 0)
+	    {
+	      fprintf(stderr, "Bad shard address %s\n", opts->shards[k]);
+	      close_all();
+	      return -1;
+	    }
+	  shards[k].link_fd = -1;
+	}
+      build_ring();
     }
     
-  int listen_fd;
   struct sockaddr_in serv_addr;
+  socklen_t addr_len = sizeof(serv_addr);
   
   // Create listening socket
-  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (listen_fd < 0)
     {
       perror("socket");
-      exit(1);
+      close_all();
+      return -1;
     }
   
+  // Unbound UDP socket for sending replication hints to peers
+  hint_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (hint_fd < 0)
+    {
+      perror("socket");
+    }
+
   // Allow port reuse
-  int opt = 1;
-  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+  int on = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
     {
       perror("setsockopt");
     }
   
-  // Bind
+  // Bind; port 0 lets the kernel choose, and UDP follows TCP's choice
   memset(&serv_addr, 0, sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
   serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port = htons(atoi(argv[1]));
+  serv_addr.sin_port = htons(opts->port);
   
-  if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+  if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0 ||
+      getsockname(listen_fd, (struct sockaddr*)&serv_addr, &addr_len) < 0)
     {
       perror("bind");
-      exit(1);
+      close_all();
+      return -1;
+    }
+
+  // UDP SEARCH endpoint on the same port number; TCP works without it
+  udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (udp_fd >= 0 && bind(udp_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+      perror("bind udp");
+      close(udp_fd);
+      udp_fd = -1;
     }
   
-    // Listen
-  if (listen(listen_fd, 5) < 0)
+  // Listen
+  if (listen(listen_fd, opts->backlog) < 0)
     {
       perror("listen");
-      exit(1);
+      close_all();
+      return -1;
     }
   
-    // Setup select
-  fd_set master_set, read_set;
-  FD_ZERO(&master_set);
-  FD_SET(listen_fd, &master_set);
-  int max_fd = listen_fd;
-  
+  // Setup epoll, plus the eventfd p2p_registry_stop() signals
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  __atomic_store_n(&stop_fd, fd, __ATOMIC_RELEASE);
+  if (epoll_fd < 0 || fd < 0)
+    {
+      perror("epoll_create1");
+      close_all();
+      return -1;
+    }
+  if (watch_fd(listen_fd) < 0 || watch_fd(fd) < 0)
+    {
+      close_all();
+      return -1;
+    }
+  if (udp_fd >= 0)
+    {
+      watch_fd(udp_fd);
+    }
+  if (merge_event_fd >= 0)
+    {
+      watch_fd(merge_event_fd);
+    }
+  return ntohs(serv_addr.sin_port);
+}
+
+void p2p_registry_stop(void)
+{
+  uint64_t one = 1;
+  int fd = __atomic_load_n(&stop_fd, __ATOMIC_ACQUIRE);
+  if (fd >= 0 && write(fd, &one, sizeof(one)) < 0)
+    {
+      perror("write stop");
+    }
+}
+
+int p2p_registry_run(void)
+{
+  int running = 1;
+  int rc = 0;
+
+  if (epoll_fd < 0)
+    {
+      fprintf(stderr, "Registry not open\n");
+      return -1;
+    }
+  // Connection state is allocated from here on, so it lands on this
+  // CPU's NUMA node
+  if (loop_cpu >= 0 && p2p_pin_cpu(loop_cpu) < 0)
+    {
+      perror("pin event loop");
+    }
+
   // Main loop
-    while (1)
+    while (running)
       {
-	read_set = master_set;
+	struct epoll_event events[MAX_EVENTS];
+	// Wake up periodically to retry links to other shards
+	int timeout = shard_count ? LINK_RETRY_SECS * 1000 : -1;
         
-        if (select(max_fd + 1, &read_set, NULL, NULL, NULL) < 0)
+        int nev = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (nev < 0)
+	  {
+	    if (errno == EINTR) continue;
+	    perror("epoll_wait");
+	    rc = -1;
+	    break;
+	  }
+
+        if (shard_count > 0)
 	  {
-	    perror("select");
-	    exit(1);
+	    reconnect_shards();
 	  }
         
-        // Check all file descriptors
-        for (int fd = 0; fd <= max_fd; fd++)
+        for (int i = 0; i < nev; i++)
 	  {
-	    if (!FD_ISSET(fd, &read_set)) continue;
+	    int fd = events[i].data.fd;
 	    
             if (fd == listen_fd)
 	      {
-		// Accept new connection
-		struct sockaddr_in cli_addr;
-                socklen_t cli_len = sizeof(cli_addr);
-                int new_fd = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
-                
-                if (new_fd < 0)
-		  {
-		    perror("accept");
-		    continue;
-		  }
-                
-                FD_SET(new_fd, &master_set);
-                if (new_fd > max_fd)
-		  {
-                    max_fd = new_fd;
-		  }
+		accept_connections();
+		continue;
+	      }
+	    if (fd == udp_fd)
+	      {
+		handle_udp_searches();
+		continue;
+	      }
+	    if (fd == merge_event_fd)
+	      {
+		finish_merge();
+		continue;
+	      }
+	    if (fd == __atomic_load_n(&stop_fd, __ATOMIC_RELAXED))
+	      {
+		running = 0;  // finish this pass first
+		continue;
+	      }
+
+	    struct conn *c = conns[fd];
+	    if (!c) continue;  // dropped earlier in this pass
+
+	    if (events[i].events & EPOLLERR)
+	      {
+		drop_connection(fd);
+		continue;
+	      }
+	    if (c->handshake)
+	      {
+		continue_handshake(fd, c);
+		continue;
+	      }
+	    if (events[i].events & EPOLLOUT)
+	      {
+		mark_dirty(fd, c);  // socket has room again
 	      }
-	    else
+	    if (c->len == BUFFER_SIZE)
 	      {
-		// Handle peer message
-                uint8_t buffer[BUFFER_SIZE];
-                int n = recv(fd, buffer, BUFFER_SIZE, 0);
-                
-                if (n <= 0) {
-		  // Connection closed or error
-                    close(fd);
-                    FD_CLR(fd, &master_set);
-                    remove_peer(fd);
-                }
-		else
+		// Not reading; only notice a client that hung up
+		if (events[i].events & EPOLLHUP)
 		  {
-                    // Process message based on type
-                    uint8_t msg_type = buffer[0];
-                    
-                    if (msg_type == 0)
-		      {
-			handle_join(fd, buffer, n);
-		      }
-		    else if (msg_type == 1)
-		      {
-			handle_publish(fd, buffer, n);
-		      }
-		    else if (msg_type == 2)
-		      {
-			handle_search(fd, buffer, n);
-		      }
+		    drop_connection(fd);
 		  }
+		continue;
 	      }
+	    if (!(events[i].events & (EPOLLIN | EPOLLHUP))) continue;
+
+	    // Handle peer message
+	    read_connection(fd, c);
 	  }
+
+	// One gathered write per connection for everything queued above
+	flush_all();
+
+	// Fold this pass's catalog changes into the next snapshot
+	start_merge();
       }
     
-    close(listen_fd);
-    return 0;
+    close_all();
+    return rc;
+}
+
+#ifndef REGISTRY_LIBRARY
+void stop_on_signal(int sig)
+{
+  (void)sig;
+  p2p_registry_stop();
+}
+
+int main(int argc, char *argv[]) {
+  struct p2p_registry_options opts;
+  int bad_usage = 0;
+  int opt;
+
+  p2p_registry_default_options(&opts);
+  if (p2p_tls_setup_env() != P2P_OK)
+    {
+      fprintf(stderr, "Can't set up TLS from P2P_TLS_CERT, P2P_TLS_KEY and P2P_TLS_CA\n");
+      exit(1);
+    }
+  p2p_trace_setup_env();
+  p2p_net_setup_env();
+  if (p2p_tracing)
+    {
+      // Stop cleanly on ^C so the trace is dumped at exit
+      signal(SIGINT, stop_on_signal);
+      signal(SIGTERM, stop_on_signal);
+    }
+  while ((opt = getopt(argc, argv, "+b:a:p:c:q")) != -1)
+    {
+      switch (opt)
+	{
+	case 'b':
+	  opts.backlog = atoi(optarg);
+	  break;
+	case 'a':
+	  opts.admit_rate = atof(optarg);
+	  break;
+	case 'p':
+	  opts.max_peers = atoi(optarg);
+	  break;
+	case 'c':
+	  opts.cpu = atoi(optarg);
+	  break;
+	case 'q':
+	  opts.quiet = 1;
+	  break;
+	default:
+	  bad_usage = 1;
+	  break;
+	}
+    }
+  // Positional arguments as if there were no options
+  argv += optind - 1;
+  argc -= optind - 1;
+
+  if (bad_usage || argc < 2 || argc == 3 || argc - 3 > MAX_SHARDS)
+    {
+      fprintf(stderr, "Usage: registry [-b backlog] [-a conns_per_sec] [-p max_peers] [-c cpu] [-q] "
+	      "<port> [<self index> <host:port> ...]\n");
+      exit(1);
+    }
+
+  opts.port = (uint16_t)atoi(argv[1]);
+  if (argc > 3)
+    {
+      opts.self_shard = atoi(argv[2]);
+      opts.shard_count = argc - 3;
+      opts.shards = (const char *const *)(argv + 3);
+    }
+
+  // Pinned before open, whose tables are then first touched on the
+  // event loop's node
+  if (opts.cpu >= 0 && p2p_pin_cpu(opts.cpu) < 0)
+    {
+      perror("pin");
+      exit(1);
+    }
+  if (p2p_registry_open(&opts) < 0)
+    {
+      exit(1);
+    }
+  return p2p_registry_run() < 0 ? 1 : 0;
 }
+#endif
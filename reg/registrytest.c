@@ -0,0 +1,651 @@
+// registrytest.c
+// Behaviour tests for registry internals, run by `make check`: the name
+// table across peer removal and compaction, the SIMD scanning routines
+// against their scalar versions, the cluster ring when a shard joins,
+// connection output across partial writes, SEARCH over catalog
+// snapshots and their deltas, admission control, and an open refused for
+// its shard options. registry.c is compiled in whole, without its main(),
+// so the tests see its state directly. Prints each failure
+// and exits 1 if there were any.
+
+#define REGISTRY_LIBRARY
+#include "registry.c"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+int failures = 0;
+
+#define CHECK(cond)							\
+  do									\
+    {									\
+      if (!(cond))							\
+	{								\
+	  fprintf(stderr, "%s:%d: %s: check failed: %s\n",		\
+		  __FILE__, __LINE__, __func__, #cond);			\
+	  failures++;							\
+	}								\
+    }									\
+  while (0)
+
+// Add a joined local peer holding names, as handle_publish() leaves it
+struct peer_entry* add_peer(uint32_t id, const char *const *names, int count)
+{
+  struct peer_entry *peer = &peers[peer_count++];
+  memset(peer, 0, sizeof(*peer));
+  peer->id = id;
+  peer->socket_fd = (int)id;
+  peer->joined = 1;
+  for (int i = 0; i < count; i++)
+    {
+      int slot = intern_name((const uint8_t*)names[i], strlen(names[i]));
+      CHECK(slot >= 0);
+      if (slot < 0) continue;
+      name_table[slot].refs++;
+      peer->files[peer->num_files++] = slot;
+    }
+  return peer;
+}
+
+int find_name(const char *name)
+{
+  size_t len = strlen(name);
+  return lookup_name((const uint8_t*)name, len, hash_name((const uint8_t*)name, len));
+}
+
+// Every file a peer holds still names what it published
+int peer_holds(const struct peer_entry *peer, const char *const *names, int count)
+{
+  if (peer->num_files != count) return 0;
+  for (int i = 0; i < count; i++)
+    {
+      if (strcmp(name_str(peer->files[i]), names[i]) != 0 ||
+	  find_name(names[i]) != peer->files[i])
+	{
+	  return 0;
+	}
+    }
+  return 1;
+}
+
+void test_intern_after_remove(void)
+{
+  const char *a[] = { "alpha", "shared", "a-only" };
+  const char *b[] = { "beta", "shared" };
+  const char *c[] = { "gamma", "c-only", "shared" };
+  reset_state();
+  catalog_reset();
+  add_peer(1, a, 3);
+  add_peer(2, b, 2);
+  add_peer(3, c, 3);
+  CHECK(names_used == 6);
+  CHECK(name_table[find_name("shared")].refs == 3);
+
+  // Removing the first peer moves the last into its place
+  remove_entry(0);
+  CHECK(peer_count == 2);
+  CHECK(peers[0].id == 3 && peers[1].id == 2);
+  CHECK(name_table[find_name("shared")].refs == 2);
+  CHECK(name_table[find_name("alpha")].refs == 0);
+
+  // Compaction drops what nobody holds and remaps the rest
+  size_t before = arena_used;
+  compact_names();
+  CHECK(names_used == 4);
+  CHECK(arena_used == before - strlen("alpha") - strlen("a-only") - 2);
+  CHECK(find_name("alpha") < 0 && find_name("a-only") < 0);
+  CHECK(peer_holds(&peers[0], c, 3));
+  CHECK(peer_holds(&peers[1], b, 2));
+  CHECK(name_table[find_name("shared")].refs == 2);
+
+  // A held name probed past a removed one moves to its home slot, so
+  // the holder's file list must follow it
+  char first[32], second[32];
+  uint32_t home;
+  for (int i = 0; ; i++)
+    {
+      int len = snprintf(first, sizeof(first), "evicted-%d", i);
+      home = hash_name((const uint8_t*)first, (size_t)len) & (NAME_TABLE_SIZE - 1);
+      if (!name_table[home].used && !name_table[(home + 1) & (NAME_TABLE_SIZE - 1)].used)
+	{
+	  break;
+	}
+    }
+  for (int i = 0; ; i++)
+    {
+      int len = snprintf(second, sizeof(second), "collides-%d", i);
+      if ((hash_name((const uint8_t*)second, (size_t)len) & (NAME_TABLE_SIZE - 1)) == home)
+	{
+	  break;
+	}
+    }
+  const char *e[] = { first };
+  const char *f[] = { second };
+  add_peer(5, e, 1);
+  add_peer(6, f, 1);
+  int moved_from = peers[3].files[0];
+  CHECK(moved_from != (int)home && peers[2].files[0] == (int)home);
+  remove_entry(2);
+  compact_names();
+  CHECK(peer_holds(&peers[2], f, 1));
+  CHECK(peers[2].files[0] != moved_from);
+
+  // Interning a held name finds it; a new one gets a slot of its own
+  int shared = find_name("shared");
+  CHECK(intern_name((const uint8_t*)"shared", 6) == shared);
+  int fresh = intern_name((const uint8_t*)"alpha", 5);
+  CHECK(fresh >= 0 && fresh != shared && strcmp(name_str(fresh), "alpha") == 0);
+
+  // Enough unreferenced names to fill the table several times over:
+  // intern_name() compacts as it goes and the held names survive it
+  for (int i = 0; i < 4 * NAME_TABLE_SIZE; i++)
+    {
+      char name[32];
+      int len = snprintf(name, sizeof(name), "churn-%d", i);
+      int slot = intern_name((const uint8_t*)name, (size_t)len);
+      CHECK(slot >= 0);
+      if (slot < 0) break;
+      CHECK(strcmp(name_str(slot), name) == 0);
+    }
+  CHECK(names_used <= NAME_TABLE_LIMIT);
+  CHECK(peer_holds(&peers[0], c, 3));
+  CHECK(peer_holds(&peers[1], b, 2));
+  CHECK(peer_holds(&peers[2], f, 1));
+
+  // A peer joining now interns alongside them
+  const char *d[] = { "delta", "shared" };
+  struct peer_entry *late = add_peer(4, d, 2);
+  CHECK(peer_holds(late, d, 2));
+  CHECK(name_table[find_name("shared")].refs == 3);
+  catalog_reset();
+}
+
+// CRC32C a byte at a time, as hash_name_crc32() should compute it
+uint32_t crc32c_bitwise(const uint8_t *p, size_t len)
+{
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < len; i++)
+    {
+      crc ^= p[i];
+      for (int k = 0; k < 8; k++)
+	{
+	  crc = (crc >> 1) ^ (0x82f63b78u & -(crc & 1));
+	}
+    }
+  return crc ^ (uint32_t)len;
+}
+
+// Every version of find_nul(), hash_name() and names_equal() this CPU
+// runs must give the scalar answer for names of every length up to twice
+// the widest vector, at every alignment. The bytes just past a name
+// would change the answer if read, and with no gap the name ends where
+// an unreadable page begins.
+void test_simd_matches_scalar(void)
+{
+  enum { WIDTH = 32, MAX_LEN = 2 * WIDTH };
+  const uint8_t* (*finds[3])(const uint8_t*, size_t) = { find_nul_scalar };
+  int (*equals[3])(const uint8_t*, const uint8_t*, size_t) = { names_equal_scalar };
+  int variants = 1, crc32 = 0;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    {
+      finds[variants] = find_nul_sse2;
+      equals[variants++] = names_equal_sse2;
+    }
+  if (__builtin_cpu_supports("avx2"))
+    {
+      finds[variants] = find_nul_avx2;
+      equals[variants++] = names_equal_avx2;
+    }
+  crc32 = __builtin_cpu_supports("sse4.2");
+#endif
+
+  // [a][guard][b][guard]
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  uint8_t *map = mmap(NULL, 4 * page, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(map != MAP_FAILED);
+  if (map == MAP_FAILED) return;
+  CHECK(mprotect(map + page, page, PROT_NONE) == 0);
+  CHECK(mprotect(map + 3 * page, page, PROT_NONE) == 0);
+
+  for (size_t len = 0; len <= MAX_LEN; len++)
+    {
+      for (size_t gap = 0; gap < WIDTH; gap++)
+	{
+	  uint8_t *a = map + page - gap - len;
+	  uint8_t *b = map + 3 * page - gap - len;
+	  for (size_t i = 0; i < len; i++)
+	    {
+	      a[i] = b[i] = (uint8_t)(1 + (i * 7 + len) % 255);
+	    }
+	  memset(a + len, 0, gap);
+	  memset(b + len, 0xff, gap);
+
+	  // A NUL at each position, then none
+	  for (size_t nul = 0; nul <= len; nul++)
+	    {
+	      if (nul < len) a[nul] = 0;
+	      const uint8_t *want = find_nul_scalar(a, len);
+	      CHECK(want == (nul < len ? a + nul : NULL));
+	      for (int v = 1; v < variants; v++)
+		{
+		  CHECK(finds[v](a, len) == want);
+		}
+	      if (nul < len) a[nul] = b[nul];
+	    }
+
+#ifdef HAVE_X86_SIMD
+	  if (crc32)
+	    {
+	      CHECK(hash_name_crc32(a, len) == crc32c_bitwise(a, len));
+	      CHECK(hash_name_crc32(b, len) == hash_name_crc32(a, len));
+	    }
+#endif
+	  CHECK(hash_name_scalar(b, len) == hash_name_scalar(a, len));
+
+	  // Equal, then one byte different at each position
+	  for (size_t diff = 0; diff <= len; diff++)
+	    {
+	      if (diff < len) b[diff] ^= 0x20;
+	      int want = names_equal_scalar(a, b, len);
+	      CHECK(want == (diff == len));
+	      for (int v = 1; v < variants; v++)
+		{
+		  CHECK(equals[v](a, b, len) == want);
+		}
+	      if (diff < len) b[diff] ^= 0x20;
+	    }
+	}
+    }
+  munmap(map, 4 * page);
+}
+
+size_t free_chunk_count(void)
+{
+  size_t n = 0;
+  for (struct out_chunk *t = free_chunks; t; t = t->next) n++;
+  return n;
+}
+
+// Bytes in a socket pair waiting to be read at fd
+size_t unread(int fd)
+{
+  int n = 0;
+  ioctl(fd, FIONREAD, &n);
+  return (size_t)n;
+}
+
+// Bytes queued in pieces that straddle chunks come out in order and
+// whole, however the socket splits the writes, and their chunks go back
+// on the free list for the next queue to reuse
+void test_output_partial_writes(void)
+{
+  enum { TOTAL = 3 * OUT_IOV_MAX * OUT_CHUNK_SIZE + 123 };
+  enum { CHUNKS = (TOTAL + OUT_CHUNK_SIZE - 1) / OUT_CHUNK_SIZE };
+  static uint8_t sent[TOTAL], got[TOTAL];
+  int sv[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  int sndbuf;
+
+  reset_state();
+  struct conn *c = calloc(1, sizeof(*c));
+  conns[sv[0]] = c;
+  for (size_t i = 0; i < TOTAL; i++)
+    {
+      sent[i] = (uint8_t)(i * 131 + (i >> 12));
+    }
+  for (int round = 0; round < 2; round++)
+    {
+      size_t free_start = free_chunk_count();
+      size_t queued = 0, piece = 1;
+      while (queued < TOTAL)
+	{
+	  size_t n = piece < TOTAL - queued ? piece : TOTAL - queued;
+	  CHECK(queue_output(sv[0], sent + queued, n) == 0);
+	  queued += n;
+	  piece = piece * 3 + 7;
+	  if (piece > 3 * OUT_CHUNK_SIZE) piece = 1;
+	}
+      CHECK(c->out_bytes == TOTAL);
+      CHECK(c->dirty && dirty_count == 1 && dirty_fds[0] == sv[0]);
+      // What the free list holds is used before anything is allocated
+      CHECK(free_chunk_count() == (free_start > CHUNKS ? free_start - CHUNKS : 0));
+
+      // Read a little at a time, so each flush finds room for only part
+      // of what's queued. A stream socket pair takes writes in pieces of
+      // half its buffer; changing the buffer's size varies them.
+      size_t received = 0;
+      int short_flushes = 0;
+      for (int i = 0; i < 1000000 && received < TOTAL; i++)
+	{
+	  sndbuf = 2400 + (i * 397) % 4000;
+	  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	  CHECK(flush_output(sv[0], c) == 0);
+	  if (c->out_head)
+	    {
+	      short_flushes++;
+	      CHECK(c->out_head->start < c->out_head->end);
+	    }
+	  CHECK(c->out_bytes + unread(sv[1]) + received == TOTAL);
+	  ssize_t n = recv(sv[1], got + received, 1000, MSG_DONTWAIT);
+	  if (n > 0) received += (size_t)n;
+	}
+      CHECK(received == TOTAL && memcmp(got, sent, TOTAL) == 0);
+      CHECK(short_flushes > 0);
+      CHECK(c->out_bytes == 0 && !c->out_head && !c->out_tail);
+      CHECK(free_chunk_count() == (free_start > CHUNKS ? free_start : CHUNKS));
+      c->dirty = 0;
+      dirty_count = 0;
+    }
+
+  // With room for it all, one flush sends more than one sendmsg() can
+  sndbuf = 4 * TOTAL;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  CHECK(queue_output(sv[0], sent, TOTAL) == 0);
+  CHECK(flush_output(sv[0], c) == 0);
+  CHECK(unread(sv[1]) + c->out_bytes == TOTAL);
+  CHECK(unread(sv[1]) > OUT_IOV_MAX * OUT_CHUNK_SIZE);
+  discard_output(c);
+  CHECK(free_chunk_count() >= CHUNKS);
+
+  close(sv[0]);
+  close(sv[1]);
+  conns[sv[0]] = NULL;
+  free(c);
+  reset_state();
+}
+
+void set_shards(int count)
+{
+  shard_count = count;
+  for (int k = 0; k < count; k++)
+    {
+      shards[k].addr.sin_family = AF_INET;
+      shards[k].addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      shards[k].addr.sin_port = htons((uint16_t)(9000 + k));
+    }
+  build_ring();
+}
+
+// Adding a shard only moves names to it, and about its share of them
+void test_ring_add_shard(void)
+{
+  enum { NAMES = 20000 };
+  static int owner[NAMES];
+  char name[32];
+
+  reset_state();
+  CHECK(owner_of((const uint8_t*)"x", 1) == self_shard);
+
+  set_shards(4);
+  CHECK(ring_len == 4 * VNODES_PER_SHARD);
+  int per_shard[MAX_SHARDS] = { 0 };
+  for (int i = 0; i < NAMES; i++)
+    {
+      int len = snprintf(name, sizeof(name), "file-%d.bin", i);
+      owner[i] = owner_of((const uint8_t*)name, (size_t)len);
+      CHECK(owner[i] >= 0 && owner[i] < 4);
+      if (owner[i] >= 0 && owner[i] < 4) per_shard[owner[i]]++;
+    }
+  for (int k = 0; k < 4; k++)
+    {
+      CHECK(per_shard[k] > NAMES / 4 / 2);  // no shard starved
+    }
+
+  // The same addresses give the same ring
+  set_shards(4);
+  for (int i = 0; i < NAMES; i++)
+    {
+      int len = snprintf(name, sizeof(name), "file-%d.bin", i);
+      CHECK(owner_of((const uint8_t*)name, (size_t)len) == owner[i]);
+    }
+
+  set_shards(5);
+  int moved = 0;
+  for (int i = 0; i < NAMES; i++)
+    {
+      int len = snprintf(name, sizeof(name), "file-%d.bin", i);
+      int now = owner_of((const uint8_t*)name, (size_t)len);
+      CHECK(now == owner[i] || now == 4);
+      moved += now != owner[i];
+    }
+  // The new shard's share is a fifth; allow for vnode placement
+  CHECK(moved > NAMES / 10 && moved < NAMES * 3 / 10);
+  reset_state();
+}
+
+// Stands in for a content digest
+uint64_t digest_of(const char *name)
+{
+  return (uint64_t)hash_name_scalar((const uint8_t*)name, strlen(name)) << 8 | 1;
+}
+
+// PUBLISH ATTRS of names for a peer, each with a digest made from its
+// name, as handle_publish() parses it
+void publish(struct peer_entry *peer, const char *const *names, int count)
+{
+  uint8_t msg[MAX_FILES * (P2P_ATTRS_LEN + MAX_FILENAME_LEN)];
+  int len = 0;
+  for (int i = 0; i < count; i++)
+    {
+      struct p2p_file_attrs attrs = { 100 + i, 1000, digest_of(names[i]) };
+      p2p_encode_attrs(msg + len, &attrs);
+      len += P2P_ATTRS_LEN;
+      memcpy(msg + len, names[i], strlen(names[i]) + 1);
+      len += (int)strlen(names[i]) + 1;
+    }
+  CHECK(parse_names(peer, msg, len, 0, (uint32_t)count, 1) == count);
+}
+
+// Wait for the merge in flight and swap it in
+void land_merge(void)
+{
+  struct pollfd pfd = { .fd = merge_event_fd, .events = POLLIN };
+  CHECK(merging && poll(&pfd, 1, 5000) == 1);
+  finish_merge();
+}
+
+// Id of the peer SEARCH finds name at, or 0
+uint32_t holder_of(const char *name)
+{
+  size_t len = strlen(name);
+  uint32_t hash = hash_name((const uint8_t*)name, len);
+  struct peer_entry *p = find_holder((const uint8_t*)name, len, hash,
+				     lookup_name((const uint8_t*)name, len, hash),
+				     &no_filter, NULL);
+  return p ? p->id : 0;
+}
+
+// Id of the peer SEARCH FILTER by content finds name's digest at, or 0
+uint32_t holder_of_digest(const char *name)
+{
+  struct p2p_search_filter filter = { .flags = P2P_FILTER_DIGEST,
+				      .digest = digest_of(name) };
+  struct peer_entry *p = find_holder((const uint8_t*)"", 0, 0, -1, &filter, NULL);
+  return p ? p->id : 0;
+}
+
+// SEARCH gives the same answers from the snapshot, the delta, or both,
+// as peers publish, re-publish without a file, leave and join
+void test_catalog_merge(void)
+{
+  const char *a[] = { "alpha", "shared" };
+  const char *a2[] = { "alpha2", "shared" };
+  const char *b[] = { "beta", "shared" };
+  const char *b2[] = { "beta", "gamma" };
+  reset_state();
+  catalog_reset();
+  catalog_init();
+  CHECK(merge_event_fd >= 0);
+
+  publish(add_peer(1, NULL, 0), a, 2);
+  publish(add_peer(2, NULL, 0), b, 2);
+  CHECK(delta_count == 2 && !catalog);
+  CHECK(holder_of("alpha") == 1 && holder_of("beta") == 2);
+  start_merge();
+  land_merge();
+  CHECK(catalog && catalog->count == 4 && delta_count == 0);
+  CHECK(holder_of("alpha") == 1 && holder_of("beta") == 2);
+  CHECK(holder_of("shared") == 1 || holder_of("shared") == 2);
+  CHECK(holder_of_digest("alpha") == 1 && holder_of_digest("beta") == 2);
+
+  // Re-publishing without alpha hides the snapshot's record of it at
+  // once, and the next snapshot leaves it out
+  publish(&peers[0], a2, 2);
+  CHECK(delta_count == 1);
+  CHECK(holder_of("alpha") == 0 && holder_of_digest("alpha") == 0);
+  CHECK(holder_of("alpha2") == 1 && holder_of_digest("alpha2") == 1);
+  start_merge();
+  land_merge();
+  CHECK(catalog->count == 4 && delta_count == 0);
+  CHECK(holder_of("alpha") == 0 && holder_of_digest("alpha") == 0);
+  CHECK(holder_of("alpha2") == 1 && holder_of("beta") == 2);
+
+  // Peer 1 leaves and peer 2 moves into its entry. A new peer then takes
+  // entry 1, where the snapshot still has peer 2's records; it would win
+  // any tie on load, but must not be taken for their holder.
+  remove_entry(0);
+  CHECK(peers[0].id == 2);
+  struct peer_entry *late = add_peer(3, NULL, 0);
+  catalog_touch((int)(late - peers));
+  CHECK(late == &peers[1]);
+  peers[0].load = 5;
+  CHECK(holder_of("alpha2") == 0 && holder_of("shared") == 2 && holder_of("beta") == 2);
+  CHECK(holder_of_digest("beta") == 2);
+  start_merge();
+  land_merge();
+  CHECK(catalog->count == 2 && delta_count == 0);
+  CHECK(holder_of("alpha2") == 0 && holder_of("shared") == 2 && holder_of("beta") == 2);
+
+  // A PUBLISH while the builder works stays in the delta after the swap
+  publish(&peers[0], b2, 2);
+  start_merge();
+  publish(&peers[0], b, 2);
+  land_merge();
+  CHECK(delta_count == 1 && delta[0] == 0);
+  CHECK(holder_of("gamma") == 0 && holder_of("shared") == 2);
+  start_merge();
+  land_merge();
+  CHECK(catalog->count == 2 && delta_count == 0);
+  CHECK(holder_of("gamma") == 0 && holder_of("shared") == 2 && holder_of("beta") == 2);
+
+  catalog_reset();
+  catalog_stop();
+  reset_state();
+}
+
+// Connections admit() takes from ip at now before it refuses one
+int admits_until_refused(uint32_t ip, double now)
+{
+  int n = 0;
+  while (n < 10000 && admit(ip, now)) n++;
+  return n;
+}
+
+// Each source gets a burst, then admit_rate a second; sources are
+// independent, and a full table forgets the stalest
+void test_admit(void)
+{
+  double saved_rate = admit_rate;
+  int saved_peers = max_local_peers;
+  uint32_t ip = htonl(0x0a000001), other = htonl(0x0a000002);
+  reset_state();
+
+  // The burst is twice the rate, or max_local_peers if that's more
+  admit_rate = 20;
+  max_local_peers = 5;
+  CHECK(admits_until_refused(ip, 100.0) == 40);
+  CHECK(admits_until_refused(other, 100.0) == 40);
+  CHECK(admits_until_refused(ip, 100.5) == 10);
+  CHECK(admits_until_refused(ip, 100.5) == 0);
+  CHECK(admits_until_refused(ip, 1000.0) == 40);  // idle refills to the burst, no more
+  reset_state();
+  max_local_peers = 100;
+  CHECK(admits_until_refused(ip, 100.0) == 100);
+  CHECK(admits_until_refused(ip, 101.0) == 20);
+
+  // Nine sources probing the same slots: the ninth takes the place of
+  // the one seen longest ago and starts with a full burst, while the
+  // others keep their state
+  reset_state();
+  max_local_peers = 5;
+  uint32_t same[9];
+  uint32_t home = (ip * 2654435761u) & (ADMIT_TABLE_SIZE - 1);
+  int found = 0;
+  for (uint32_t cand = 1; found < 9; cand++)
+    {
+      if (((cand * 2654435761u) & (ADMIT_TABLE_SIZE - 1)) == home) same[found++] = cand;
+    }
+  for (int i = 0; i < 8; i++)
+    {
+      CHECK(admits_until_refused(same[i], 100.0 + i) == 40);
+    }
+  CHECK(admits_until_refused(same[0], 107.5) == 40);  // same[1] is now the stalest
+  CHECK(admits_until_refused(same[8], 108.0) == 40);
+  CHECK(admits_until_refused(same[0], 108.0) == 10);
+  for (int i = 2; i < 8; i++)
+    {
+      int refilled = 20 * (8 - i);
+      CHECK(admits_until_refused(same[i], 108.0) == (refilled < 40 ? refilled : 40));
+    }
+  CHECK(admits_until_refused(same[1], 108.0) == 40);  // forgotten, so new again
+
+  // A rate of 0 turns admission control off
+  admit_rate = 0;
+  CHECK(admits_until_refused(ip, 100.0) == 10000);
+
+  admit_rate = saved_rate;
+  max_local_peers = saved_peers;
+  reset_state();
+}
+
+// An open refused for its shard options leaves nothing running, and the
+// next open starts clean
+void test_open_failures(void)
+{
+  const char *good[] = { "127.0.0.1:1", "127.0.0.1:2" };
+  const char *bad[] = { "127.0.0.1:1", "no-port" };
+  struct p2p_registry_options opts;
+  p2p_registry_default_options(&opts);
+  opts.quiet = 1;
+  opts.shard_count = 2;
+  opts.shards = good;
+
+  opts.self_shard = 2;
+  CHECK(p2p_registry_open(&opts) == -1);
+  CHECK(merge_event_fd < 0 && epoll_fd < 0 && shard_count == 0);
+
+  opts.self_shard = 0;
+  opts.shards = bad;
+  CHECK(p2p_registry_open(&opts) == -1);
+  CHECK(merge_event_fd < 0 && epoll_fd < 0 && listen_fd < 0 && shard_count == 0);
+
+  opts.shards = good;
+  CHECK(p2p_registry_open(&opts) > 0);
+  CHECK(merge_event_fd >= 0 && shard_count == 2);
+  close_all();
+  CHECK(merge_event_fd < 0 && epoll_fd < 0 && shard_count == 0);
+}
+
+int main(void)
+{
+  test_output = 0;
+  init_simd();
+  test_intern_after_remove();
+  test_simd_matches_scalar();
+  test_ring_add_shard();
+  test_output_partial_writes();
+  test_catalog_merge();
+  test_admit();
+  test_open_failures();
+  if (failures)
+    {
+      fprintf(stderr, "registrytest: %d check(s) failed\n", failures);
+      return 1;
+    }
+  printf("registrytest: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,219 @@
+// searchbench.c
+// Allocations and cycles per SEARCH in the registry's steady state:
+//   searchbench [searches]
+// The registry runs in this process (p2p_registry.h) and a client on
+// one connection JOINs, PUBLISHes MAX_FILES names and then sends the
+// SEARCHes in pipelined batches, mixing hits with a miss. Every malloc
+// in the process is counted; after a warm-up pass has filled the
+// registry's pools, a SEARCH that allocates fails the run.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "p2p_io.h"
+#include "p2p_proto.h"
+#include "p2p_registry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define NAMES 10        // the registry keeps this many per peer
+#define BATCH 64        // SEARCHes per write
+#define WARMUP 10000
+
+// ---- Counting allocator ----
+//
+// glibc's own entry points, so these replace malloc for the whole
+// process, the registry thread and libc's internal callers included.
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(p, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  void *p = __libc_memalign(align, size);
+  if (!p) return ENOMEM;
+  *out = p;
+  return 0;
+}
+
+unsigned long allocations_now(void)
+{
+  return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+// ---- Client ----
+
+void* run_registry(void *arg)
+{
+  (void)arg;
+  if (p2p_registry_run() < 0)
+    {
+      fprintf(stderr, "searchbench: registry failed\n");
+      exit(1);
+    }
+  return NULL;
+}
+
+// One batch of SEARCHes, for the (i % (NAMES + 1))th name each, where
+// the last is never published. Returns how many answers were wrong,
+// -1 on error.
+int search_batch(int fd, long first)
+{
+  static uint8_t req[BATCH * 16], reply[BATCH * P2P_SEARCH_REPLY_LEN];
+  size_t len = 0;
+  for (int i = 0; i < BATCH; i++)
+    {
+      char name[16];
+      long k = (first + i) % (NAMES + 1);
+      snprintf(name, sizeof(name), k < NAMES ? "file%ld" : "missing", k);
+      len += p2p_encode_request(req + len, sizeof(req) - len, P2P_MSG_SEARCH, name);
+    }
+  if (p2p_send_all(fd, req, len) < 0 || p2p_recv_all(fd, reply, sizeof(reply)) < 0)
+    {
+      return -1;
+    }
+
+  int wrong = 0;
+  for (int i = 0; i < BATCH; i++)
+    {
+      struct p2p_location loc;
+      p2p_decode_location(reply + i * P2P_SEARCH_REPLY_LEN, &loc);
+      wrong += p2p_location_found(&loc) != ((first + i) % (NAMES + 1) < NAMES);
+    }
+  return wrong;
+}
+
+int main(int argc, char *argv[])
+{
+  long searches = argc > 1 ? atol(argv[1]) : 1000000;
+  if (argc > 2 || searches < BATCH)
+    {
+      fprintf(stderr, "usage: %s [searches (at least %d)]\n", argv[0], BATCH);
+      return 2;
+    }
+  searches -= searches % BATCH;
+
+  struct p2p_registry_options opts;
+  p2p_registry_default_options(&opts);
+  opts.quiet = 1;
+  int port = p2p_registry_open(&opts);
+  if (port < 0) return 1;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, run_registry, NULL) != 0)
+    {
+      fprintf(stderr, "searchbench: can't start the registry\n");
+      return 1;
+    }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+      perror("connect");
+      return 1;
+    }
+
+  // JOIN and PUBLISH file0..file9
+  uint8_t msg[5 + NAMES * 16];
+  size_t len = p2p_encode_join(msg, 1);
+  if (p2p_send_all(fd, msg, len) < 0) return 1;
+  uint32_t count_net = htonl(NAMES);
+  msg[0] = P2P_MSG_PUBLISH;
+  memcpy(msg + 1, &count_net, 4);
+  len = 5;
+  for (int i = 0; i < NAMES; i++)
+    {
+      len += sprintf((char*)msg + len, "file%d", i) + 1;
+    }
+  if (p2p_send_all(fd, msg, len) < 0) return 1;
+
+  // PUBLISH has no reply: warm up until every name is found, the
+  // catalog snapshot has been built and the reply pool is filled
+  long done = 0;
+  int wrong;
+  double deadline = p2p_monotonic_secs() + 10;
+  do
+    {
+      wrong = search_batch(fd, done);
+      done += BATCH;
+    }
+  while ((wrong > 0 && p2p_monotonic_secs() < deadline) || (wrong == 0 && done < WARMUP));
+  usleep(100000);  // let the catalog builder finish its last merge
+
+  unsigned long before = allocations_now();
+  double start = p2p_monotonic_secs();
+#ifdef HAVE_TSC
+  uint64_t tsc = __rdtsc();
+#endif
+  for (long i = 0; i < searches && wrong == 0; i += BATCH)
+    {
+      wrong = search_batch(fd, done + i);
+    }
+#ifdef HAVE_TSC
+  tsc = __rdtsc() - tsc;
+#endif
+  double secs = p2p_monotonic_secs() - start;
+  unsigned long allocated = allocations_now() - before;
+  if (wrong != 0)
+    {
+      fprintf(stderr, "searchbench: %s\n",
+	      wrong < 0 ? "lost the registry connection" : "wrong SEARCH reply");
+      return 1;
+    }
+
+  printf("SEARCH: %ld in %.3f s, %.0f ns each", searches, secs, secs * 1e9 / searches);
+#ifdef HAVE_TSC
+  printf(", %.0f cycles each", (double)tsc / searches);
+#endif
+  printf(" (round trip, batches of %d)\n", BATCH);
+  printf("allocations: %lu, %.4f per SEARCH\n", allocated, (double)allocated / searches);
+
+  close(fd);
+  p2p_registry_stop();
+  pthread_join(tid, NULL);
+
+  if (allocated != 0)
+    {
+      fprintf(stderr, "searchbench: steady-state SEARCH allocated\n");
+      return 1;
+    }
+  return 0;
+}